@@ -0,0 +1,37 @@
+#pragma once
+#include <istream>
+#include <ostream>
+#include <type_traits>
+
+/**
+ * @brief Write the bytes of a trivially copyable value, in the machine's byte order.
+ */
+template <typename T>
+void writeBinary(std::ostream& stream, const T& value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+/**
+ * @brief Write `count` trivially copyable values stored one after the other.
+ */
+template <typename T>
+void writeBinary(std::ostream& stream, const T* values, std::size_t count) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  stream.write(reinterpret_cast<const char*>(values), static_cast<std::streamsize>(sizeof(T) * count));
+}
+
+/**
+ * @brief Read what writeBinary wrote, check the stream afterwards.
+ */
+template <typename T>
+void readBinary(std::istream& stream, T& value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  stream.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+template <typename T>
+void readBinary(std::istream& stream, T* values, std::size_t count) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  stream.read(reinterpret_cast<char*>(values), static_cast<std::streamsize>(sizeof(T) * count));
+}
@@ -1,8 +1,10 @@
 #pragma once
+#include <cstdint>
 #include <vector>
 
 #include <glad/gl.h>
 
+#include "bufferring.h"
 #include "utils.h"
 
 class Buffer {
@@ -46,6 +48,29 @@ class Buffer {
    * @param usage One of the buffer usage macro. GL_[STATIC/DYNAMIC/STREAM]_[READ/COPY/DRAW]
    */
   void allocate_load(GLsizeiptr _size, const void* data, GLenum usage = GL_STATIC_DRAW) const noexcept;
+  /**
+   * @brief Allocate a ring of regions for data that changes once per frame, see BufferRing.
+   * The storage is mapped once and stays mapped when the context has buffer storage (GL 4.4), otherwise each region
+   * is mapped unsynchronized when it is written. Either way a region is only rewritten after the GPU is done with it,
+   * so writes never stall on draws still in flight. May replace the handle, attribute pointers must be set again.
+   *
+   * @param regionSize Size of the data of one frame in bytes.
+   * @param regionCount Number of regions.
+   */
+  void allocateRing(GLsizeiptr regionSize, int regionCount = BufferRing::defaultRegionCount);
+  /**
+   * @brief Write the data of `frame` into the next region of the ring, unless the current region already holds it.
+   *
+   * @param frame Identifies the data, e.g. the frame of a simulation snapshot.
+   * @param _size The size of the data in bytes, at most the region size.
+   * @param data Pointer to the data to be loaded.
+   * @return Whether the data was written.
+   */
+  bool loadRing(std::uint64_t frame, GLsizeiptr _size, const void* data);
+  /**
+   * @brief Byte offset of the region holding the last frame written by loadRing.
+   */
+  GLintptr ringOffset() const noexcept { return static_cast<GLintptr>(_ring.currentOffset()); }
   /**
    * @brief Get the type string
    *
@@ -72,8 +97,16 @@ class Buffer {
   GLsizeiptr size() const noexcept { return _size; }
 
  protected:
+  /// @brief Delete the fences of the ring regions
+  void releaseRing() noexcept;
+
   GLuint _handle;
   mutable GLsizeiptr _size;
+  BufferRing _ring;
+  // One fence per ring region, set when it was retired and not waited for yet
+  std::vector<GLsync> _fences;
+  // Persistent mapping of the whole ring, null when regions are mapped one at a time
+  void* _mapping = nullptr;
 };
 
 class ArrayBuffer final : public Buffer {
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Bookkeeping of a buffer split into regions that are written in turn, one region per frame.
+ * A new frame always goes to the region after the current one, so it never overwrites data the GPU may still be
+ * drawing from. The region that stops being current is retired: its owner fences it, and waits for that fence before
+ * the region comes around again. A frame that is already current is not written again, so any number of draws share one
+ * upload. Holds no OpenGL state, see Buffer::allocateRing for that part.
+ */
+class BufferRing final {
+ public:
+  static constexpr int defaultRegionCount = 3;
+  /**
+   * @brief Start over with `regionCount` empty regions of at least `regionSize` bytes.
+   *
+   * @param regionSize Bytes per region, rounded up to a multiple of `alignment`.
+   * @param regionCount Number of regions, 3 lets the CPU write one while the GPU reads another and a third is queued.
+   * @param alignment Offset alignment of the regions in bytes, a power of two.
+   */
+  void reset(std::ptrdiff_t regionSize, int regionCount = defaultRegionCount, std::ptrdiff_t alignment = 256) {
+    _regionSize = (regionSize + alignment - 1) & ~(alignment - 1);
+    _regionCount = regionCount;
+    _current = 0;
+    _retired = -1;
+    _hasFrame = false;
+  }
+  /**
+   * @brief Whether `frame` differs from the frame in the current region, i.e. whether it must be written.
+   */
+  bool isStale(std::uint64_t frame) const { return !_hasFrame || frame != _frame; }
+  /**
+   * @brief Make the next region current for writing `frame` and retire the previous one.
+   * Before the first frame, region 0 is used and nothing is retired.
+   *
+   * @return The region to write.
+   */
+  int advance(std::uint64_t frame) {
+    if (_hasFrame) {
+      _retired = _current;
+      _current = (_current + 1) % _regionCount;
+    }
+    _frame = frame;
+    _hasFrame = true;
+    return _current;
+  }
+  /**
+   * @brief Region to draw from, the one written last.
+   */
+  int current() const { return _current; }
+  /**
+   * @brief Region retired by the last advance, -1 when none was.
+   */
+  int retired() const { return _retired; }
+  std::uint64_t frame() const { return _frame; }
+  int regionCount() const { return _regionCount; }
+  std::ptrdiff_t regionSize() const { return _regionSize; }
+  std::ptrdiff_t totalSize() const { return _regionSize * _regionCount; }
+  // Byte offset of a region in the buffer
+  std::ptrdiff_t offset(int region) const { return _regionSize * region; }
+  std::ptrdiff_t currentOffset() const { return offset(_current); }
+
+ private:
+  std::ptrdiff_t _regionSize = 0;
+  int _regionCount = 0;
+  int _current = 0;
+  int _retired = -1;
+  std::uint64_t _frame = 0;
+  bool _hasFrame = false;
+};
@@ -0,0 +1,142 @@
+#pragma once
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <vector>
+
+/**
+ * @brief Bounding volume hierarchy over a triangle mesh whose topology never changes.
+ * The tree is built once and only refit when the vertices move, which keeps working for cloth because triangles
+ * that are close on the mesh stay close in space.
+ */
+class TriangleBVH {
+ public:
+  /// @brief Most triangles in a leaf
+  static constexpr int leafSize = 8;
+  /**
+   * @brief Build the tree by median splits along the longest axis.
+   *
+   * @param triangles Vertex indices, 3 per triangle.
+   * @param positions Vertex positions, one per column.
+   */
+  void build(const std::vector<unsigned int>& triangles, const Eigen::Ref<const Eigen::Matrix4Xf>& positions);
+  /**
+   * @brief Recompute every bounding box for the new vertex positions, bottom up.
+   *
+   * @param positions Vertex positions, one per column.
+   */
+  void refit(const Eigen::Ref<const Eigen::Matrix4Xf>& positions);
+  /**
+   * @brief Call visit(a, b, c) with the vertex indices of every triangle whose bounding box overlaps the box.
+   */
+  template <typename Visitor>
+  void query(const Eigen::AlignedBox3f& box, Visitor&& visit) const;
+  /**
+   * @brief Number of leaves, the unit of work of queryVertices.
+   */
+  int leafCount() const { return static_cast<int>(_leaves.size()); }
+  /**
+   * @brief Call visit(vertex, a, b, c) for every vertex owned by leaves [beginLeaf, endLeaf) and every triangle
+   * whose bounding box is within `margin` of it. Each vertex of a triangle is owned by exactly one leaf, so
+   * disjoint leaf ranges can run in parallel. One tree walk serves all vertices of a leaf.
+   *
+   * @param positions Vertex positions, the same ones as the last refit.
+   */
+  template <typename Visitor>
+  void queryVertices(int beginLeaf,
+                     int endLeaf,
+                     float margin,
+                     const Eigen::Ref<const Eigen::Matrix4Xf>& positions,
+                     Visitor&& visit) const;
+
+ private:
+  struct Node {
+    Eigen::AlignedBox3f box;
+    // Leaves own triangles [firstTriangle, firstTriangle + triangleCount), inner nodes have triangleCount 0 and
+    // children firstChild and firstChild + 1.
+    int firstChild;
+    int firstTriangle;
+    int triangleCount;
+  };
+  /// @brief Whether two boxes overlap, boxes that only touch count as overlapping
+  static bool overlaps(const Eigen::AlignedBox3f& a, const Eigen::AlignedBox3f& b);
+  /// @brief Split `order` [begin, end) into the subtree of _nodes[node]
+  void buildNode(int node, int begin, int end, std::vector<int>& order, const Eigen::Matrix3Xf& centroids);
+  /// @brief Call visit(t) for every triangle t in _triangles whose bounding box overlaps the box
+  template <typename Visitor>
+  void traverse(const Eigen::AlignedBox3f& box, Visitor&& visit) const;
+
+  // Parents come before their children, so refit walks the nodes backwards.
+  std::vector<Node> _nodes;
+  // Triangles reordered so that every leaf is contiguous
+  std::vector<unsigned int> _triangles;
+  // Bounding box of every triangle in _triangles, updated by refit
+  std::vector<Eigen::AlignedBox3f> _triangleBoxes;
+  // Node index of every leaf, leaf l owns vertices [_ownedVertexStart[l], _ownedVertexStart[l + 1]).
+  std::vector<int> _leaves;
+  std::vector<int> _ownedVertexStart;
+  std::vector<int> _ownedVertices;
+};
+
+inline bool TriangleBVH::overlaps(const Eigen::AlignedBox3f& a, const Eigen::AlignedBox3f& b) {
+  return a.min().x() <= b.max().x() && b.min().x() <= a.max().x() && a.min().y() <= b.max().y() &&
+         b.min().y() <= a.max().y() && a.min().z() <= b.max().z() && b.min().z() <= a.max().z();
+}
+
+template <typename Visitor>
+void TriangleBVH::traverse(const Eigen::AlignedBox3f& box, Visitor&& visit) const {
+  if (_nodes.empty() || !overlaps(_nodes[0].box, box)) return;
+  // Median splits keep the depth near log2 of the leaf count, far below the stack size
+  int stack[64];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    // Nodes on the stack already overlap the box
+    const Node& node = _nodes[stack[--top]];
+    if (node.triangleCount == 0) {
+      if (overlaps(_nodes[node.firstChild].box, box)) stack[top++] = node.firstChild;
+      if (overlaps(_nodes[node.firstChild + 1].box, box)) stack[top++] = node.firstChild + 1;
+      continue;
+    }
+    for (int t = node.firstTriangle; t < node.firstTriangle + node.triangleCount; ++t) {
+      if (overlaps(_triangleBoxes[t], box)) visit(t);
+    }
+  }
+}
+
+template <typename Visitor>
+void TriangleBVH::query(const Eigen::AlignedBox3f& box, Visitor&& visit) const {
+  traverse(box, [&](int t) { visit(_triangles[3 * t], _triangles[3 * t + 1], _triangles[3 * t + 2]); });
+}
+
+template <typename Visitor>
+void TriangleBVH::queryVertices(int beginLeaf,
+                                int endLeaf,
+                                float margin,
+                                const Eigen::Ref<const Eigen::Matrix4Xf>& positions,
+                                Visitor&& visit) const {
+  // Owned vertices of one leaf, copied out once for all candidate triangles
+  Eigen::Vector3f owned[3 * leafSize];
+  for (int leaf = beginLeaf; leaf < endLeaf; ++leaf) {
+    const int first = _ownedVertexStart[leaf];
+    const int count = _ownedVertexStart[leaf + 1] - first;
+    if (count == 0) continue;
+    Eigen::AlignedBox3f box;
+    for (int i = 0; i < count; ++i) {
+      owned[i] = positions.col(_ownedVertices[first + i]).template head<3>();
+      box.extend(owned[i]);
+    }
+    box.min().array() -= margin;
+    box.max().array() += margin;
+    traverse(box, [&](int t) {
+      const Eigen::Vector3f lower = _triangleBoxes[t].min().array() - margin;
+      const Eigen::Vector3f upper = _triangleBoxes[t].max().array() + margin;
+      for (int i = 0; i < count; ++i) {
+        const Eigen::Vector3f& x = owned[i];
+        // Bitwise and, most vertices fail and the branches would not predict well
+        bool isNear = (lower.x() <= x.x()) & (x.x() <= upper.x()) & (lower.y() <= x.y()) & (x.y() <= upper.y()) &
+                      (lower.z() <= x.z()) & (x.z() <= upper.z());
+        if (isNear) visit(_ownedVertices[first + i], _triangles[3 * t], _triangles[3 * t + 1], _triangles[3 * t + 2]);
+      }
+    });
+  }
+}
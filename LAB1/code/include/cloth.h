@@ -1,40 +1,141 @@
 #pragma once
-#include <glad/gl.h>
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
 #include <vector>
 
-#include "buffer.h"
+#include "bvh.h"
+#include "configs.h"
 #include "shape.h"
 #include "spring.h"
+#include "springkernel.h"
 #include "utils.h"
+// The headless build (HW1Benchmark) only needs the simulation part of the cloth.
+#ifndef HW1_HEADLESS
+#include <glad/gl.h>
+
+#include "buffer.h"
 #include "vertexarray.h"
+#endif
 
 class Cloth final : public Shape {
  public:
   MOVE_ONLY(Cloth)
   enum class DrawType { FULL, STRUCTURAL, SHEAR, BEND, PARTICLE };
-  Cloth();
+  /**
+   * @brief Layout of the particles in memory.
+   * GRID stores them row by row. MORTON stores them along a Z-order curve over the grid, so the particles a spring
+   * connects are close in memory in both directions, and sorts the springs by their first particle.
+   */
+  enum class ParticleOrder { GRID, MORTON };
+  /**
+   * @brief Construct a square cloth.
+   *
+   * @param particlesPerEdge Number of particles along each edge, at least 3 so that bend springs exist.
+   * @param order Layout of the particles, every index the cloth hands out (springs, triangles, corners) follows it.
+   */
+  explicit Cloth(int particlesPerEdge = defaultParticlesPerEdge, ParticleOrder order = ParticleOrder::GRID);
+  /**
+   * @brief Get the number of particles along each edge.
+   *
+   */
+  int particlesPerEdge() const { return _particlesPerEdge; }
+  ParticleOrder particleOrder() const { return _order; }
+  /**
+   * @brief Get the index of the particle at row `row` and column `column` of the grid.
+   */
+  int particleIndex(int row, int column) const { return _gridToParticle[row * _particlesPerEdge + column]; }
+  /**
+   * @brief Get the particle index of a corner.
+   *
+   * @param corner 0 to 3, ordered as top-left, top-right, bottom-left, bottom-right.
+   */
+  int cornerIndex(int corner) const;
   /**
    * @brief Get the springs.
    *
    */
   std::vector<Spring>& springs() { return _springs; }
   /**
-   * @brief Render the cloth based on the given type.
+   * @brief Set the stiffness and damping of a spring relative to springCoef and damperCoef, both 1 by default.
+   * They are multiplied by the factors of the spring's type in springTypeScale and damperTypeScale, e.g. softer
+   * structural springs along the columns than along the rows make the weft of the fabric stretch more than its warp.
+   */
+  void setSpringMaterial(int spring, float stiffness, float damping);
+  /**
+   * @brief Combine the factors of each spring with the ones of its type into the scales below, when either changed.
+   * computeSpringForce calls it, so does everything that reads the scales without it.
+   */
+  void updateMaterial();
+  /**
+   * @brief Get the stiffness and damping of each spring relative to springCoef and damperCoef, as of the last
+   * updateMaterial(). Spring i has the stiffness springCoef * stiffnessScales()[i].
+   */
+  const std::vector<float>& stiffnessScales() const { return _stiffnessScales; }
+  const std::vector<float>& dampingScales() const { return _dampingScales; }
+  /**
+   * @brief Get a count that changes whenever updateMaterial() changes the scales.
+   */
+  std::uint64_t materialRevision() const { return _materialRevision; }
+  // Kernel computeSpringForce uses with `isVectorized`
+  const SpringKernel& springKernel() const { return _springKernel; }
+  /**
+   * @brief Get the spring indices sorted by color, springs of the same color never share a particle.
+   * Color c owns [springColorOffsets()[c], springColorOffsets()[c + 1]).
+   */
+  const std::vector<int>& coloredSprings() const { return _coloredSprings; }
+  const std::vector<int>& springColorOffsets() const { return _springColorOffsets; }
+  // One spring attached to a particle, `sign` is -1 when the particle is its start and 1 when it is its end
+  struct AdjacentSpring {
+    int spring;
+    float sign;
+  };
+  /**
+   * @brief Get the springs attached to each particle in compressed sparse row form.
+   * Particle i owns [adjacencyOffsets()[i], adjacencyOffsets()[i + 1]) of adjacentSprings(), in spring order.
+   */
+  const std::vector<int>& adjacencyOffsets() const { return _adjacencyOffsets; }
+  const std::vector<AdjacentSpring>& adjacentSprings() const { return _adjacentSprings; }
+  /**
+   * @brief Get the current length of the longest structural or shear spring, i.e. of the longest triangle edge.
+   *
+   */
+  float longestEdge();
+  float longestRestEdge() const { return _longestRestEdge; }
+#ifndef HW1_HEADLESS
+  /**
+   * @brief Upload the particle positions for the following draws, once per frame.
+   * Returns at once when `frame` is already uploaded, e.g. while paused. See Buffer::loadRing.
+   *
+   * @param positions Particle positions to be drawn, e.g. a snapshot taken by the simulation thread.
+   * @param frame Identifies the positions.
+   */
+  void upload(const Eigen::Matrix4Xf& positions, std::uint64_t frame);
+  /**
+   * @brief Render the cloth based on the given type, from the last uploaded positions.
    *
    * @param type The render type.
    */
   void draw(DrawType type) const;
+#endif
   /**
    * @brief Compute the internal force produce by the springs.
-   * Which includes spring force and damper force.
+   * Which includes spring force and damper force. Runs on the thread pool when `isMultithreaded` is set and uses
+   * the SIMD kernel in springkernel.h when `isVectorized` is set. A MORTON cloth always gathers the forces per particle
+   * instead, its springs do not form the contiguous runs the SIMD kernel is built for. So does a cloth with sleeping
+   * tiles, which must leave their particles untouched.
    *
    */
   void computeSpringForce();
   /**
    * @brief Compute the smooth normal of the surface. Only called when draw type is FULL
+   * Vertices gather the normals of their faces, row strips run on the thread pool when `isMultithreaded` is set.
    *
+   * @param positions Particle positions to be drawn, e.g. a snapshot taken by the simulation thread.
+   * @param frame Identifies the positions, returns at once when it is the same as in the last call.
+   * Also identifies the normals in their upload ring.
    */
-  void computeNormal();
+  void computeNormal(const Eigen::Matrix4Xf& positions, std::uint64_t frame);
   /**
    * @brief Cloth collide with unknown shape
    *
@@ -47,8 +148,82 @@ class Cloth final : public Shape {
    * @param sphere The sphere to be tested.
    */
   void collide(Spheres* sphere) override;
+  /**
+   * @brief Cloth collide with planes, capsules, boxes and signed distance fields.
+   *
+   * @param colliders The colliders to be tested.
+   */
+  void collide(Colliders* colliders) override;
+  /**
+   * @brief Cloth collide with itself, when `isSelfColliding` is set.
+   * Particles closer than the collision thickness to a triangle they do not belong to get an impulse that stops
+   * them from approaching it. The triangles are kept in a BVH that is refit on every call.
+   */
+  void collide() override;
+  /**
+   * @brief Put still regions of the cloth to sleep and wake disturbed ones when `isSleeping` is set.
+   * Called once per step, after integrating it. Wakes everything when `isSleeping` is not set.
+   * The grid is split into tiles of sleepTileSize x sleepTileSize particles. A tile whose mean kinetic energy stays
+   * below sleepEnergyThreshold for sleepSteps steps, with no neighbor tile above it, falls asleep: its particles stop
+   * and are left out of the particles' active ranges, so computeExternalForce, computeSpringForce and the integrators
+   * skip them. It wakes when a collision gives one of its particles a velocity or a neighbor tile goes above the
+   * threshold. Only awake tiles and the sleeping ones marked by disturb() are measured, so a cloth that is mostly
+   * asleep costs little more than its awake tiles.
+   */
+  void updateSleep();
+  /**
+   * @brief Mark the tile of particle `i` for updateSleep to measure when it sleeps. Everything that changes the
+   * velocity of a cloth particle outside the integrators, e.g. a collision, must call it. Thread safe.
+   */
+  void disturb(int i) {
+    if (!isAsleep(i)) return;
+    _isTileDisturbed[_particleTile[i]].store(1, std::memory_order_relaxed);
+  }
+  /**
+   * @brief Limit the stretch of the structural springs when `isStrainLimiting` is set, called after integrating a step.
+   * A spring longer than 1 + maxStrain times its rest length moves its ends back to that length, in proportion to their
+   * inverse masses, and drops the velocity that separates them further. strainLimitIterations Gauss-Seidel sweeps go
+   * over the springs color by color, on the thread pool when `isMultithreaded` is set, so the result does not depend on
+   * the thread count. Pinned and sleeping particles are held.
+   */
+  void limitStrain();
+  /**
+   * @brief Whether particle `i` is asleep, i.e. held still until its tile wakes.
+   */
+  bool isAsleep(int i) const { return _isTileAsleep[_particleTile[i]] != 0; }
+  int awakeParticleCount() const;
+  /**
+   * @brief Write the sleep state of the tiles, restoring it with loadState() continues a run bit for bit.
+   */
+  void saveState(std::ostream& stream) const;
+  void loadState(std::istream& stream);
 
  private:
+  /**
+   * @brief Number the particles of the grid according to the particle order.
+   *
+   */
+  void initializeOrder();
+  /**
+   * @brief Split the particles into the tiles that fall asleep together.
+   *
+   */
+  void initializeTiles();
+  /**
+   * @brief Wake every tile and forget how long they have been still.
+   *
+   */
+  void resetSleep();
+  /**
+   * @brief Hand the runs of awake particles to _particles and collect the springs with an awake end.
+   *
+   */
+  void updateActiveSet();
+  /**
+   * @brief Wake every tile when the particles were replaced (e.g. restored by a reset), which makes them all active.
+   *
+   */
+  void checkActiveRanges();
   /**
    * @brief Initialize the model, setting OpenGL related buffers.
    *
@@ -59,10 +234,109 @@ class Cloth final : public Shape {
    *
    */
   void initializeSpring();
+  /**
+   * @brief Group the springs into colors, springs with the same color do not share any particle.
+   *
+   */
+  void initializeSpringColors();
+  /**
+   * @brief Build the compressed sparse row adjacency from the springs.
+   *
+   */
+  void initializeAdjacency();
+  /**
+   * @brief Evaluate every spring once, then let each particle sum the forces of its springs.
+   * No two threads write the same particle, so unlike the scatter no coloring is needed. While some tiles sleep, only
+   * the springs with an awake end are evaluated and only the awake particles gather.
+   */
+  void gatherSpringForce();
+  /**
+   * @brief Accumulate the spring and damper force of one spring into its particles' acceleration.
+   *
+   * @param spring Index of the spring to be evaluated.
+   */
+  void applySpringForce(int spring);
+  /**
+   * @brief Limit the stretch of structural springs [begin, end) of _structuralSprings, see limitStrain().
+   */
+  void limitSprings(int begin, int end);
+  // Closest triangle of a particle found by self collision, vertices[0] is -1 when there is none.
+  struct SelfContact {
+    int vertices[3];
+    Eigen::Vector3f weights;
+    Eigen::Vector3f normal;
+    float distance;
+  };
+  int _particlesPerEdge;
+  ParticleOrder _order;
+  // Particle index of each grid vertex, in row-major grid order
+  std::vector<int> _gridToParticle;
   std::vector<Spring> _springs;
+  // Factors of setSpringMaterial, and the same times the factors of each spring's type as of the last updateMaterial
+  std::vector<float> _springStiffness;
+  std::vector<float> _springDamping;
+  std::vector<float> _stiffnessScales;
+  std::vector<float> _dampingScales;
+  // Type factors the scales were made with
+  Eigen::Vector3f _typeStiffness = Eigen::Vector3f::Zero();
+  Eigen::Vector3f _typeDamping = Eigen::Vector3f::Zero();
+  bool _isMaterialChanged = true;
+  std::uint64_t _materialRevision = 0;
+  float _longestRestEdge = 0.0f;
+  // Spring indices sorted by color, color c owns [_springColorOffsets[c], _springColorOffsets[c + 1]).
+  std::vector<int> _coloredSprings;
+  std::vector<int> _springColorOffsets;
+  // The structural ones among them, color c owns [_structuralColorOffsets[c], _structuralColorOffsets[c + 1])
+  std::vector<int> _structuralSprings;
+  std::vector<int> _structuralColorOffsets;
+  // Springs that limitStrain pulled back in its current sweep, counted by every thread
+  std::atomic<int> _overstretchedSprings{0};
+  // Same springs as _springs in structure-of-arrays runs
+  SpringKernel _springKernel;
+  // Particle i owns [_adjacencyOffsets[i], _adjacencyOffsets[i + 1]) of _adjacentSprings
+  std::vector<int> _adjacencyOffsets;
+  std::vector<AdjacentSpring> _adjacentSprings;
+  // Spring and damper force on the end particle of each spring, staged by gatherSpringForce
+  Eigen::Matrix4Xf _springForces;
+  // Sleep state, one entry per tile in row-major tile order
+  int _tilesPerEdge = 0;
+  std::vector<int> _particleTile;
+  // Tile t owns particles [_tileOffsets[t], _tileOffsets[t + 1]) of _tileParticles, sorted
+  std::vector<int> _tileOffsets;
+  std::vector<int> _tileParticles;
+  std::vector<std::uint8_t> _isTileAsleep;
+  // Sleeping tiles whose velocities changed since the last updateSleep, see disturb()
+  std::vector<std::atomic<std::uint8_t>> _isTileDisturbed;
+  // Steps each awake tile has stayed below the energy threshold
+  std::vector<int> _quietSteps;
+  // Mean kinetic energy per particle at the last updateSleep
+  std::vector<float> _tileEnergy;
+  int _sleepingTileCount = 0;
+  // What was handed to _particles, and the awake particles and springs with an awake end while some tiles sleep
+  std::vector<Particles::Range> _activeRanges;
+  std::vector<int> _activeParticles;
+  std::vector<int> _activeSprings;
+  // Normals in grid order
+  Eigen::Matrix4Xf _normals;
+  // Positions and normals permuted between grid and particle order, only used by a MORTON cloth
+  Eigen::Matrix4Xf _gridPositions;
+  Eigen::Matrix4Xf _particleNormals;
+  // Components of the two face normals of each quad, column 6 * i + c holds component c % 3 of the first (c < 3) or
+  // second triangle of quad (i, j) at row j + 1. Rows 0 and n are zero, so vertices on the edges need no branches.
+  Eigen::ArrayXXf _faceNormals;
+  // Per vertex row i, columns 4 * i .. 4 * i + 2 sum x, y, z of its faces, the last one is the inverse length
+  Eigen::ArrayXXf _normalSums;
+  // Frame of the positions _normals was computed from
+  std::uint64_t _normalFrame = ~std::uint64_t{0};
+  // Vertex indices of the surface, 3 per triangle
+  std::vector<unsigned int> _triangles;
+  TriangleBVH _triangleTree;
+  std::vector<SelfContact> _selfContacts;
+#ifndef HW1_HEADLESS
   VertexArray vao;
   ArrayBuffer positionBuffer;
   ArrayBuffer normalBuffer;
   ArrayBuffer textureBuffer;
   ElementArrayBuffer ebo, structuralSpring, shearSpring, bendSpring;
+#endif
 };
@@ -0,0 +1,94 @@
+#pragma once
+#include <Eigen/Core>
+#include <vector>
+
+#include "configs.h"
+#include "particles.h"
+#include "spring.h"
+#include "springkernel.h"
+#include "utils.h"
+
+/**
+ * @brief Coefficients the viewer reads from the `springCoef`, `damperCoef` and `viscousCoef` globals.
+ */
+struct ClothMaterial {
+  float springCoef;
+  float damperCoef;
+  float viscousCoef;
+};
+
+/**
+ * @brief Many independent copies of the HW1 cloth, each with its own material, for parameter sweeps.
+ * All instances share one Particles store, instance i owns columns [i * particleCount(), (i + 1) * particleCount()).
+ * They start from the same flat cloth with pinned corners and fall onto static spheres. Instances never interact, so
+ * the thread pool runs whole instances for all requested steps without synchronizing in between.
+ */
+class ClothBatch final {
+ public:
+  MOVE_ONLY(ClothBatch)
+  // Summary of one instance, accumulated by step()
+  struct Metrics {
+    // Largest relative spring elongation (|d| - l) / l seen so far, sampled once per displayed frame, NaN once unstable
+    float maxStrain = 0.0f;
+    // Current kinetic energy
+    float kineticEnergy = 0.0f;
+    // Current largest particle speed
+    float maxSpeed = 0.0f;
+    // Current mean height of the particles
+    float meanHeight = 0.0f;
+    // False once a position or velocity stopped being finite at a strain sample, the instance stops there
+    bool isStable = true;
+  };
+  /**
+   * @brief Create one cloth instance per material.
+   *
+   * @param particlesPerEdge Number of particles along each edge, as in the Cloth constructor.
+   * @param materials Coefficients of each instance.
+   * @param isPinned Pin the four corners like the viewer does by default.
+   */
+  ClothBatch(int particlesPerEdge, std::vector<ClothMaterial> materials, bool isPinned = true);
+  /**
+   * @brief Add a static sphere every instance collides with, the HW1 scene has a unit sphere at the origin.
+   */
+  void addSphere(const Eigen::Vector4f& center, float radius);
+  /**
+   * @brief Advance every instance by `steps` explicit Euler steps of `deltaTime`.
+   * Instances are split over the thread pool when `isMultithreaded` is set, springs use the SIMD kernel when
+   * `isVectorized` is set. Springs are scaled by the factors of their type in springTypeScale and damperTypeScale, as
+   * in Cloth.
+   */
+  void step(int steps);
+
+  int size() const { return static_cast<int>(_materials.size()); }
+  // Number of particles of one instance
+  int particleCount() const { return _particleCount; }
+  const ClothMaterial& material(int instance) const { return _materials[instance]; }
+  const Metrics& metrics(int instance) const { return _metrics[instance]; }
+  Particles& particles() { return _particles; }
+
+ private:
+  /**
+   * @brief Run one instance for `steps` steps and refresh its metrics.
+   */
+  void simulateInstance(int instance, int steps);
+  /**
+   * @brief Recompute the scales of each spring from the type factors when they changed, see Cloth::updateMaterial.
+   */
+  void updateMaterial();
+
+  int _particleCount;
+  std::vector<ClothMaterial> _materials;
+  std::vector<Metrics> _metrics;
+  // Topology of a single instance, particle indices are relative to the instance
+  std::vector<Spring> _springs;
+  // Type factors the scales were computed with, and the resulting stiffness and damping scale of each spring
+  Eigen::Vector3f _typeStiffness = Eigen::Vector3f::Constant(-1.0f);
+  Eigen::Vector3f _typeDamping = Eigen::Vector3f::Constant(-1.0f);
+  std::vector<float> _stiffnessScales;
+  std::vector<float> _dampingScales;
+  // One per instance, as each keeps its own SoA scratch
+  std::vector<SpringKernel> _springKernels;
+  Particles _particles;
+  std::vector<Eigen::Vector4f> _sphereCenters;
+  std::vector<float> _sphereRadii;
+};
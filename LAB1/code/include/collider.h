@@ -0,0 +1,148 @@
+#pragma once
+#include <Eigen/Core>
+#include <vector>
+
+#include "shape.h"
+#include "utils.h"
+
+/**
+ * @brief Signed distance field of a closed triangle mesh, sampled on a regular grid.
+ * Negative inside the mesh. Between the samples it is interpolated trilinearly, so it is only as sharp as a cell.
+ */
+class SignedDistanceField {
+ public:
+  MOVE_ONLY(SignedDistanceField)
+  /**
+   * @brief Voxelize a mesh. Samples next to a triangle get their exact distance, the others take the closest
+   * triangle of a neighbor by sweeping the grid, and the sign comes from counting crossings along x.
+   *
+   * @param vertices Vertex positions, one per column (w is ignored).
+   * @param triangles Vertex indices, 3 per triangle, of a closed mesh.
+   * @param cellSize Edge length of a cell.
+   * @param padding Cells of empty space around the bounding box of the mesh.
+   */
+  SignedDistanceField(const Eigen::Ref<const Eigen::Matrix4Xf>& vertices,
+                      const std::vector<unsigned int>& triangles,
+                      float cellSize,
+                      int padding = 2);
+  /**
+   * @brief Interpolated distance at a point and its gradient, the outward normal of the surface near it.
+   * Points outside of the grid are clamped onto it and get the distance to the grid added.
+   */
+  float sample(const Eigen::Vector3f& point, Eigen::Vector3f& gradient) const;
+  const Eigen::Vector3f& lower() const { return _lower; }
+  Eigen::Vector3f upper() const { return _lower + _cellSize * (_size - Eigen::Vector3i::Ones()).cast<float>(); }
+
+ private:
+  float value(int x, int y, int z) const { return _values[(z * _size.y() + y) * _size.x() + x]; }
+
+  // Position of sample (0, 0, 0)
+  Eigen::Vector3f _lower;
+  float _cellSize;
+  // Samples along each axis
+  Eigen::Vector3i _size;
+  // x-major samples
+  std::vector<float> _values;
+};
+
+/**
+ * @brief Rigid colliders the cloth bounces off: planes, capsules, oriented boxes and signed distance fields.
+ * Unlike Spheres they are not simulated, they stay where they are put (e.g. by an animated character) and have
+ * infinite mass. Each collider has a pose, a rigid transform from its local frame to the world, and a velocity that
+ * the particles in contact with it follow along its normal.
+ * Particles are tested in batches of batchSize copied to structure-of-arrays form, each type computes the distances of
+ * a whole batch with array expressions that vectorize. A batch is only tested against the colliders whose bounding box
+ * its own bounding box overlaps.
+ */
+class Colliders final : public Shape {
+ public:
+  MOVE_ONLY(Colliders)
+  enum class Type { PLANE, CAPSULE, BOX, FIELD };
+  /// @brief Particles per batch of the distance query
+  static constexpr int batchSize = 128;
+  Colliders();
+  /**
+   * @brief Add a plane, particles on the side its normal points to are outside. Returns the index of the collider.
+   * The local frame of a plane has its normal along y.
+   */
+  int addPlane(const Eigen::Ref<const Eigen::Vector4f>& point, const Eigen::Ref<const Eigen::Vector4f>& normal);
+  /**
+   * @brief Add a capsule around the segment from -halfHeight to halfHeight along local y.
+   */
+  int addCapsule(const Eigen::Ref<const Eigen::Matrix4f>& pose, float halfHeight, float radius);
+  /**
+   * @brief Add a box centered on the local origin.
+   *
+   * @param halfExtents Half the edge lengths along local x, y and z.
+   */
+  int addBox(const Eigen::Ref<const Eigen::Matrix4f>& pose, const Eigen::Ref<const Eigen::Vector3f>& halfExtents);
+  /**
+   * @brief Add a signed distance field, built in the local frame.
+   */
+  int addField(const Eigen::Ref<const Eigen::Matrix4f>& pose, SignedDistanceField field);
+  /**
+   * @brief Move a collider.
+   *
+   * @param pose Rigid transform from its local frame to the world.
+   * @param velocity Velocity over the next step, w = 0.
+   */
+  void setPose(int i,
+               const Eigen::Ref<const Eigen::Matrix4f>& pose,
+               const Eigen::Ref<const Eigen::Vector4f>& velocity = Eigen::Vector4f::Zero());
+  int size() const { return static_cast<int>(_colliders.size()); }
+  Type type(int i) const { return _colliders[i].type; }
+  /**
+   * @brief Signed distance of particles to a collider and the outward normal at the closest surface point.
+   *
+   * @param i Index of the collider.
+   * @param positions Particle positions, at most batchSize columns.
+   * @param distances Negative inside the collider, one per particle.
+   * @param normals World space normals, one per particle in the first 3 rows.
+   */
+  void distance(int i,
+                const Eigen::Ref<const Eigen::Matrix4Xf>& positions,
+                Eigen::Ref<Eigen::ArrayXf> distances,
+                Eigen::Ref<Eigen::Matrix3Xf> normals) const;
+  void collide(Shape* shape) override;
+  /**
+   * @brief Colliders collide with cloth. Particles within colliderMargin of a surface lose the velocity that takes
+   * them towards it, relative to the collider, and particles inside are pushed out at colliderRepulsion times their
+   * depth. Runs the batches on the thread pool when `isMultithreaded` is set. Sleeping particles are only tested
+   * against moving colliders, resting on a static one does not keep them awake.
+   *
+   * @param cloth The cloth to be tested.
+   */
+  void collide(Cloth* cloth) override;
+
+ private:
+  struct Collider {
+    Type type;
+    Eigen::Matrix4f localToWorld;
+    Eigen::Matrix4f worldToLocal;
+    Eigen::Vector4f velocity;
+    // Half height and radius of a capsule, half extents of a box
+    Eigen::Vector3f extent;
+    // Index into _fields
+    int field;
+    // World space bounds, unbounded for a plane
+    Eigen::Vector3f lower;
+    Eigen::Vector3f upper;
+  };
+  // Positions or normals of a batch in structure-of-arrays form, one row per component
+  using Batch = Eigen::Array<float, 3, batchSize, Eigen::RowMajor>;
+  using BatchRow = Eigen::Array<float, 1, batchSize>;
+  /**
+   * @brief Same as distance() for world space positions already transposed into a batch.
+   * Every column is computed, the ones past `count` must hold copies of valid positions.
+   */
+  void distance(const Collider& collider, const Batch& positions, int count, BatchRow& distances, Batch& normals) const;
+  int add(Type type, const Eigen::Ref<const Eigen::Matrix4f>& pose, const Eigen::Vector3f& extent, int field = -1);
+  /**
+   * @brief Recompute the world space bounds of a collider after it moved.
+   *
+   */
+  void updateBounds(Collider& collider) const;
+
+  std::vector<Collider> _colliders;
+  std::vector<SignedDistanceField> _fields;
+};
@@ -0,0 +1,93 @@
+#pragma once
+#include <Eigen/Core>
+#include <cstddef>
+#include <cstdint>
+
+#include "particles.h"
+#include "springkernel.h"
+
+class Cloth;
+
+/**
+ * @brief Particle storage without the padding of Particles, compared against it by `HW1Benchmark --layouts`.
+ * Particles keeps every vector in 4 floats, so a particle costs 56 bytes (position, velocity, acceleration, mass and
+ * inverse mass) and the spring kernel copies it into SoA rows each step. This keeps x, y and z in separate rows with
+ * the inverse masses precomputed, no acceleration, and the velocity in VelocityScalar: float, or Eigen::half to halve
+ * it for very large cloths. Rows are padded to a multiple of `alignment` particles, so each one starts on a 16 byte
+ * boundary in either precision. The padding particles are pinned and have no springs.
+ * Half velocities keep 11 significant bits, an increment below half their spacing is rounded away: with the default
+ * deltaTime, gravity alone (9.8e-4 per step) stops speeding up a particle at about 2 m/s. Spring forces are far larger,
+ * so it mostly shows on falling cloth.
+ */
+template <typename VelocityScalar>
+class CompactParticles {
+ public:
+  // Particles per 16 bytes of a half row
+  static constexpr int alignment = 8;
+  explicit CompactParticles(int size = 0);
+  void resize(int size);
+  int size() const { return _size; }
+  // Particles per row, size() rounded up to alignment
+  int stride() const { return static_cast<int>(_inverseMass.cols()); }
+  /**
+   * @brief Copy the position, velocity and inverse mass of every particle, `particles` must hold size() of them.
+   */
+  void load(const Particles& particles);
+  /**
+   * @brief Copy position and velocity back, the other fields of `particles` are left as they are.
+   */
+  void store(Particles& particles) const;
+  /**
+   * @brief Get the bytes of the state, padding included.
+   */
+  std::size_t bytes() const;
+  // Row `axis` of position and velocity, stride() values each
+  float* position(int axis) { return _position.row(axis).data(); }
+  const float* position(int axis) const { return _position.row(axis).data(); }
+  VelocityScalar* velocity(int axis) { return _velocity.row(axis).data(); }
+  const VelocityScalar* velocity(int axis) const { return _velocity.row(axis).data(); }
+  const float* inverseMass() const { return _inverseMass.data(); }
+
+ private:
+  int _size = 0;
+  Eigen::Matrix<float, 3, Eigen::Dynamic, Eigen::RowMajor> _position;
+  Eigen::Matrix<VelocityScalar, 3, Eigen::Dynamic, Eigen::RowMajor> _velocity;
+  Eigen::RowVectorXf _inverseMass;
+};
+
+/**
+ * @brief Explicit euler step of a cloth kept in CompactParticles, for the layout comparison of the benchmark.
+ * Same forces as computeExternalForce and computeSpringForce with `isVectorized`, and the update of
+ * ExplicitEuler::integrate, straight on the compact rows: the spring kernel reads them in place instead of copying
+ * them, and the forces go to 3 rows that are turned into the velocity update. No collision, sleeping or threads.
+ */
+template <typename VelocityScalar>
+class CompactEulerStep {
+ public:
+  /**
+   * @brief Pack the springs of `cloth` and copy its particles.
+   */
+  explicit CompactEulerStep(Cloth& cloth);
+  /**
+   * @brief Advance the particles by `deltaTime`, never allocates.
+   */
+  void step();
+  CompactParticles<VelocityScalar>& particles() { return _particles; }
+  /**
+   * @brief Get the bytes of the force rows, which live through a step.
+   */
+  std::size_t scratchBytes() const { return static_cast<std::size_t>(_force.size()) * sizeof(float); }
+
+ private:
+  Cloth& _cloth;
+  CompactParticles<VelocityScalar> _particles;
+  SpringKernel _springKernel;
+  // Cloth::materialRevision() of the spring scales in _springKernel
+  std::uint64_t _materialRevision = 0;
+  Eigen::Matrix<float, 3, Eigen::Dynamic, Eigen::RowMajor> _force;
+};
+
+extern template class CompactParticles<float>;
+extern template class CompactParticles<Eigen::half>;
+extern template class CompactEulerStep<float>;
+extern template class CompactEulerStep<Eigen::half>;
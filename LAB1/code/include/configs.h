@@ -2,12 +2,55 @@
 #include <Eigen/Core>
 
 // constants
-inline constexpr int particlesPerEdge = 25;
+// Cloth resolution used when none is given, can be changed at runtime through the Cloth constructor
+inline constexpr int defaultParticlesPerEdge = 25;
 inline constexpr int clothWidth = 2;
 inline constexpr int clothHeight = 2;
 inline constexpr float particleMass = 1.0f;
 inline constexpr float sphereDensity = 1e3f;
 inline constexpr float baseSpeed = 1e-3f;
+// Gravity pulls every particle with a mass along -y, see Shape::computeExternalForce
+inline constexpr float gravityAcceleration = 9.8f;
+// Conjugate gradient settings of the backward euler integrator
+inline constexpr int implicitSolverMaxIterations = 100;
+inline constexpr float implicitSolverTolerance = 1e-4f;
+// Multigrid preconditioner of the backward euler integrator: the lattice is halved until it has at most
+// multigridCoarsestEdge particles per edge, every finer level gets multigridSmoothingSweeps damped block Jacobi sweeps
+// before and after its coarse correction
+inline constexpr int multigridCoarsestEdge = 8;
+inline constexpr int multigridSmoothingSweeps = 2;
+inline constexpr float multigridSmoothingWeight = 0.6f;
+// Gauss-Seidel sweeps over the spring constraints per step of the XPBD integrator
+inline constexpr int xpbdIterations = 10;
+// Gauss-Seidel sweeps over the structural springs per step of strain limiting, see Cloth::limitStrain
+inline constexpr int strainLimitIterations = 4;
+// Particles per tile of the fused explicit euler step, the tile's state and its neighbors' stay in L1 / L2
+inline constexpr int fusedTileSize = 256;
+// Minimum work items per thread pool chunk, smaller loops stay on one thread
+inline constexpr int parallelGrainSize = 256;
+// Spheres::collide switches from the double loop to a spatial hash over the cloth from this many spheres on
+inline constexpr int broadPhaseMinSpheres = 8;
+// Cloth particles closer than this to a sphere's surface collide with it
+inline constexpr float sphereCollisionMargin = 0.01f;
+// Cloth particles closer than this to the surface of a collider (plane, capsule, box, field) collide with it
+inline constexpr float colliderMargin = 0.01f;
+// Separation speed, per unit of depth, that a collider gives to a cloth particle inside of it
+inline constexpr float colliderRepulsion = 10.0f;
+// Self collision keeps particles this far from the triangles, relative to the rest distance between particles
+inline constexpr float selfCollisionThickness = 0.25f;
+// Separation speed, per unit of depth into the thickness, that self collision gives to a particle
+inline constexpr float selfCollisionRepulsion = 10.0f;
+// Cloth sleeping: tiles of sleepTileSize x sleepTileSize particles fall asleep once their mean kinetic energy per
+// particle stayed below sleepEnergyThreshold for sleepSteps steps
+inline constexpr int sleepTileSize = 8;
+inline constexpr float sleepEnergyThreshold = 1e-6f;
+inline constexpr int sleepSteps = 500;
+// Frames a point cache writer encodes in memory before writing them out
+inline constexpr int pointCacheChunkFrames = 64;
+// Displayed frames in the rolling per-phase histograms of the profiler
+inline constexpr int profileHistoryFrames = 120;
+// Timed scopes a Chrome trace keeps at most, later ones are dropped
+inline constexpr int profileTraceMaxEvents = 1 << 20;
 
 inline constexpr int sphereSlice = 36;
 inline constexpr int sphereStack = 18;
@@ -23,9 +66,28 @@ extern float keyboardMoveSpeed;
 
 extern float deltaTime;
 extern int simulationPerFrame;
+// Error controlled substeps for the midpoint and RK4 integrators, within [minDeltaTime, maxDeltaTime]
+extern bool isAdaptive;
+extern float minDeltaTime;
+extern float maxDeltaTime;
+extern float adaptiveTolerance;
+// Precondition the backward euler solve with a multigrid V-cycle instead of the diagonal, see ClothMultigrid
+extern bool isMultigrid;
+// Step explicit euler in one pass over the particles where it can, see FusedEulerStep
+extern bool isFused;
+// Substeps the integrator took for the last displayed frame
+extern int substepsPerFrame;
 
 extern float springCoef;
 extern float damperCoef;
+// Stiffness and damping of structural, shear and bend springs relative to springCoef and damperCoef, indexed by
+// Spring::Type. Each spring can be scaled further, see Cloth::setSpringMaterial
+extern Eigen::Vector3f springTypeScale;
+extern Eigen::Vector3f damperTypeScale;
+// Pull structural springs stretched by more than maxStrain of their rest length back after each step, see
+// Cloth::limitStrain
+extern bool isStrainLimiting;
+extern float maxStrain;
 extern float viscousCoef;
 
 extern Eigen::Vector4f sphereColor;
@@ -38,5 +100,33 @@ extern bool isDrawingBendSprings;
 extern bool isDrawingCloth;
 extern bool isPaused;
 extern bool isStateSwitched;
+extern bool isMultithreaded;
+extern bool isVectorized;
+extern bool isSelfColliding;
+// Sweep the spheres over each step when colliding them with the cloth, see Spheres::collide
+extern bool isContinuousCollision;
+// Collide the cloth with the ground plane under the sphere, see Colliders::collide
+extern bool isGroundColliding;
+// Let settled tiles of the cloth sleep, see Cloth::updateSleep
+extern bool isSleeping;
+// Cloth particles awake after the last displayed frame
+extern int awakeParticles;
+// Log the inputs of the viewer into a recording file while set
+extern bool isRecording;
+// Save a checkpoint of the current state on the next frame
+extern bool isCheckpointRequested;
+// Append every simulated frame of the cloth to a point cache file while set
+extern bool isBaking;
+// Bake 16-bit positions relative to each frame's bounding box instead of floats
+extern bool isCacheQuantized;
+// Draw the cloth from the last baked point cache instead of the simulation
+extern bool isPlayingCache;
+extern int cacheFrame;
+// Frames in the last baked point cache, 0 when there is none
+extern int cacheFrameCount;
+// Time the phases of each frame and show them as histograms, see Profiler
+extern bool isProfiling;
+// Keep every timed phase while set and write them to a Chrome trace file when cleared
+extern bool isTracing;
 
 extern int currentIntegrator;
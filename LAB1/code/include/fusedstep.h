@@ -0,0 +1,68 @@
+#pragma once
+#include <Eigen/Core>
+#include <cstdint>
+#include <vector>
+
+#include "particles.h"
+#include "springkernel.h"
+
+class Cloth;
+class Integrator;
+class Spheres;
+
+/**
+ * @brief Explicit euler step of the cloth and the spheres in a single pass over the cloth, used when `isFused` is set.
+ * The usual step sweeps every particle four times (computeExternalForce, computeSpringForce, Spheres::collide and
+ * ExplicitEuler::integrate), each time through whole position, velocity and acceleration matrices. This one walks the
+ * cloth in tiles of fusedTileSize particles: it copies the tile into the SoA state of a SpringKernel, evaluates the
+ * springs whose later particle is in the tile, then finishes every particle whose springs are now all summed (gravity
+ * and viscosity, its contact with each sphere and the euler update) from that state straight into the particles. Only
+ * a band of a few tiles is live at any time, so it stays in L1 / L2, and no acceleration is stored. The spring runs
+ * need the GRID particle order.
+ * With `isMultithreaded`, the tiles are copied first, then each thread takes a run of tiles and also evaluates the
+ * springs of the few tiles before it that reach its particles. The result does not depend on the thread count.
+ * Contacts are the discrete ones of Spheres::collide, except that a sphere gets the sum of its impulses after the pass
+ * instead of after each one.
+ */
+class FusedEulerStep {
+ public:
+  explicit FusedEulerStep(Cloth& cloth);
+  /**
+   * @brief Whether step() can stand in for simulateOneStep and integrate with the current configs.
+   * It needs explicit euler, a GRID cloth, discrete sphere contacts, fewer than broadPhaseMinSpheres spheres, no self
+   * collision, no colliders and no sleeping tile.
+   *
+   * @param hasColliders Whether the step would collide the cloth with Colliders, which the fused step does not.
+   */
+  static bool isApplicable(const Integrator& integrator, Cloth& cloth, const Spheres& spheres, bool hasColliders);
+  /**
+   * @brief Advance the cloth and the spheres by `deltaTime`.
+   * Only allocates when the number of spheres changes.
+   */
+  void step(Spheres& spheres);
+
+ private:
+  /**
+   * @brief Finish the particles of tile `tile`, their spring forces must be complete.
+   */
+  void finishTile(int tile, Spheres& spheres);
+  /**
+   * @brief Finish particles [range.begin, range.end), at most fusedTileSize of them, whose impulses go to tile `tile`.
+   */
+  void finishRange(int tile, Particles::Range range, Spheres& spheres);
+
+  Cloth& _cloth;
+  // Springs packed by tile
+  SpringKernel _springKernel;
+  // Tile each particle is finished in, the one of its farthest neighbor
+  std::vector<int> _finalTile;
+  // Tile t finishes the particles of ranges [_finalOffsets[t], _finalOffsets[t + 1]) of _finalRanges
+  std::vector<int> _finalOffsets;
+  std::vector<Particles::Range> _finalRanges;
+  // Most tiles between the tile of a particle and the one it is finished in
+  int _lag = 0;
+  // Cloth::materialRevision() of the spring scales in _springKernel
+  std::uint64_t _materialRevision = 0;
+  // Impulse of tile t on sphere s in column t * sphere count + s, summed in tile order
+  Eigen::Matrix4Xf _sphereImpulses;
+};
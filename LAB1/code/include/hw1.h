@@ -3,10 +3,16 @@
 #include "buffer.h"
 #include "camera.h"
 #include "cloth.h"
+#include "collider.h"
 #include "configs.h"
+#include "fusedstep.h"
 #include "glcontext.h"
 #include "gui.h"
 #include "integrator.h"
+#include "pointcache.h"
+#include "profiler.h"
+#include "recording.h"
 #include "shader.h"
+#include "simulationthread.h"
 #include "sphere.h"
 #include "utils.h"
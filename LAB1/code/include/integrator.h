@@ -1,17 +1,22 @@
 #pragma once
 #include <Eigen/Core>
+#include <Eigen/SparseCore>
 #include <functional>
+#include <iosfwd>
 #include <vector>
 
+#include "multigrid.h"
 #include "particles.h"
 #include "utils.h"
 
+class Cloth;
+
 class Integrator {
  public:
   Integrator() noexcept {}
   DELETE_COPY(Integrator)
   DELETE_MOVE(Integrator)
-  enum class Type { EXPLICIT_EULER, IMPLICIT_EULER, MIDPOINT_EULER, RUNGE_KUTTA_FOURTH };
+  enum class Type { EXPLICIT_EULER, IMPLICIT_EULER, MIDPOINT_EULER, RUNGE_KUTTA_FOURTH, BACKWARD_EULER, XPBD };
   /**
    * @brief Integrate the ODE of acceleration and velocity.
    *
@@ -19,30 +24,215 @@ class Integrator {
    * @param simulateOneStep A function that computes next step f(x, t+h)
    */
   virtual void integrate(const std::vector<Particles *> &particles,
-                         std::function<void(void)> simulateOneStep) const = 0;
+                         const std::function<void(void)> &simulateOneStep) const = 0;
   CONSTEXPR_VIRTUAL virtual Type getType() const = 0;
+  /**
+   * @brief Number of substeps the last call to integrate took, always 1 for fixed step integrators.
+   */
+  virtual int substepCount() const { return 1; }
+  /**
+   * @brief Number of integrate calls per displayed frame, each fixed step integrator call covers `deltaTime`.
+   */
+  virtual int stepsPerFrame() const;
+  /**
+   * @brief Write what the integrator carries from one call to the next, e.g. a warm start. Nothing for most of them.
+   * Restoring it with loadState() makes the following steps bit identical to an uninterrupted run.
+   */
+  virtual void saveState(std::ostream &) const {}
+  virtual void loadState(std::istream &) {}
+
+ protected:
+  /**
+   * @brief Make `scratch` hold one particle buffer per set with matching capacity.
+   * Only allocates when the set count or capacity changes, the contents are left unspecified.
+   *
+   * @param particles The particles to be matched.
+   * @param scratch Persistent scratch storage owned by the integrator.
+   */
+  static void reserveScratch(const std::vector<Particles *> &particles, std::vector<Particles> &scratch);
+  /**
+   * @brief Copy position and velocity of each particle set into `backup`.
+   * Buffers are reused between calls and only reallocated when the set count or capacity changes.
+   *
+   * @param particles The particles to be saved.
+   * @param backup Persistent scratch storage owned by the integrator.
+   */
+  static void backupState(const std::vector<Particles *> &particles, std::vector<Particles> &backup);
 };
 
 class ExplicitEuler : public Integrator {
  public:
-  void integrate(const std::vector<Particles *> &particles, std::function<void(void)> simulateOneStep) const override;
+  void integrate(const std::vector<Particles *> &particles,
+                 const std::function<void(void)> &simulateOneStep) const override;
   CONSTEXPR_VIRTUAL Type getType() const override { return Type::EXPLICIT_EULER; }
 };
 
 class ImplicitEuler : public Integrator {
  public:
-  void integrate(const std::vector<Particles *> &particles, std::function<void(void)> simulateOneStep) const override;
+  void integrate(const std::vector<Particles *> &particles,
+                 const std::function<void(void)> &simulateOneStep) const override;
   CONSTEXPR_VIRTUAL Type getType() const override { return Type::IMPLICIT_EULER; }
+
+ private:
+  mutable std::vector<Particles> _backup;
+};
+
+/**
+ * @brief Integrator that covers a whole frame per call, in substeps chosen by error control, when `isAdaptive` is set.
+ * Each substep of size h is taken once as a whole and once as two halves, the difference estimates the error of the
+ * halves (step doubling). Substeps with an error above `adaptiveTolerance` are retried with a smaller h, and the size
+ * of the next one is predicted from the error, within [minDeltaTime, maxDeltaTime].
+ */
+class AdaptiveIntegrator : public Integrator {
+ public:
+  void integrate(const std::vector<Particles *> &particles,
+                 const std::function<void(void)> &simulateOneStep) const final;
+  int substepCount() const override { return _substepCount; }
+  int stepsPerFrame() const override;
+  void saveState(std::ostream &stream) const override;
+  void loadState(std::istream &stream) override;
+
+ protected:
+  /**
+   * @brief Take one step of size h, the acceleration of the current state must already be computed.
+   *
+   * @param particles A vector of particles to be integrated.
+   * @param simulateOneStep A function that computes next step f(x, t+h)
+   * @param h Step size.
+   */
+  virtual void step(const std::vector<Particles *> &particles, const std::function<void(void)> &simulateOneStep,
+                    float h) const = 0;
+  /**
+   * @brief Order of accuracy of step(), used to scale the error estimate.
+   */
+  virtual int order() const = 0;
+
+ private:
+  // Position, velocity and acceleration at the start of the current substep
+  mutable std::vector<Particles> _start;
+  // Result of the whole step
+  mutable std::vector<Particles> _whole;
+  // Predicted size of the next substep, 0 before the first one
+  mutable float _stepSize = 0.0f;
+  mutable int _substepCount = 1;
 };
 
-class MidpointEuler : public Integrator {
+class MidpointEuler : public AdaptiveIntegrator {
  public:
-  void integrate(const std::vector<Particles *> &particles, std::function<void(void)> simulateOneStep) const override;
   CONSTEXPR_VIRTUAL Type getType() const override { return Type::MIDPOINT_EULER; }
+
+ protected:
+  void step(const std::vector<Particles *> &particles, const std::function<void(void)> &simulateOneStep,
+            float h) const override;
+  int order() const override { return 2; }
+
+ private:
+  mutable std::vector<Particles> _backup;
 };
 
-class RungeKuttaFourth : public Integrator {
+class RungeKuttaFourth : public AdaptiveIntegrator {
  public:
-  void integrate(const std::vector<Particles *> &particles, std::function<void(void)> simulateOneStep) const override;
   CONSTEXPR_VIRTUAL Type getType() const override { return Type::RUNGE_KUTTA_FOURTH; }
+
+ protected:
+  void step(const std::vector<Particles *> &particles, const std::function<void(void)> &simulateOneStep,
+            float h) const override;
+  int order() const override { return 4; }
+
+ private:
+  mutable std::vector<Particles> _backup;
+  // Weighted sum k1 + 2 * k2 + 2 * k3 + k4, stored in position / velocity.
+  mutable std::vector<Particles> _increment;
+};
+
+/**
+ * @brief Backward Euler (Baraff & Witkin, Large Steps in Cloth Simulation) for the cloth.
+ * Solves (M - h df/dv - h^2 df/dx) dv = h (f + h df/dx v) with preconditioned conjugate gradient. The preconditioner
+ * is the diagonal, or a multigrid V-cycle over the cloth lattice when `isMultigrid` is set, which keeps the iteration
+ * count about the same as the resolution grows. Other particle sets (e.g. spheres) are integrated with explicit euler.
+ */
+class BackwardEuler : public Integrator {
+ public:
+  explicit BackwardEuler(Cloth &cloth) noexcept : _cloth(cloth) {}
+  void integrate(const std::vector<Particles *> &particles,
+                 const std::function<void(void)> &simulateOneStep) const override;
+  CONSTEXPR_VIRTUAL Type getType() const override { return Type::BACKWARD_EULER; }
+  /**
+   * @brief Number of conjugate gradient iterations used by the last step.
+   */
+  int iterations() const { return _iterations; }
+  void saveState(std::ostream &stream) const override;
+  void loadState(std::istream &stream) override;
+
+ private:
+  /**
+   * @brief Build the block sparsity pattern from the springs and cache where each 3x3 block lives in the matrix.
+   */
+  void buildPattern() const;
+  /**
+   * @brief Fill the system matrix and right hand side for the current state.
+   */
+  void assemble() const;
+  /**
+   * @brief Solve the system with preconditioned conjugate gradient, warm started from the last solution.
+   */
+  void solve() const;
+  /**
+   * @brief _preconditioned = M^-1 _residual.
+   */
+  void precondition() const;
+
+  Cloth &_cloth;
+  // Row-major so that each row of a 3x3 block is contiguous in valuePtr().
+  mutable Eigen::SparseMatrix<float, Eigen::RowMajor> _system;
+  // Offset of the first entry of each block row in valuePtr(): 3 per particle / 6 per spring (start-end, end-start).
+  mutable std::vector<int> _diagonalOffsets;
+  mutable std::vector<int> _springOffsets;
+  mutable Eigen::VectorXf _rhs, _deltaVelocity, _inverseDiagonal;
+  mutable Eigen::VectorXf _residual, _direction, _preconditioned, _product;
+  // 1 on the rows of free particles and 0 on held ones, whose dv must stay 0
+  mutable Eigen::VectorXf _freeRows;
+  mutable ClothMultigrid _multigrid;
+  mutable int _iterations = 0;
+};
+
+/**
+ * @brief Extended position based dynamics (Macklin et al., XPBD: Position-Based Simulation of Compliant Constrained
+ * Dynamics) for the cloth. Every spring is a distance constraint with the inverse of its stiffness as compliance and
+ * its damping (see Cloth::stiffnessScales), solved with `xpbdIterations` Gauss-Seidel sweeps per step. Stable at
+ * frame-rate time steps.
+ * The cloth's acceleration must only hold the external force, the constraints replace computeSpringForce.
+ * Other particle sets (e.g. spheres) are integrated with explicit euler.
+ */
+class XPBD : public Integrator {
+ public:
+  explicit XPBD(Cloth &cloth) noexcept : _cloth(cloth) {}
+  void integrate(const std::vector<Particles *> &particles,
+                 const std::function<void(void)> &simulateOneStep) const override;
+  CONSTEXPR_VIRTUAL Type getType() const override { return Type::XPBD; }
+
+ private:
+  /**
+   * @brief Project the springs in [beginSlot, endSlot) of Cloth::coloredSprings() once.
+   */
+  void projectSprings(int beginSlot, int endSlot) const;
+
+  // One spring constraint, stored in Cloth::coloredSprings() order so that a color is a contiguous range
+  struct Constraint {
+    int start;
+    int end;
+    float restLength;
+    // Time step scaled compliance alpha~ and damping gamma of the spring
+    float compliance;
+    float damping;
+    // 1 / ((1 + gamma) * (wa + wb) + alpha~), 0 when both ends are pinned
+    float inverseDenominator;
+    // Accumulated lagrange multiplier
+    float lambda;
+  };
+  Cloth &_cloth;
+  // Positions at the start of the step, x(n)
+  mutable Eigen::Matrix4Xf _previousPosition;
+  mutable std::vector<float> _inverseMass;
+  mutable std::vector<Constraint> _constraints;
 };
@@ -0,0 +1,96 @@
+#pragma once
+#include <Eigen/Cholesky>
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <vector>
+
+class Cloth;
+
+/**
+ * @brief Geometric multigrid V-cycle for a system with one 3x3 block per cloth particle, e.g. the backward euler one.
+ * Coarser levels decimate the particle lattice by keeping every other row and column (and the last ones), fine values
+ * are bilinear interpolations of the coarse ones. Coarse operators are the Galerkin products P^T A P, stored as block
+ * sparse rows, so they follow the current spring directions and stiffness. Each level is smoothed with damped block
+ * Jacobi, the coarsest one is solved directly. Low frequency error, which spreads one particle per iteration on the fine
+ * lattice, is removed on the coarse levels, so a preconditioned solve needs about as many iterations on a large cloth
+ * as on a small one. Nothing is allocated after build().
+ */
+class ClothMultigrid {
+ public:
+  using SystemMatrix = Eigen::SparseMatrix<float, Eigen::RowMajor>;
+  /**
+   * @brief Build the levels for the lattice of the cloth.
+   *
+   * @param cloth Gives the lattice position of each particle.
+   * @param system Fine system, 3 rows per particle in particle order. Kept by reference, its pattern must not change.
+   */
+  void build(const Cloth& cloth, const SystemMatrix& system);
+  /**
+   * @brief Recompute the coarse operators and smoothers after the values of the fine system changed.
+   * The Galerkin products are gathered through the term lists made by build(), no index is searched per step.
+   */
+  void update();
+  /**
+   * @brief Run one V-cycle from a zero guess, which approximates system^-1 * residual.
+   * It is a symmetric positive definite operator, so it can precondition conjugate gradient.
+   *
+   * @param residual Right hand side, 3 entries per particle.
+   * @param correction Approximate solution, same size.
+   */
+  void apply(const Eigen::VectorXf& residual, Eigen::VectorXf& correction);
+  int levelCount() const { return static_cast<int>(_levels.size()); }
+
+ private:
+  // Node of the next level a node interpolates from, padded with zero weights up to 4
+  struct Parent {
+    int node;
+    float weight;
+  };
+  // One fine block of a Galerkin product, a coarse block is the weighted sum of its terms
+  struct GalerkinTerm {
+    int block;
+    float weight;
+  };
+  struct Level {
+    // Nodes per lattice edge
+    int edge;
+    // Lattice row and column of each node, node order is particle order on level 0 and row-major on the others
+    std::vector<int> rows;
+    std::vector<int> columns;
+    // 4 per node, empty on the coarsest level
+    std::vector<Parent> parents;
+    // Block sparse rows: blocks[blockStarts[i]] up to blocks[blockStarts[i + 1]] couple node i to blockColumns
+    std::vector<int> blockStarts;
+    std::vector<int> blockColumns;
+    std::vector<Eigen::Matrix3f> blocks;
+    std::vector<int> diagonalBlocks;
+    // Block k of the next level sums the blocks of this one listed in galerkinTerms[galerkinStarts[k]] up to
+    // galerkinTerms[galerkinStarts[k + 1]], empty on the coarsest level
+    std::vector<int> galerkinStarts;
+    std::vector<GalerkinTerm> galerkinTerms;
+    std::vector<Eigen::Matrix3f> inverseDiagonal;
+    Eigen::VectorXf rhs, solution, residual;
+  };
+  /**
+   * @brief Find the pattern of the operator of level `level + 1` and which blocks of `level` sum up to each block.
+   */
+  void buildGalerkin(int level);
+  /**
+   * @brief residual = rhs - A * solution on one level.
+   */
+  void computeResidual(int level);
+  /**
+   * @brief One damped block Jacobi sweep, a zero solution is taken as given instead of being read.
+   */
+  void smooth(int level, bool isZero);
+  /**
+   * @brief Solve level `level` for its rhs, recursively.
+   */
+  void cycle(int level);
+
+  const SystemMatrix* _system = nullptr;
+  std::vector<Level> _levels;
+  // Direct solve of the coarsest level
+  Eigen::MatrixXf _coarsest;
+  Eigen::LLT<Eigen::MatrixXf> _coarsestFactor;
+};
@@ -1,34 +1,67 @@
 #pragma once
 #include <Eigen/Core>
+#include <cstddef>
 #include <vector>
 
 class Particles {
  public:
+  // Particles [begin, end)
+  struct Range {
+    int begin;
+    int end;
+    bool operator==(const Range& other) const { return begin == other.begin && end == other.end; }
+  };
   Particles(int size = -1, float mass_ = 0.0f) noexcept;
   void resize(int newSize);
   void setZero();
 
   int getCapacity() const { return static_cast<int>(_position.cols()); }
+  // Bytes of position, velocity, acceleration and both mass arrays, padding included
+  std::size_t bytes() const;
   // Get all particles.
   Eigen::Ref<Eigen::Matrix4Xf> position() { return _position; }
   Eigen::Ref<Eigen::Matrix4Xf> velocity() { return _velocity; }
   Eigen::Ref<Eigen::Matrix4Xf> acceleration() { return _acceleration; }
-  std::vector<float>& mass() { return _mass; }
+  const std::vector<float>& mass() const { return _mass; }
   // Get specific particle by index.
   Eigen::Ref<Eigen::Vector4f> position(int i) { return _position.col(i); }
   Eigen::Ref<Eigen::Vector4f> velocity(int i) { return _velocity.col(i); }
   Eigen::Ref<Eigen::Vector4f> acceleration(int i) { return _acceleration.col(i); }
-  float& mass(int i) { return _mass[i]; }
-  float inverseMass(int i) { return (_mass[i] == 0.0f) ? 0.0f : 1.0f / _mass[i]; }
+  // Get a run of particles.
+  Eigen::Ref<Eigen::Matrix4Xf> position(Range r) { return _position.middleCols(r.begin, r.end - r.begin); }
+  Eigen::Ref<Eigen::Matrix4Xf> velocity(Range r) { return _velocity.middleCols(r.begin, r.end - r.begin); }
+  Eigen::Ref<Eigen::Matrix4Xf> acceleration(Range r) { return _acceleration.middleCols(r.begin, r.end - r.begin); }
+  float mass(int i) const { return _mass[i]; }
+  // 1 / m, or 0 for a pinned particle (m == 0), kept up to date by the mass setters
+  float inverseMass(int i) const { return _inverseMass[i]; }
+  void setMass(int i, float mass) {
+    _mass[i] = mass;
+    _inverseMass[i] = inverse(mass);
+  }
+  /**
+   * @brief Set the masses of every particle from `masses`, which holds getCapacity() of them.
+   */
+  void setMass(const float* masses);
+  /**
+   * @brief Get the runs of particles that are simulated, sorted. The others sleep and must be left untouched.
+   * A single run over every particle unless their shape put some of them to sleep, see Cloth::updateSleep.
+   */
+  const std::vector<Range>& activeRanges() const { return _activeRanges; }
+  void setActiveRanges(const std::vector<Range>& ranges) { _activeRanges = ranges; }
 
   const float* getPositionData() const { return _position.data(); }
   const float* getVelocityData() const { return _velocity.data(); }
   const float* getAccelerationData() const { return _acceleration.data(); }
   const float* getMassData() const { return _mass.data(); }
+  const float* getInverseMassData() const { return _inverseMass.data(); }
 
  private:
+  static float inverse(float mass) { return (mass == 0.0f) ? 0.0f : 1.0f / mass; }
+
   Eigen::Matrix4Xf _position;
   Eigen::Matrix4Xf _velocity;
   Eigen::Matrix4Xf _acceleration;
   std::vector<float> _mass;
+  std::vector<float> _inverseMass;
+  std::vector<Range> _activeRanges;
 };
@@ -0,0 +1,114 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "utils.h"
+
+/**
+ * @brief Streams cloth positions into a point cache file, one frame at a time.
+ * The file holds "HW1P", version, particle count, flags, frame count, then the frames back to back. A frame is either
+ * x, y, z floats per particle, or (quantized) the frame's bounding box min and extent followed by 16-bit x, y, z per
+ * particle relative to the box. Frames are buffered in chunks of `pointCacheChunkFrames`, a full chunk is written by a
+ * thread of the writer while the next one fills, so append() only waits for the disk when it falls a whole chunk
+ * behind. The frame count in the header is filled in by close().
+ */
+class PointCacheWriter final {
+ public:
+  DELETE_COPY(PointCacheWriter)
+  DELETE_MOVE(PointCacheWriter)
+  PointCacheWriter() = default;
+  ~PointCacheWriter() { close(); }
+  /**
+   * @brief Start a new cache, returns false when the file cannot be written.
+   *
+   * @param path File to be created or overwritten.
+   * @param particleCount Number of particles per frame.
+   * @param isQuantized Store 16-bit positions relative to each frame's bounding box instead of floats.
+   */
+  bool open(const std::filesystem::path& path, int particleCount, bool isQuantized);
+  /**
+   * @brief Append one frame, `positions` holds 4 floats per particle like Particles::getPositionData().
+   */
+  void append(const float* positions);
+  /**
+   * @brief Flush the last chunk and write the frame count.
+   *
+   * @return false when any write of the cache failed, e.g. because the disk is full.
+   */
+  bool close();
+  bool isOpen() const { return _file.is_open(); }
+  /**
+   * @brief Whether a write failed since open(), later frames are dropped and close() returns false.
+   */
+  bool hasFailed() const { return _hasFailed.load(std::memory_order_relaxed); }
+  std::uint64_t frameCount() const { return _frameCount; }
+
+ private:
+  /// @brief Hand the buffered frames to the writer thread, waiting for it to finish the previous ones
+  void flush();
+  /// @brief Write the chunks handed over by flush() until close()
+  void writeLoop();
+
+  std::ofstream _file;
+  int _particleCount = 0;
+  bool _isQuantized = false;
+  std::size_t _frameSize = 0;
+  std::uint64_t _frameCount = 0;
+  // Encoded frames not handed over yet
+  std::vector<char> _chunk;
+  // Frames being written by _writer, swapped with _chunk so neither is reallocated
+  std::vector<char> _pending;
+  std::thread _writer;
+  // Guards _hasPending and _isClosing
+  std::mutex _mutex;
+  std::condition_variable _condition;
+  bool _hasPending = false;
+  bool _isClosing = false;
+  std::atomic<bool> _hasFailed{false};
+};
+
+/**
+ * @brief Plays a point cache back by memory mapping it, so frames are paged in on demand and a cache larger than
+ * memory can be scrubbed. A cache whose writer never closed it is read up to its last complete frame.
+ */
+class PointCacheReader final {
+ public:
+  DELETE_COPY(PointCacheReader)
+  DELETE_MOVE(PointCacheReader)
+  PointCacheReader() = default;
+  ~PointCacheReader() { close(); }
+  /**
+   * @brief Map a cache written by PointCacheWriter, returns false when it is not one.
+   */
+  bool open(const std::filesystem::path& path);
+  void close();
+  bool isOpen() const { return _data != nullptr; }
+  int particleCount() const { return _particleCount; }
+  std::uint64_t frameCount() const { return _frameCount; }
+  /**
+   * @brief Decode a frame into `positions`, resized to 4 x particleCount() with w = 1 so it can be drawn directly.
+   * Returns false and leaves `positions` alone when `frame` is not below frameCount().
+   */
+  bool readFrame(std::uint64_t frame, Eigen::Matrix4Xf& positions) const;
+
+ private:
+  const unsigned char* _data = nullptr;
+  std::size_t _size = 0;
+#ifdef _WIN32
+  void* _fileHandle = nullptr;
+  void* _mappingHandle = nullptr;
+#endif
+  int _particleCount = 0;
+  bool _isQuantized = false;
+  std::size_t _frameSize = 0;
+  std::uint64_t _frameCount = 0;
+};
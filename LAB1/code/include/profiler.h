@@ -0,0 +1,130 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "configs.h"
+#include "utils.h"
+
+/**
+ * @brief Time spent in each phase of the viewer, shown as rolling histograms and exported as Chrome trace files.
+ * Phases are timed by ScopedTimer from any thread: the simulation thread times the steps, the render thread the
+ * uploads and draws. endFrame() closes the current display frame, the milliseconds each phase took during it go into a
+ * history of the last profileHistoryFrames frames. Scopes may nest and count for every phase they are in, e.g. the
+ * force phases evaluated by a midpoint integrate also count for INTEGRATE. The integrators time their own stages
+ * inside INTEGRATE: the state updates between force evaluations of the explicit ones, the step doubling error control,
+ * backward euler's assembly, multigrid update and solve, and XPBD's prediction and projection. Draws are timed on the
+ * CPU, the GPU may still be busy with them afterwards.
+ * While tracing, every timed scope is also kept as a complete event until writeTrace() saves them in the Chrome trace
+ * format, which chrome://tracing or Perfetto open.
+ */
+class Profiler final {
+ public:
+  DELETE_COPY(Profiler)
+  DELETE_MOVE(Profiler)
+  using Clock = std::chrono::steady_clock;
+  enum class Phase {
+    EXTERNAL_FORCE,
+    SPRING_FORCE,
+    COLLISION,
+    INTEGRATE,
+    // Stages of the integrators, nested in INTEGRATE
+    INTEGRATOR_STAGES,
+    STEP_DOUBLING,
+    ASSEMBLE,
+    MULTIGRID_UPDATE,
+    SOLVE,
+    XPBD_PREDICT,
+    XPBD_PROJECT,
+    FUSED_STEP,
+    STRAIN_LIMIT,
+    SLEEP,
+    UPLOAD,
+    NORMALS,
+    DRAW,
+    COUNT
+  };
+  static constexpr int phaseCount = static_cast<int>(Phase::COUNT);
+  static Profiler& getProfiler();
+  static const char* name(Phase phase);
+  /**
+   * @brief Whether the timers measure anything, either profiling or tracing is on.
+   */
+  bool isActive() const { return isProfiling || _isTracing.load(std::memory_order_relaxed); }
+  /**
+   * @brief Add a scope of `phase` that ran on the calling thread, thread safe.
+   */
+  void add(Phase phase, Clock::time_point begin, Clock::time_point end);
+  /**
+   * @brief Move the time of the current frame into the history, called once per displayed frame.
+   */
+  void endFrame();
+  /**
+   * @brief Milliseconds of `phase` in each frame of the history, a ring of profileHistoryFrames values whose oldest is
+   * at historyOffset().
+   */
+  const float* history(Phase phase) const { return _history[static_cast<int>(phase)].data(); }
+  int historyOffset() const { return _frame % profileHistoryFrames; }
+  /**
+   * @brief Mean milliseconds of `phase` per frame over the history.
+   */
+  float average(Phase phase) const;
+  bool isTracing() const { return _isTracing.load(std::memory_order_relaxed); }
+  /**
+   * @brief Drop the events of the last trace and start keeping new ones, at most profileTraceMaxEvents of them.
+   */
+  void startTrace();
+  /**
+   * @brief Stop tracing and write the events kept since startTrace() as Chrome trace JSON.
+   *
+   * @return Whether the stream was written.
+   */
+  bool writeTrace(std::ostream& stream);
+
+ private:
+  Profiler();
+  struct Event {
+    Phase phase;
+    std::thread::id thread;
+    // Nanoseconds since the profiler was created
+    std::int64_t begin;
+    std::int64_t duration;
+  };
+
+  Clock::time_point _origin;
+  // Nanoseconds of each phase in the current frame
+  std::array<std::atomic<std::int64_t>, phaseCount> _pending{};
+  std::array<std::array<float, profileHistoryFrames>, phaseCount> _history{};
+  int _frame = 0;
+  std::atomic<bool> _isTracing = false;
+  std::mutex _traceMutex;
+  std::vector<Event> _events;
+  // Events that did not fit in the trace
+  std::int64_t _droppedEvents = 0;
+};
+
+/**
+ * @brief Add the time until the end of the scope to a phase of the profiler.
+ * Costs one check when neither profiling nor tracing, so the timers stay in place in release builds.
+ */
+class ScopedTimer final {
+ public:
+  DELETE_COPY(ScopedTimer)
+  DELETE_MOVE(ScopedTimer)
+  explicit ScopedTimer(Profiler::Phase phase) : _phase(phase), _isActive(Profiler::getProfiler().isActive()) {
+    if (_isActive) _begin = Profiler::Clock::now();
+  }
+  ~ScopedTimer() {
+    if (_isActive) Profiler::getProfiler().add(_phase, _begin, Profiler::Clock::now());
+  }
+
+ private:
+  Profiler::Phase _phase;
+  bool _isActive;
+  Profiler::Clock::time_point _begin;
+};
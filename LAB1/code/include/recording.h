@@ -0,0 +1,174 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iosfwd>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "utils.h"
+
+class Cloth;
+class Integrator;
+class Particles;
+class Spheres;
+
+/**
+ * @brief Everything the viewer's controls feed into the simulation.
+ * A step reads nothing else besides the particles and the integrators' carried state, so applying the same inputs at
+ * the same steps reproduces a run bit for bit.
+ */
+struct SimulationInputs {
+  enum Flag : std::uint32_t {
+    MULTITHREADED = 1,
+    VECTORIZED = 2,
+    SELF_COLLIDING = 4,
+    ADAPTIVE = 8,
+    SLEEPING = 16,
+    CONTINUOUS_COLLISION = 32,
+    GROUND_COLLIDING = 64,
+    MULTIGRID = 128,
+    FUSED = 256,
+    STRAIN_LIMITING = 512
+  };
+  // Incremented whenever the scene is restored to its initial state
+  std::uint32_t resetCount = 0;
+  // Index of the selected integrator, same as `currentIntegrator`
+  std::int32_t integrator = 0;
+  // Bit i pins corner i of the cloth
+  std::uint32_t pinnedCorners = 0xF;
+  std::uint32_t flags = 0;
+  std::int32_t simulationPerFrame = 0;
+  float deltaTime = 0.0f;
+  float springCoef = 0.0f;
+  float damperCoef = 0.0f;
+  // Same as the springTypeScale and damperTypeScale globals
+  Eigen::Vector3f springTypeScale = Eigen::Vector3f::Ones();
+  Eigen::Vector3f damperTypeScale = Eigen::Vector3f::Ones();
+  float maxStrain = 0.0f;
+  float minDeltaTime = 0.0f;
+  float maxDeltaTime = 0.0f;
+  float adaptiveTolerance = 0.0f;
+  Eigen::Vector4f sphereVelocity = Eigen::Vector4f::Zero();
+  /**
+   * @brief Read the inputs held by the configs globals. Reset count, pins and sphere velocity are left as they are.
+   */
+  static SimulationInputs fromConfigs();
+  /**
+   * @brief Write the inputs held by the configs globals back.
+   */
+  void applyConfigs() const;
+  /**
+   * @brief Pin the selected corners and set the velocity of sphere 0, the way the viewer does before every step.
+   */
+  void applyToScene(Cloth& cloth, Spheres& spheres) const;
+  bool operator==(const SimulationInputs& other) const;
+  bool operator!=(const SimulationInputs& other) const { return !(*this == other); }
+
+  void write(std::ostream& stream) const;
+  void read(std::istream& stream);
+};
+
+/**
+ * @brief State of a run between two steps, enough to continue it bit for bit.
+ * Written as: "HW1C", version, particles per edge, particle order, step, inputs, then position / velocity / acceleration /
+ * mass of each particle set, the sleep state of the cloth and the carried state of each integrator.
+ */
+struct CheckpointHeader {
+  std::int32_t particlesPerEdge = 0;
+  // Cloth::ParticleOrder of the cloth, the particle indices depend on it
+  std::int32_t particleOrder = 0;
+  // Number of steps taken before the checkpoint
+  std::uint64_t step = 0;
+  // Inputs in effect at that point
+  SimulationInputs inputs;
+};
+
+/**
+ * @brief Write a checkpoint, returns false when the stream failed.
+ *
+ * @param stream Binary output stream.
+ * @param header Step and inputs of the run.
+ * @param cloth The cloth of the scene, for its sleep state.
+ * @param particles Particle sets of the scene, in a fixed order (cloth, spheres).
+ * @param integrators Every integrator of the scene, in a fixed order, not only the current one.
+ */
+bool saveCheckpoint(std::ostream& stream,
+                    const CheckpointHeader& header,
+                    const Cloth& cloth,
+                    const std::vector<Particles*>& particles,
+                    const std::vector<const Integrator*>& integrators);
+/**
+ * @brief Read a checkpoint written by saveCheckpoint into an already built scene of the same size.
+ * Returns false when the stream failed or does not match the scene, the scene is left unspecified then.
+ */
+bool loadCheckpoint(std::istream& stream,
+                    CheckpointHeader& header,
+                    Cloth& cloth,
+                    const std::vector<Particles*>& particles,
+                    const std::vector<Integrator*>& integrators);
+
+/**
+ * @brief Log of the inputs of a run, for replaying it later.
+ * A recording file holds "HW1R", version, the checkpoint the recording started from, then one record per input change:
+ * the step count when the inputs were applied (before that step runs) and the inputs. Inputs hold until the next
+ * record. An end record closes it.
+ */
+class InputRecorder final {
+ public:
+  DELETE_COPY(InputRecorder)
+  DELETE_MOVE(InputRecorder)
+  InputRecorder() = default;
+  /**
+   * @brief Start a new recording from the given state, returns false when the file cannot be written.
+   */
+  bool start(const std::filesystem::path& path,
+             const CheckpointHeader& header,
+             const Cloth& cloth,
+             const std::vector<Particles*>& particles,
+             const std::vector<const Integrator*>& integrators);
+  /**
+   * @brief Log inputs applied before step `step` runs.
+   */
+  void record(std::uint64_t step, const SimulationInputs& inputs);
+  /**
+   * @brief Close the recording, the run ended after `step` steps.
+   */
+  void stop(std::uint64_t step);
+  bool isRecording() const { return _file.is_open(); }
+
+ private:
+  std::ofstream _file;
+};
+
+/**
+ * @brief Read back a recording written by InputRecorder.
+ */
+class InputReplay final {
+ public:
+  DELETE_COPY(InputReplay)
+  DELETE_MOVE(InputReplay)
+  InputReplay() = default;
+  /**
+   * @brief Open a recording and read its header, returns false when it is not a recording.
+   */
+  bool open(const std::filesystem::path& path, CheckpointHeader& header);
+  /**
+   * @brief Load the state the recording started from, into a scene built for header.particlesPerEdge.
+   */
+  bool loadStart(CheckpointHeader& header,
+                 Cloth& cloth,
+                 const std::vector<Particles*>& particles,
+                 const std::vector<Integrator*>& integrators);
+  /**
+   * @brief Read the next record. Returns false at the end record, whose step is the length of the run, and at the end
+   * of a recording that was never stopped, which leaves `step` untouched.
+   */
+  bool next(std::uint64_t& step, SimulationInputs& inputs);
+
+ private:
+  std::ifstream _file;
+  // Where the start checkpoint begins
+  std::streampos _start;
+};
@@ -4,6 +4,7 @@
 #include "particles.h"
 
 class Cloth;
+class Colliders;
 class Spheres;
 
 class Integrator;
@@ -17,13 +18,14 @@ class Shape {
   Eigen::Matrix4f getModelMatrix() const { return modelMatrix; }
   Eigen::Matrix4f getNormalMatrix() const { return normalMatrix; }
   /**
-   * @brief Compute gravity and viscous force.
+   * @brief Compute gravity and viscous force of the active particles.
    *
    */
   void computeExternalForce();
   virtual void collide(Shape* shape) = 0;
   virtual void collide(Cloth*) { return; }
   virtual void collide(Spheres*) { return; }
+  virtual void collide(Colliders*) { return; }
   virtual void collide() { return; }
 
  protected:
@@ -0,0 +1,84 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include <Eigen/Core>
+
+#include "triplebuffer.h"
+#include "utils.h"
+
+class Cloth;
+class Spheres;
+
+/**
+ * @brief Run the simulation on its own thread, paced to one batch of steps per display frame.
+ * Finished frames are published as position snapshots that the render thread reads without locking.
+ * Everything the steps read besides the particles (configs, pins, integrator) may only be changed while
+ * holding lockControls(), the simulation thread only takes that lock for one step at a time.
+ */
+class SimulationThread final {
+ public:
+  DELETE_COPY(SimulationThread)
+  DELETE_MOVE(SimulationThread)
+  // Positions of one simulated frame
+  struct Snapshot {
+    Eigen::Matrix4Xf clothPosition;
+    Eigen::Matrix4Xf spherePosition;
+    // Number of batches simulated before this snapshot, changes whenever the positions may have changed
+    std::uint64_t frame = 0;
+    // Integrator substeps taken by the batch that produced this snapshot
+    int substeps = 0;
+  };
+  /**
+   * @brief Start the simulation thread.
+   *
+   * @param cloth The cloth to be captured.
+   * @param spheres The spheres to be captured.
+   * @param step Simulate and integrate one time step and return the substeps it took, only ever called on the
+   * simulation thread.
+   * @param stepsPerFrame Number of steps in the batch run per frame, called with the controls locked.
+   * @param frameDone Called with the controls locked after every batch that advanced the simulation, e.g. to bake it.
+   * @param frameRate Display refresh rate, one batch is run per frame.
+   */
+  SimulationThread(Cloth& cloth, Spheres& spheres, std::function<int(void)> step, std::function<int(void)> stepsPerFrame,
+                   std::function<void(void)> frameDone, int frameRate);
+  /// @brief Stop and join the simulation thread
+  ~SimulationThread();
+  /**
+   * @brief Wait until the simulation thread is between two steps and keep it there while the lock is held.
+   */
+  std::unique_lock<std::mutex> lockControls();
+  /**
+   * @brief Get the most recently finished frame, only called by the render thread.
+   * It is left untouched by the simulation until the next call.
+   */
+  const Snapshot& latestSnapshot() { return _snapshots.latest(); }
+
+ private:
+  /// @brief Run batches of steps until stopped
+  void simulationLoop();
+  /// @brief Copy the current positions into a snapshot, must hold _mutex
+  void capture(Snapshot& snapshot, int substeps);
+
+  Cloth& _cloth;
+  Spheres& _spheres;
+  std::function<int(void)> _step;
+  std::function<int(void)> _stepsPerFrame;
+  std::function<void(void)> _frameDone;
+  std::chrono::steady_clock::duration _framePeriod;
+  TripleBuffer<Snapshot> _snapshots;
+  // Guards everything a step reads, taken by the simulation thread once per step
+  std::mutex _mutex;
+  std::condition_variable _stopCondition;
+  // Threads waiting in lockControls(), the simulation thread lets them in before its next step
+  std::atomic<int> _controlRequests{0};
+  bool _isStopping = false;
+  // Only used by the simulation thread
+  std::uint64_t _frame = 0;
+  std::thread _thread;
+};
@@ -0,0 +1,44 @@
+#pragma once
+#include <Eigen/Core>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Uniform grid over a set of points, stored as a hash table of cells.
+ * It is rebuilt from scratch with a counting sort, which does not allocate once the tables have grown to the point
+ * count. Cells that hash to the same bucket share it, so queries may return a few points outside of the box.
+ */
+class SpatialHash {
+ public:
+  /**
+   * @brief Sort the points into cells.
+   *
+   * @param points Points to be hashed, one per column (w is ignored).
+   * @param cellSize Edge length of a cell.
+   */
+  void build(const Eigen::Ref<const Eigen::Matrix4Xf>& points, float cellSize);
+  /**
+   * @brief Collect the points in every cell overlapped by an axis aligned box.
+   *
+   * @param lower Lower corner of the box.
+   * @param upper Upper corner of the box.
+   * @param result Indices of the points, in ascending order and without duplicates.
+   */
+  void query(const Eigen::Vector4f& lower, const Eigen::Vector4f& upper, std::vector<int>& result);
+
+ private:
+  /// @brief Integer cell coordinates of a point
+  Eigen::Vector3i cellOf(const Eigen::Vector4f& point) const;
+  /// @brief Bucket of a cell
+  int hashCell(const Eigen::Vector3i& cell) const;
+
+  float _inverseCellSize = 1.0f;
+  int _mask = 0;
+  // Bucket b owns _entries[_bucketStart[b], _bucketStart[b + 1])
+  std::vector<int> _bucketStart;
+  // Point indices sorted by bucket
+  std::vector<int> _entries;
+  std::vector<int> _pointBucket;
+  // Scratch bitmap of query, all zero between calls
+  std::vector<std::uint64_t> _marks;
+};
@@ -1,31 +1,69 @@
 #pragma once
 #include <Eigen/Core>
+#include <cstdint>
 #include <vector>
 
-#include "buffer.h"
 #include "shape.h"
+#include "spatialhash.h"
 #include "utils.h"
+#ifndef HW1_HEADLESS
+#include "buffer.h"
 #include "vertexarray.h"
+#endif
 
 class Spheres final : public Shape {
  public:
   MOVE_ONLY(Spheres)
   static Spheres& initSpheres();
   void addSphere(const Eigen::Ref<const Eigen::Vector4f>& position, float size);
+#ifndef HW1_HEADLESS
+  // Upload the sphere positions of `frame` for the following draws, e.g. a snapshot taken by the simulation thread.
+  // Returns at once when `frame` is already uploaded.
+  void upload(const Eigen::Matrix4Xf& positions, std::uint64_t frame);
+  // Render the spheres at the last uploaded positions.
   void draw() const;
+#endif
   void collide(Shape* shape) override;
+  /**
+   * @brief Sphere collide with cloth, colliding spheres and cloth particles exchange impulses.
+   * When `isContinuousCollision` is set, each sphere is swept over the next step against the particles and against
+   * the structural and shear edges, so a fast sphere can neither jump over a particle between two steps nor slip
+   * between two particles.
+   *
+   * @param cloth The cloth to be tested.
+   */
   void collide(Cloth* cloth) override;
+  // Number of spheres, the particles may have spare capacity
+  int size() const { return sphereCount; }
   float radius(int i) const { return _radius[i]; }
   void setVelocity(int i, const Eigen::Vector4f vel);
 
  private:
   Spheres();
+  /**
+   * @brief Collide the spheres and the cloth as they are at the start of the step.
+   *
+   */
+  void collideDiscrete(Cloth* cloth);
+  /**
+   * @brief Collide the spheres and the cloth along their straight paths over the next step.
+   * A pair that would touch within the step only keeps enough of its approach speed to close the gap by the end of
+   * it. Edges take the point closest to the sphere's path relative to them, so their contacts are approximate.
+   */
+  void collideSwept(Cloth* cloth);
 
   int sphereCount;
   std::vector<float> _radius;
+  // Broad phase of collide(Cloth*), rebuilt on every call
+  SpatialHash _clothHash;
+  std::vector<int> _candidates;
+  // Marks the candidates of the current sphere, all zero between calls
+  std::vector<std::uint8_t> _isCandidate;
+#ifndef HW1_HEADLESS
   VertexArray vao;
   ArrayBuffer vbo;
   ArrayBuffer offsets;
   ArrayBuffer sizes;
   ElementArrayBuffer ebo;
+#endif
 };
@@ -0,0 +1,148 @@
+#pragma once
+#include <Eigen/Core>
+#include <cstddef>
+#include <vector>
+
+#include "particles.h"
+#include "spring.h"
+
+/**
+ * @brief Structure-of-arrays spring force kernel.
+ * Springs are packed into runs where both start and end index grow by one per spring, which is how every spring
+ * family of the cloth grid is emitted. A run reads and writes contiguous particles, so it maps to plain SIMD loads
+ * and stores on SoA copies of the particle state instead of gathers and scatters.
+ */
+class SpringKernel {
+ public:
+  /**
+   * @brief Pack the springs, keeping their order. Short gaps between runs are padded with springs of zero stiffness and damping.
+   *
+   * @param springs The springs to be packed.
+   */
+  void assign(const std::vector<Spring>& springs);
+  /**
+   * @brief Scale the stiffness and damping of each spring, given in the order of the springs passed to assign() or
+   * assignTiles(). A spring's coefficients are the ones passed to the compute methods times its scales, 1 until set.
+   */
+  void setScales(const std::vector<float>& stiffness, const std::vector<float>& damping);
+  /**
+   * @brief Accumulate spring and damper force of all packed springs into the particles' acceleration.
+   *
+   * @param particles Particles the springs are attached to.
+   * @param stiffness Spring coefficient, see setScales().
+   * @param damping Damper coefficient, see setScales().
+   * @param isParallel Split the springs over the thread pool, each thread accumulates into its own force buffer.
+   */
+  void compute(Particles& particles, float stiffness, float damping, bool isParallel);
+  /**
+   * @brief Same on the calling thread, for springs attached to particles [firstParticle, firstParticle + particleCount)
+   * of a larger store. Their indices are relative to firstParticle, e.g. one cloth of a ClothBatch.
+   */
+  void compute(Particles& particles, int firstParticle, int particleCount, float stiffness, float damping);
+  /**
+   * @brief Same on the calling thread, with the particles in SoA rows of the caller instead, e.g. CompactParticles.
+   * Rows hold one component of every particle the springs are attached to, the forces are added to `force` as they
+   * are, not divided by the masses.
+   *
+   * @param position x, y and z rows.
+   * @param velocity vx, vy and vz rows, in float or Eigen::half.
+   * @param force x, y and z rows.
+   */
+  template <typename VelocityScalar>
+  void computeRows(const float* const* position, const VelocityScalar* const* velocity, float* const* force,
+                   float stiffness, float damping) const;
+  /**
+   * @brief Pack the springs tile by tile instead, for the tile methods below.
+   * Tile t holds the springs whose later particle is in [t * tileSize, (t + 1) * tileSize), in their order and in runs
+   * like assign(). Going through the tiles in order, a particle has all of its springs once the tile of its farthest
+   * neighbor is done. See FusedEulerStep.
+   *
+   * @param springs The springs to be packed.
+   * @param particleCount Number of particles the springs are attached to.
+   * @param tileSize Particles per tile.
+   */
+  void assignTiles(const std::vector<Spring>& springs, int particleCount, int tileSize);
+  /**
+   * @brief Copy particles [begin, end) into the SoA state and clear their forces.
+   * Must come before the springs of their tile are computed, later tiles do not change them.
+   */
+  void loadTile(Particles& particles, int begin, int end) { loadState(particles, 0, begin, end); }
+  /**
+   * @brief Add the spring and damper forces of the springs of tile `tile` to their particles' forces.
+   * Nothing is written to the particles, see force().
+   *
+   * @param owner When given, only the particles i with ownerBegin <= owner[i] < ownerEnd get the forces, so threads
+   * that compute the same tile for particles on both sides of their boundary never write the same particle. The sums do
+   * not depend on it.
+   */
+  void computeTile(int tile, float stiffness, float damping, const int* owner = nullptr, int ownerBegin = 0,
+                   int ownerEnd = 0);
+  // SoA state copied by loadTile(): x, y, z, vx, vy, vz and inverse mass
+  using StateMatrix = Eigen::Matrix<float, 7, Eigen::Dynamic, Eigen::RowMajor>;
+  const StateMatrix& state() const { return _state; }
+  // x, y, z of the spring and damper force summed by computeTile()
+  using ForceMatrix = Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+  const ForceMatrix& force() const { return _force; }
+  // Bytes of the SoA state and the force accumulators, 0 until the first compute
+  std::size_t scratchBytes() const { return static_cast<std::size_t>(_state.size() + _force.size()) * sizeof(float); }
+  /**
+   * @brief Name of the instruction set the kernel was built for: "avx512", "avx2" or "scalar".
+   * It follows the compiler flags picked by the top level CMakeLists.txt (-march=native, or /arch from cmake/cputest).
+   */
+  static const char* name();
+
+ private:
+  struct Run {
+    int firstSpring;
+    int springCount;
+    int startParticle;
+    int endParticle;
+  };
+  /**
+   * @brief Drop the packed springs and size the slot table for `springCount` new ones.
+   */
+  void clearSprings(size_t springCount);
+  /**
+   * @brief Append a spring to the last run when it continues it, possibly across a short gap, else start a new run.
+   *
+   * @return The spring's index in the packed table.
+   */
+  int packSpring(const Spring& spring, bool canJoin);
+  /**
+   * @brief Append a spring to the packed table with unit scales and return its index.
+   */
+  int appendSpring(const Spring& spring);
+  /**
+   * @brief Evaluate springs [beginSpring, endSpring) run by run and add the forces to the given buffer.
+   */
+  void computeRuns(int beginSpring, int endSpring, float* force, float stiffness, float damping) const;
+  /**
+   * @brief Same with the state read from `state`, a set of SoA rows, and the forces added to 3 rows.
+   */
+  template <typename Rows>
+  void computeRuns(const Rows& state, int beginSpring, int endSpring, float* const* force, float stiffness,
+                   float damping) const;
+  /**
+   * @brief Copy particles [firstParticle + begin, firstParticle + end) into the SoA state and clear their forces.
+   */
+  void loadState(Particles& particles, int firstParticle, int begin, int end);
+  /**
+   * @brief Add the forces of [begin, end) summed over `threadCount` accumulators to the particles' acceleration.
+   */
+  void storeForce(Particles& particles, int firstParticle, int threadCount, int begin, int end);
+
+  // Packed spring table
+  std::vector<float> _restLength;
+  // Scales of setScales(), 0 for the springs padding the gaps between runs
+  std::vector<float> _stiffnessScale;
+  std::vector<float> _dampingScale;
+  // Index in the packed table of each spring given to assign() or assignTiles()
+  std::vector<int> _slots;
+  std::vector<Run> _runs;
+  // Tile t owns runs [_tileRuns[t], _tileRuns[t + 1]), empty unless packed by assignTiles
+  std::vector<int> _tileRuns;
+  // SoA copies of position, velocity and inverse mass, one row per component
+  StateMatrix _state;
+  // Force accumulators, 3 rows per thread
+  ForceMatrix _force;
+};
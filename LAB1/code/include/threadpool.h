@@ -0,0 +1,52 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "utils.h"
+
+class ThreadPool final {
+ public:
+  // Not copyable
+  DELETE_COPY(ThreadPool)
+  // Not movable
+  DELETE_MOVE(ThreadPool)
+  /// @brief Stop and join the workers
+  ~ThreadPool();
+  /// @brief Get the shared pool, it uses one thread per hardware thread (the caller included).
+  static ThreadPool& getPool();
+  /// @return Number of threads taking part in parallelFor, including the calling thread.
+  int size() const { return static_cast<int>(workers.size()) + 1; }
+  /**
+   * @brief Split [0, count) into contiguous chunks and run them in parallel. Returns when every chunk is done.
+   * Calls from different threads (e.g. the simulation and the render thread) run one after the other.
+   * Must not be called from inside a task.
+   *
+   * @param count Number of items.
+   * @param task Called as task(begin, end) once per chunk.
+   * @param grainSize Minimum number of items per chunk, small ranges run on the calling thread only.
+   */
+  void parallelFor(int count, const std::function<void(int, int)>& task, int grainSize = 1);
+
+ private:
+  /// @brief Create the workers, call by getPool
+  explicit ThreadPool(int threadCount);
+  /// @brief Wait for new jobs and run the chunk assigned to this worker
+  void workerLoop(int chunk);
+
+  std::vector<std::thread> workers;
+  // Held for a whole parallelFor, the pool runs one job at a time
+  std::mutex callerMutex;
+  std::mutex mutex;
+  std::condition_variable wakeCondition;
+  std::condition_variable doneCondition;
+  // Current job, guarded by mutex
+  const std::function<void(int, int)>* currentTask = nullptr;
+  int itemCount = 0;
+  int chunkCount = 0;
+  int pendingChunks = 0;
+  unsigned int generation = 0;
+  bool isStopping = false;
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <array>
+#include <atomic>
+
+#include "utils.h"
+
+/**
+ * @brief Lock-free triple buffer between one writer and one reader thread.
+ * The writer fills back() and publishes it, the reader gets the most recently published slot from latest().
+ * Neither side ever waits for the other, the reader may see the same slot again or skip slots.
+ */
+template <typename T>
+class TripleBuffer final {
+ public:
+  DELETE_COPY(TripleBuffer)
+  DELETE_MOVE(TripleBuffer)
+  /**
+   * @brief Fill all three slots with `value`, so the reader has something to show before the first publish.
+   */
+  explicit TripleBuffer(const T& value) : _slots{value, value, value} {}
+  /**
+   * @brief Get the slot owned by the writer.
+   */
+  T& back() { return _slots[_back]; }
+  /**
+   * @brief Hand the back slot to the reader, the writer continues with the slot the reader is not using.
+   */
+  void publish() { _back = _middle.exchange(_back | freshBit, std::memory_order_acq_rel) & indexMask; }
+  /**
+   * @brief Get the most recently published slot, it stays untouched by the writer until the next call.
+   */
+  const T& latest() {
+    if (_middle.load(std::memory_order_relaxed) & freshBit) {
+      _front = _middle.exchange(_front, std::memory_order_acq_rel) & indexMask;
+    }
+    return _slots[_front];
+  }
+
+ private:
+  // _middle holds a slot index plus a flag telling whether it was published after the reader's last swap
+  static constexpr int indexMask = 3;
+  static constexpr int freshBit = 4;
+  std::array<T, 3> _slots;
+  int _back = 0;
+  std::atomic<int> _middle{1};
+  int _front = 2;
+};
@@ -0,0 +1,464 @@
+#include <Eigen/Geometry>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "cloth.h"
+#include "collider.h"
+#include "compactparticles.h"
+#include "configs.h"
+#include "fusedstep.h"
+#include "integrator.h"
+#include "sphere.h"
+#include "springkernel.h"
+#include "threadpool.h"
+
+namespace {
+// Number of heap allocations made by the whole process.
+std::atomic<long long> allocationCount{0};
+}  // namespace
+
+// Count heap traffic so we can check that a steady-state step does not allocate.
+#ifdef __GLIBC__
+// Eigen allocates with std::malloc directly, so interpose malloc itself on glibc. operator new ends up here too.
+extern "C" {
+void* __libc_malloc(std::size_t size);
+void* __libc_calloc(std::size_t count, std::size_t size);
+void* __libc_realloc(void* pointer, std::size_t size);
+
+void* malloc(std::size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void* calloc(std::size_t count, std::size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, std::size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(pointer, size);
+}
+}
+#else
+// Elsewhere only operator new can be replaced portably, Eigen's matrices are not counted.
+void* operator new(std::size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  if (void* pointer = std::malloc(size == 0 ? 1 : size)) return pointer;
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) { return ::operator new(size); }
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+void operator delete[](void* pointer) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::size_t) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, std::size_t) noexcept { std::free(pointer); }
+#endif
+
+namespace {
+struct Options {
+  int steps = 2000;
+  int warmup = 200;
+  float deltaTime = 0.0f;
+  std::vector<int> resolutions{defaultParticlesPerEdge};
+  bool isMultithreaded = false;
+  bool isVectorized = true;
+  int extraSpheres = 0;
+  bool isSelfColliding = false;
+  bool isContinuousCollision = true;
+  bool isAdaptive = false;
+  bool isSleeping = false;
+  bool hasColliders = false;
+  bool isMultigrid = false;
+  bool isFused = false;
+  bool isStrainLimiting = false;
+  float maxStrain = 0.0f;
+  Eigen::Vector3f springTypeScale = Eigen::Vector3f::Ones();
+  // Stiffness of the structural springs along the columns relative to the ones along the rows
+  float weftScale = 1.0f;
+  // Compare the particle layouts instead of the integrators
+  bool isComparingLayouts = false;
+  Cloth::ParticleOrder particleOrder = Cloth::ParticleOrder::GRID;
+};
+
+void printUsage(const char* program) {
+  std::cerr << "Usage: " << program
+            << " [--steps N] [--warmup N] [--delta-time H] [--resolution N[,N...]] [--multithread] [--no-simd]"
+               " [--spheres N] [--self-collision] [--discrete] [--adaptive] [--morton] [--sleep] [--colliders]"
+               " [--multigrid] [--fused] [--strain-limit STRAIN] [--spring-types S,S,S] [--weft SCALE] [--layouts]"
+            << std::endl;
+}
+
+bool parseResolutions(const char* argument, std::vector<int>& resolutions) {
+  resolutions.clear();
+  std::stringstream stream(argument);
+  std::string token;
+  while (std::getline(stream, token, ',')) {
+    int resolution = std::atoi(token.c_str());
+    if (resolution < 3) return false;
+    resolutions.emplace_back(resolution);
+  }
+  return !resolutions.empty();
+}
+
+bool parseScales(const char* argument, Eigen::Vector3f& scales) {
+  std::stringstream stream(argument);
+  std::string token;
+  for (int i = 0; i < 3; ++i) {
+    if (!std::getline(stream, token, ',')) return false;
+    scales[i] = static_cast<float>(std::atof(token.c_str()));
+    if (scales[i] < 0.0f) return false;
+  }
+  return !std::getline(stream, token, ',');
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+      options.steps = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      options.warmup = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--delta-time") == 0 && i + 1 < argc) {
+      options.deltaTime = static_cast<float>(std::atof(argv[++i]));
+    } else if (std::strcmp(argv[i], "--resolution") == 0 && i + 1 < argc) {
+      if (!parseResolutions(argv[++i], options.resolutions)) return false;
+    } else if (std::strcmp(argv[i], "--multithread") == 0) {
+      options.isMultithreaded = true;
+    } else if (std::strcmp(argv[i], "--no-simd") == 0) {
+      options.isVectorized = false;
+    } else if (std::strcmp(argv[i], "--spheres") == 0 && i + 1 < argc) {
+      options.extraSpheres = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--self-collision") == 0) {
+      options.isSelfColliding = true;
+    } else if (std::strcmp(argv[i], "--discrete") == 0) {
+      options.isContinuousCollision = false;
+    } else if (std::strcmp(argv[i], "--adaptive") == 0) {
+      options.isAdaptive = true;
+    } else if (std::strcmp(argv[i], "--sleep") == 0) {
+      options.isSleeping = true;
+    } else if (std::strcmp(argv[i], "--colliders") == 0) {
+      options.hasColliders = true;
+    } else if (std::strcmp(argv[i], "--multigrid") == 0) {
+      options.isMultigrid = true;
+    } else if (std::strcmp(argv[i], "--fused") == 0) {
+      options.isFused = true;
+    } else if (std::strcmp(argv[i], "--strain-limit") == 0 && i + 1 < argc) {
+      options.isStrainLimiting = true;
+      options.maxStrain = static_cast<float>(std::atof(argv[++i]));
+    } else if (std::strcmp(argv[i], "--spring-types") == 0 && i + 1 < argc) {
+      if (!parseScales(argv[++i], options.springTypeScale)) return false;
+    } else if (std::strcmp(argv[i], "--weft") == 0 && i + 1 < argc) {
+      options.weftScale = static_cast<float>(std::atof(argv[++i]));
+    } else if (std::strcmp(argv[i], "--layouts") == 0) {
+      options.isComparingLayouts = true;
+    } else if (std::strcmp(argv[i], "--morton") == 0) {
+      options.particleOrder = Cloth::ParticleOrder::MORTON;
+    } else {
+      return false;
+    }
+  }
+  return options.steps > 0 && options.warmup >= 0 && options.deltaTime >= 0.0f && options.extraSpheres >= 0 &&
+         options.maxStrain >= 0.0f && options.weftScale >= 0.0f;
+}
+
+// Peak resident set size of this process in KiB.
+long peakResidentSetKB() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return -1;
+  return static_cast<long>(counters.PeakWorkingSetSize / 1024);
+#else
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+#ifdef __APPLE__
+  // macOS reports bytes instead of KiB
+  return static_cast<long>(usage.ru_maxrss / 1024);
+#else
+  return static_cast<long>(usage.ru_maxrss);
+#endif
+#endif
+}
+
+// Closed torus around the y axis, a mesh that no analytic collider covers
+void torusMesh(float majorRadius, float minorRadius, Eigen::Matrix4Xf& vertices, std::vector<unsigned int>& triangles) {
+  constexpr int rings = 24;
+  constexpr int sides = 12;
+  vertices.resize(4, rings * sides);
+  for (int i = 0; i < rings; ++i) {
+    const float u = static_cast<float>(2 * EIGEN_PI * i / rings);
+    for (int j = 0; j < sides; ++j) {
+      const float v = static_cast<float>(2 * EIGEN_PI * j / sides);
+      const float r = majorRadius + minorRadius * std::cos(v);
+      vertices.col(i * sides + j) = Eigen::Vector4f(r * std::cos(u), minorRadius * std::sin(v), r * std::sin(u), 1);
+    }
+  }
+  triangles.clear();
+  for (int i = 0; i < rings; ++i) {
+    for (int j = 0; j < sides; ++j) {
+      const unsigned int a = i * sides + j;
+      const unsigned int b = ((i + 1) % rings) * sides + j;
+      const unsigned int c = i * sides + (j + 1) % sides;
+      const unsigned int d = ((i + 1) % rings) * sides + (j + 1) % sides;
+      triangles.insert(triangles.end(), {a, b, c, b, d, c});
+    }
+  }
+}
+
+// A ground plane and one collider of each other type, where the cloth drapes over them
+void addColliders(Colliders& colliders) {
+  colliders.addPlane(Eigen::Vector4f(0, -1, 0, 1), Eigen::Vector4f(0, 1, 0, 0));
+  // A capsule lying along z, like the arm of a character
+  Eigen::Matrix4f pose = Eigen::Matrix4f::Identity();
+  pose.topLeftCorner<3, 3>() = Eigen::AngleAxisf(toRadians(90), Eigen::Vector3f::UnitX()).toRotationMatrix();
+  pose.topRightCorner<3, 1>() = Eigen::Vector3f(1.4f, 0.3f, 0);
+  colliders.addCapsule(pose, 0.8f, 0.2f);
+  pose.topRightCorner<3, 1>() = Eigen::Vector3f(-1.4f, 0.3f, 0);
+  colliders.addBox(pose, Eigen::Vector3f(0.2f, 0.8f, 0.2f));
+  Eigen::Matrix4Xf vertices;
+  std::vector<unsigned int> triangles;
+  torusMesh(0.4f, 0.15f, vertices, triangles);
+  pose.setIdentity();
+  pose.topRightCorner<3, 1>() = Eigen::Vector3f(0, 0.4f, 1.4f);
+  colliders.addField(pose, SignedDistanceField(vertices, triangles, 0.05f));
+}
+
+// Largest relative stretch of a structural spring, NaN once the cloth blew up
+float maxStructuralStrain(Cloth& cloth) {
+  // std::max drops NaN lengths, a diverged cloth would report no stretch at all
+  if (!cloth.particles().position().allFinite()) return std::numeric_limits<float>::quiet_NaN();
+  float strain = 0.0f;
+  for (const Spring& spring : cloth.springs()) {
+    if (spring.type() != Spring::Type::STRUCTURAL) continue;
+    const Eigen::Vector4f delta =
+        cloth.particles().position(spring.startParticleIndex()) - cloth.particles().position(spring.endParticleIndex());
+    strain = std::max(strain, delta.norm() / spring.length() - 1.0f);
+  }
+  return strain;
+}
+
+// Scale the stiffness of the structural springs along the columns of the cloth
+void setWeftScale(Cloth& cloth, float weftScale) {
+  const int particlesPerEdge = cloth.particlesPerEdge();
+  std::vector<int> row(particlesPerEdge * particlesPerEdge);
+  for (int i = 0; i < particlesPerEdge; ++i) {
+    for (int j = 0; j < particlesPerEdge; ++j) row[cloth.particleIndex(i, j)] = i;
+  }
+  // The structural springs between two rows run along the columns
+  for (int i = 0; i < static_cast<int>(cloth.springs().size()); ++i) {
+    const Spring& spring = cloth.springs()[i];
+    const bool isWeft = row[spring.startParticleIndex()] != row[spring.endParticleIndex()];
+    if (spring.type() == Spring::Type::STRUCTURAL && isWeft) cloth.setSpringMaterial(i, weftScale, 1.0f);
+  }
+}
+
+// Nanoseconds and allocations per step of `step`, after the warmup steps
+template <typename Step>
+std::pair<double, double> timeSteps(const Options& options, Step&& step) {
+  for (int i = 0; i < options.warmup; ++i) step();
+  long long allocationsBefore = allocationCount.load(std::memory_order_relaxed);
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < options.steps; ++i) step();
+  auto end = std::chrono::steady_clock::now();
+  long long allocations = allocationCount.load(std::memory_order_relaxed) - allocationsBefore;
+  double elapsed = std::chrono::duration<double, std::nano>(end - begin).count();
+  return {elapsed / options.steps, static_cast<double>(allocations) / options.steps};
+}
+
+void printLayout(const char* layout, const char* velocity, const char* springKernel, int particlesPerEdge,
+                 std::size_t stateBytes, std::size_t scratchBytes, std::pair<double, double> timing, float deviation) {
+  const int particleCount = particlesPerEdge * particlesPerEdge;
+  std::cout << layout << ',' << particlesPerEdge << ',' << velocity << ',' << springKernel << ',' << stateBytes << ','
+            << scratchBytes << ','
+            << static_cast<double>(stateBytes + scratchBytes) / particleCount << ',' << timing.first << ','
+            << 1e9 / timing.first << ',' << timing.second << ',' << deviation << std::endl;
+}
+
+// Largest distance between the cloth particles and the ones of `reference`
+float maxDeviation(Particles& particles, Particles& reference) {
+  return (particles.position().topRows<3>() - reference.position().topRows<3>()).colwise().norm().maxCoeff();
+}
+
+template <typename VelocityScalar>
+void benchmarkCompactLayout(Cloth& cloth, const Particles& initial, Particles& reference, const char* velocity,
+                            const Options& options) {
+  cloth.particles() = initial;
+  CompactEulerStep<VelocityScalar> compactStep(cloth);
+  const auto timing = timeSteps(options, [&]() { compactStep.step(); });
+  compactStep.particles().store(cloth.particles());
+  // CompactEulerStep always runs the SIMD kernel, whatever `isVectorized` says
+  printLayout("compact", velocity, SpringKernel::name(), cloth.particlesPerEdge(), compactStep.particles().bytes(),
+              compactStep.scratchBytes(), timing, maxDeviation(cloth.particles(), reference));
+}
+
+// Step the cloth alone with explicit euler in each particle layout and print one CSV row per layout.
+void benchmarkLayouts(int particlesPerEdge, const Options& options) {
+  Cloth cloth(particlesPerEdge, options.particleOrder);
+  if (options.weftScale != 1.0f) setWeftScale(cloth, options.weftScale);
+  const Particles initial = cloth.particles();
+  ExplicitEuler explicitEuler;
+  std::vector<Particles*> particles{&cloth.particles()};
+  const auto timing = timeSteps(options, [&]() {
+    cloth.computeExternalForce();
+    cloth.computeSpringForce();
+    explicitEuler.integrate(particles, nullptr);
+  });
+  Particles reference = cloth.particles();
+  // The loop over the springs needs no scratch, so the kernel's stays empty without `isVectorized`
+  printLayout("padded", "float", isVectorized ? SpringKernel::name() : "loop", particlesPerEdge,
+              cloth.particles().bytes(), cloth.springKernel().scratchBytes(), timing, 0.0f);
+  benchmarkCompactLayout<float>(cloth, initial, reference, "float", options);
+  benchmarkCompactLayout<Eigen::half>(cloth, initial, reference, "half", options);
+}
+
+// Run every integrator on a cloth with the given resolution and print one CSV row per integrator.
+void benchmarkResolution(int particlesPerEdge, const Options& options, Spheres& spheres, Colliders& colliders) {
+  Cloth cloth(particlesPerEdge, options.particleOrder);
+  if (options.weftScale != 1.0f) setWeftScale(cloth, options.weftScale);
+  ExplicitEuler explicitEuler;
+  ImplicitEuler implicitEuler;
+  MidpointEuler midpointEuler;
+  RungeKuttaFourth rk4;
+  BackwardEuler backwardEuler(cloth);
+  XPBD xpbd(cloth);
+  FusedEulerStep fusedStep(cloth);
+  std::vector<std::pair<const char*, Integrator*>> integrators{
+      {"explicit_euler", &explicitEuler},
+      {"implicit_euler", &implicitEuler},
+      {"midpoint_euler", &midpointEuler},
+      {"runge_kutta_fourth", &rk4},
+      {"backward_euler", &backwardEuler},
+      {"xpbd", &xpbd},
+  };
+  Integrator* integrator = nullptr;
+  std::function<void(void)> simulateOneStep = [&]() {
+    cloth.computeExternalForce();
+    // XPBD solves the springs as constraints instead
+    if (integrator->getType() != Integrator::Type::XPBD) cloth.computeSpringForce();
+    spheres.collide(&cloth);
+    colliders.collide(&cloth);
+    cloth.collide();
+  };
+
+  std::vector<Particles*> particles{&cloth.particles(), &spheres.particles()};
+  Particles initialCloth = cloth.particles();
+  Particles initialSpheres = spheres.particles();
+
+  for (const auto& [name, current] : integrators) {
+    integrator = current;
+    cloth.particles() = initialCloth;
+    spheres.particles() = initialSpheres;
+    long long substeps = 0;
+    long long solverIterations = 0;
+    auto step = [&]() {
+      if (FusedEulerStep::isApplicable(*integrator, cloth, spheres, options.hasColliders)) {
+        fusedStep.step(spheres);
+      } else {
+        simulateOneStep();
+        integrator->integrate(particles, simulateOneStep);
+      }
+      cloth.limitStrain();
+      cloth.updateSleep();
+      substeps += integrator->substepCount();
+      if (integrator == &backwardEuler) solverIterations += backwardEuler.iterations();
+    };
+    for (int i = 0; i < options.warmup; ++i) step();
+
+    substeps = 0;
+    solverIterations = 0;
+    long long allocationsBefore = allocationCount.load(std::memory_order_relaxed);
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < options.steps; ++i) step();
+    auto end = std::chrono::steady_clock::now();
+    long long allocations = allocationCount.load(std::memory_order_relaxed) - allocationsBefore;
+    // An adaptive step covers a whole frame of simulationPerFrame * deltaTime
+    float stepTime = deltaTime * static_cast<float>(simulationPerFrame / integrator->stepsPerFrame());
+
+    double elapsed = std::chrono::duration<double, std::nano>(end - begin).count();
+    double nsPerStep = elapsed / options.steps;
+    int threads = isMultithreaded ? ThreadPool::getPool().size() : 1;
+    const char* springKernel = isVectorized ? SpringKernel::name() : "loop";
+    // See Cloth::computeSpringForce
+    if (options.particleOrder == Cloth::ParticleOrder::MORTON) springKernel = "gather";
+    if (FusedEulerStep::isApplicable(*integrator, cloth, spheres, options.hasColliders)) springKernel = "fused";
+    std::cout << name << ',' << particlesPerEdge << ',' << options.extraSpheres + 1 << ',' << threads << ',' << springKernel
+              << ',' << stepTime << ',' << options.steps << ',' << nsPerStep << ','
+              << 1e9 / nsPerStep << ',' << static_cast<double>(allocations) / options.steps << ','
+              << peakResidentSetKB() << ',' << static_cast<double>(substeps) / options.steps << ','
+              << cloth.awakeParticleCount() << ',' << static_cast<double>(solverIterations) / options.steps << ','
+              << maxStructuralStrain(cloth) << std::endl;
+  }
+  spheres.particles() = initialSpheres;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (options.deltaTime > 0.0f) {
+    deltaTime = options.deltaTime;
+    simulationPerFrame = std::max(1, static_cast<int>(baseSpeed / deltaTime));
+  }
+  // The compact layouts step on one thread, so does the padded one they are compared with
+  isMultithreaded = options.isMultithreaded && !options.isComparingLayouts;
+  isVectorized = options.isVectorized;
+  isSelfColliding = options.isSelfColliding;
+  isContinuousCollision = options.isContinuousCollision;
+  isAdaptive = options.isAdaptive;
+  isSleeping = options.isSleeping;
+  isMultigrid = options.isMultigrid;
+  isFused = options.isFused;
+  isStrainLimiting = options.isStrainLimiting;
+  maxStrain = options.maxStrain;
+  springTypeScale = options.springTypeScale;
+  if (options.isComparingLayouts) {
+    std::cout << "layout,particles_per_edge,velocity,spring_kernel,state_bytes,scratch_bytes,bytes_per_particle,"
+                 "ns_per_step,steps_per_sec,allocs_per_step,max_deviation"
+              << std::endl;
+    for (int resolution : options.resolutions) benchmarkLayouts(resolution, options);
+    return 0;
+  }
+  // Same scene as HW1: a pinned cloth above a unit sphere at the origin.
+  Spheres& spheres = Spheres::initSpheres();
+  spheres.addSphere(Eigen::Vector4f(0, 0, 0, 1), 1.0f);
+  // Extra colliders: a square grid of small spheres just below the cloth, thrown upwards into it
+  int sphereGrid = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(options.extraSpheres))));
+  for (int i = 0; i < options.extraSpheres; ++i) {
+    float x = -clothWidth + (i % sphereGrid + 0.5f) * 2.0f * clothWidth / sphereGrid;
+    float z = -clothHeight + (i / sphereGrid + 0.5f) * 2.0f * clothHeight / sphereGrid;
+    spheres.addSphere(Eigen::Vector4f(x, 0.8f, z, 1), 0.1f);
+    spheres.setVelocity(i + 1, Eigen::Vector4f(0, 1, 0, 0));
+  }
+
+  // Empty unless asked for, colliding with it is then free
+  Colliders colliders;
+  if (options.hasColliders) addColliders(colliders);
+
+  std::cout << "integrator,particles_per_edge,spheres,threads,spring_kernel,delta_time,steps,ns_per_step,steps_per_sec,allocs_per_step,"
+               "peak_rss_kb,substeps_per_step,awake_particles,solver_iterations,max_strain"
+            << std::endl;
+  for (int resolution : options.resolutions) benchmarkResolution(resolution, options, spheres, colliders);
+  return 0;
+}
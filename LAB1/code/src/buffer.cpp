@@ -1,8 +1,13 @@
 #include "buffer.h"
 
+#include <cstring>
+
 Buffer::Buffer() noexcept : _handle(0), _size(0) { glGenBuffers(1, &_handle); }
 
-Buffer::~Buffer() { glDeleteBuffers(1, &_handle); }
+Buffer::~Buffer() {
+  releaseRing();
+  glDeleteBuffers(1, &_handle);
+}
 
 void Buffer::bind() const noexcept { glBindBuffer(getType(), _handle); }
 
@@ -23,6 +28,66 @@ void Buffer::allocate_load(GLsizeiptr size_, const void* data, GLenum usage) con
   glBufferData(getType(), _size, data, usage);
 }
 
+void Buffer::releaseRing() noexcept {
+  for (GLsync fence : _fences) {
+    if (fence != nullptr) glDeleteSync(fence);
+  }
+  _fences.clear();
+}
+
+void Buffer::allocateRing(GLsizeiptr regionSize, int regionCount) {
+  releaseRing();
+  _ring.reset(regionSize, regionCount);
+  _fences.assign(regionCount, nullptr);
+  _size = static_cast<GLsizeiptr>(_ring.totalSize());
+  // Immutable storage cannot be resized, start over with a new handle
+  if (_mapping != nullptr) {
+    glDeleteBuffers(1, &_handle);
+    glGenBuffers(1, &_handle);
+    _mapping = nullptr;
+  }
+  bind();
+  if (GLAD_GL_VERSION_4_4) {
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(getType(), _size, nullptr, flags);
+    _mapping = glMapBufferRange(getType(), 0, _size, flags);
+  } else {
+    glBufferData(getType(), _size, nullptr, GL_STREAM_DRAW);
+  }
+}
+
+bool Buffer::loadRing(std::uint64_t frame, GLsizeiptr size_, const void* data) {
+  if (!_ring.isStale(frame)) return false;
+  const int region = _ring.advance(frame);
+  // Every draw reading the retired region has been issued by now
+  if (_ring.retired() >= 0) {
+    GLsync& retired = _fences[_ring.retired()];
+    if (retired != nullptr) glDeleteSync(retired);
+    retired = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
+  // With 3 regions the fence is almost always signaled already, the GPU would have to be two frames behind
+  GLsync& fence = _fences[region];
+  if (fence != nullptr) {
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) continue;
+    glDeleteSync(fence);
+    fence = nullptr;
+  }
+  const GLintptr offset = static_cast<GLintptr>(_ring.offset(region));
+  if (_mapping != nullptr) {
+    std::memcpy(static_cast<char*>(_mapping) + offset, data, size_);
+    return true;
+  }
+  bind();
+  const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+  if (void* mapping = glMapBufferRange(getType(), offset, size_, flags)) {
+    std::memcpy(mapping, data, size_);
+    glUnmapBuffer(getType());
+  } else {
+    glBufferSubData(getType(), offset, size_, data);
+  }
+  return true;
+}
+
 void UniformBuffer::bindUniformBlockIndex(GLuint index, GLuint offset, GLuint size_) const noexcept {
   bind();
   glBindBufferRange(GL_UNIFORM_BUFFER, index, _handle, offset, size_);
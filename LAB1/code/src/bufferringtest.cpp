@@ -0,0 +1,114 @@
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+#include "bufferring.h"
+
+// Checks of the CPU-side ring bookkeeping, see Buffer::allocateRing / Buffer::loadRing for the OpenGL part.
+namespace {
+int failures = 0;
+
+void check(bool condition, const char* what, int line) {
+  if (condition) return;
+  std::cerr << "bufferringtest.cpp:" << line << ": " << what << std::endl;
+  ++failures;
+}
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+// Upload `frame` the way Buffer::loadRing does, returning the region written or -1 when nothing was
+int load(BufferRing& ring, std::uint64_t frame) {
+  if (!ring.isStale(frame)) return -1;
+  return ring.advance(frame);
+}
+
+void testLayout() {
+  BufferRing ring;
+  ring.reset(1000, 3, 256);
+  CHECK(ring.regionSize() == 1024);
+  CHECK(ring.regionCount() == 3);
+  CHECK(ring.totalSize() == 3072);
+  CHECK(ring.offset(2) == 2048);
+  CHECK(ring.currentOffset() == 0);
+  ring.reset(512, 2, 256);
+  CHECK(ring.regionSize() == 512);
+  CHECK(ring.totalSize() == 1024);
+}
+
+void testFirstFrame() {
+  BufferRing ring;
+  ring.reset(64);
+  CHECK(ring.isStale(0));
+  CHECK(ring.advance(0) == 0);
+  CHECK(ring.retired() == -1);
+  CHECK(!ring.isStale(0));
+  CHECK(ring.isStale(1));
+}
+
+void testWrapAround() {
+  BufferRing ring;
+  ring.reset(64, 3);
+  CHECK(ring.advance(10) == 0);
+  CHECK(ring.advance(11) == 1);
+  CHECK(ring.retired() == 0);
+  CHECK(ring.advance(12) == 2);
+  CHECK(ring.retired() == 1);
+  // Back to the first region, which the owner must have waited for
+  CHECK(ring.advance(13) == 0);
+  CHECK(ring.retired() == 2);
+  CHECK(ring.currentOffset() == 0);
+  CHECK(ring.advance(14) == 1);
+  CHECK(ring.retired() == 0);
+  CHECK(ring.frame() == 14);
+}
+
+void testSharedUpload() {
+  BufferRing ring;
+  ring.reset(64, 3);
+  CHECK(load(ring, 5) == 0);
+  // More draws of the same frame reuse the region without retiring anything
+  CHECK(load(ring, 5) == -1);
+  CHECK(load(ring, 5) == -1);
+  CHECK(ring.current() == 0);
+  CHECK(ring.retired() == -1);
+  // Frame numbers only need to differ, a simulation restart may go back
+  CHECK(load(ring, 2) == 1);
+  CHECK(ring.retired() == 0);
+  CHECK(load(ring, 2) == -1);
+}
+
+void testResetAfterUse() {
+  BufferRing ring;
+  ring.reset(64, 3);
+  ring.advance(0);
+  ring.advance(1);
+  ring.advance(2);
+  CHECK(ring.current() == 2);
+  // Buffer::allocateRing resets a ring that is already in use, e.g. when the cloth resolution changes
+  ring.reset(128, 2);
+  CHECK(ring.current() == 0);
+  CHECK(ring.retired() == -1);
+  CHECK(ring.isStale(2));
+  CHECK(ring.totalSize() == 512);
+  CHECK(ring.advance(2) == 0);
+  CHECK(ring.retired() == -1);
+  CHECK(ring.advance(3) == 1);
+  CHECK(ring.retired() == 0);
+  CHECK(ring.advance(4) == 0);
+  CHECK(ring.retired() == 1);
+}
+}  // namespace
+
+int main() {
+  testLayout();
+  testFirstFrame();
+  testWrapAround();
+  testSharedUpload();
+  testResetAfterUse();
+  if (failures != 0) {
+    std::cerr << failures << " check(s) failed" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << "All BufferRing checks passed" << std::endl;
+  return EXIT_SUCCESS;
+}
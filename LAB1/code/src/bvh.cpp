@@ -0,0 +1,89 @@
+#include "bvh.h"
+
+#include <algorithm>
+
+void TriangleBVH::build(const std::vector<unsigned int>& triangles, const Eigen::Ref<const Eigen::Matrix4Xf>& positions) {
+  const int triangleCount = static_cast<int>(triangles.size() / 3);
+  _nodes.clear();
+  _triangles.clear();
+  _triangleBoxes.clear();
+  _leaves.clear();
+  _ownedVertexStart.clear();
+  _ownedVertices.clear();
+  if (triangleCount == 0) return;
+  Eigen::Matrix3Xf centroids(3, triangleCount);
+  for (int t = 0; t < triangleCount; ++t) {
+    centroids.col(t) = (positions.col(triangles[3 * t]) + positions.col(triangles[3 * t + 1]) +
+                        positions.col(triangles[3 * t + 2]))
+                           .head<3>() /
+                       3.0f;
+  }
+  std::vector<int> order(triangleCount);
+  for (int t = 0; t < triangleCount; ++t) order[t] = t;
+
+  _nodes.reserve(2 * (triangleCount / leafSize + 1));
+  _nodes.emplace_back();
+  buildNode(0, 0, triangleCount, order, centroids);
+
+  _triangles.resize(triangles.size());
+  _triangleBoxes.resize(triangleCount);
+  for (int t = 0; t < triangleCount; ++t) {
+    std::copy_n(triangles.begin() + 3 * order[t], 3, _triangles.begin() + 3 * t);
+  }
+  // Each vertex is owned by the first leaf that uses it
+  std::vector<bool> isOwned(positions.cols(), false);
+  _ownedVertexStart.assign(1, 0);
+  for (int leaf : _leaves) {
+    const Node& node = _nodes[leaf];
+    for (int v = 3 * node.firstTriangle; v < 3 * (node.firstTriangle + node.triangleCount); ++v) {
+      if (isOwned[_triangles[v]]) continue;
+      isOwned[_triangles[v]] = true;
+      _ownedVertices.emplace_back(static_cast<int>(_triangles[v]));
+    }
+    _ownedVertexStart.emplace_back(static_cast<int>(_ownedVertices.size()));
+  }
+  refit(positions);
+}
+
+void TriangleBVH::buildNode(int node, int begin, int end, std::vector<int>& order, const Eigen::Matrix3Xf& centroids) {
+  if (end - begin <= leafSize) {
+    _nodes[node].firstChild = -1;
+    _nodes[node].firstTriangle = begin;
+    _nodes[node].triangleCount = end - begin;
+    _leaves.emplace_back(node);
+    return;
+  }
+  Eigen::AlignedBox3f bounds;
+  for (int i = begin; i < end; ++i) bounds.extend(centroids.col(order[i]));
+  int axis;
+  bounds.sizes().maxCoeff(&axis);
+  int middle = begin + (end - begin) / 2;
+  std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+                   [&](int a, int b) { return centroids(axis, a) < centroids(axis, b); });
+
+  const int firstChild = static_cast<int>(_nodes.size());
+  _nodes[node].firstChild = firstChild;
+  _nodes[node].firstTriangle = 0;
+  _nodes[node].triangleCount = 0;
+  _nodes.emplace_back();
+  _nodes.emplace_back();
+  buildNode(firstChild, begin, middle, order, centroids);
+  buildNode(firstChild + 1, middle, end, order, centroids);
+}
+
+void TriangleBVH::refit(const Eigen::Ref<const Eigen::Matrix4Xf>& positions) {
+  for (int i = static_cast<int>(_nodes.size()) - 1; i >= 0; --i) {
+    Node& node = _nodes[i];
+    node.box.setEmpty();
+    if (node.triangleCount == 0) {
+      node.box.extend(_nodes[node.firstChild].box).extend(_nodes[node.firstChild + 1].box);
+      continue;
+    }
+    for (int t = node.firstTriangle; t < node.firstTriangle + node.triangleCount; ++t) {
+      Eigen::AlignedBox3f& box = _triangleBoxes[t];
+      box.setEmpty();
+      for (int v = 3 * t; v < 3 * t + 3; ++v) box.extend(positions.col(_triangles[v]).head<3>());
+      node.box.extend(box);
+    }
+  }
+}
@@ -1,19 +1,132 @@
 #include "cloth.h"
 #include <Eigen/Geometry>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <istream>
+#include <numeric>
+#include <ostream>
 
+#include "binaryio.h"
+#include "collider.h"
 #include "configs.h"
 #include "sphere.h"
+#include "threadpool.h"
 
 #include <iostream>
 
-Cloth::Cloth() : Shape(particlesPerEdge * particlesPerEdge, particleMass) {
+namespace {
+/**
+ * Barycentric weights of the point on triangle abc closest to p, from "Real-Time Collision Detection" (Ericson).
+ */
+Eigen::Vector3f closestPointWeights(const Eigen::Vector3f& p,
+                                    const Eigen::Vector3f& a,
+                                    const Eigen::Vector3f& b,
+                                    const Eigen::Vector3f& c) {
+  Eigen::Vector3f ab = b - a, ac = c - a, ap = p - a;
+  float d1 = ab.dot(ap), d2 = ac.dot(ap);
+  if (d1 <= 0.0f && d2 <= 0.0f) return Eigen::Vector3f(1, 0, 0);
+  Eigen::Vector3f bp = p - b;
+  float d3 = ab.dot(bp), d4 = ac.dot(bp);
+  if (d3 >= 0.0f && d4 <= d3) return Eigen::Vector3f(0, 1, 0);
+  float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+    float v = d1 / (d1 - d3);
+    return Eigen::Vector3f(1 - v, v, 0);
+  }
+  Eigen::Vector3f cp = p - c;
+  float d5 = ab.dot(cp), d6 = ac.dot(cp);
+  if (d6 >= 0.0f && d5 <= d6) return Eigen::Vector3f(0, 0, 1);
+  float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+    float w = d2 / (d2 - d6);
+    return Eigen::Vector3f(1 - w, 0, w);
+  }
+  float va = d3 * d6 - d5 * d4;
+  if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+    float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+    return Eigen::Vector3f(0, 1 - w, w);
+  }
+  float denominator = 1.0f / (va + vb + vc);
+  float v = vb * denominator, w = vc * denominator;
+  return Eigen::Vector3f(1 - v - w, v, w);
+}
+
+/**
+ * Z-order curve position of a grid vertex, the bits of row and column interleaved with the row bits on top.
+ */
+std::uint32_t mortonCode(std::uint32_t row, std::uint32_t column) {
+  auto spread = [](std::uint32_t x) {
+    x &= 0xFFFFu;
+    x = (x | x << 8) & 0x00FF00FFu;
+    x = (x | x << 4) & 0x0F0F0F0Fu;
+    x = (x | x << 2) & 0x33333333u;
+    x = (x | x << 1) & 0x55555555u;
+    return x;
+  };
+  return spread(row) << 1 | spread(column);
+}
+}  // namespace
+
+Cloth::Cloth(int particlesPerEdge, ParticleOrder order) :
+    Shape(particlesPerEdge * particlesPerEdge, particleMass),
+    _particlesPerEdge(particlesPerEdge),
+    _order(order),
+    _normals(Eigen::Matrix4Xf::Zero(4, particlesPerEdge * particlesPerEdge)),
+    _faceNormals(Eigen::ArrayXXf::Zero(particlesPerEdge + 1, 6 * (particlesPerEdge - 1))),
+    _normalSums(particlesPerEdge, 4 * particlesPerEdge) {
+  initializeOrder();
+  initializeTiles();
   initializeVertex();
   initializeSpring();
+  initializeSpringColors();
+  initializeAdjacency();
+  _springKernel.assign(_springs);
+  _springStiffness.assign(_springs.size(), 1.0f);
+  _springDamping.assign(_springs.size(), 1.0f);
+  updateMaterial();
+  _triangleTree.build(_triangles, _particles.position());
+}
+
+int Cloth::cornerIndex(int corner) const {
+  const int last = _particlesPerEdge - 1;
+  switch (corner) {
+    case 0: return particleIndex(0, 0);
+    case 1: return particleIndex(0, last);
+    case 2: return particleIndex(last, 0);
+    default: return particleIndex(last, last);
+  }
+}
+
+void Cloth::initializeOrder() {
+  const int vertexCount = _particlesPerEdge * _particlesPerEdge;
+  _gridToParticle.resize(vertexCount);
+  std::iota(_gridToParticle.begin(), _gridToParticle.end(), 0);
+  if (_order == ParticleOrder::GRID) return;
+  // Rank the grid vertices by their position on the curve
+  std::vector<int> vertices(_gridToParticle);
+  std::sort(vertices.begin(), vertices.end(), [n = _particlesPerEdge](int a, int b) {
+    return mortonCode(a / n, a % n) < mortonCode(b / n, b % n);
+  });
+  for (int rank = 0; rank < vertexCount; ++rank) _gridToParticle[vertices[rank]] = rank;
+  _particleNormals = Eigen::Matrix4Xf::Zero(4, vertexCount);
+}
+
+#ifndef HW1_HEADLESS
+void Cloth::upload(const Eigen::Matrix4Xf& positions, std::uint64_t frame) {
+  positionBuffer.loadRing(frame, 4 * _particlesPerEdge * _particlesPerEdge * sizeof(GLfloat), positions.data());
 }
 
 void Cloth::draw(DrawType type) const {
   vao.bind();
-  positionBuffer.load(0, 4 * particlesPerEdge * particlesPerEdge * sizeof(GLfloat), _particles.getPositionData());
+  // Point the attributes at the current ring regions
+  positionBuffer.bind();
+  vao.setAttributePointer(0, 4, 4, static_cast<int>(positionBuffer.ringOffset() / sizeof(GLfloat)));
+  if (type == DrawType::FULL) {
+    normalBuffer.bind();
+    vao.setAttributePointer(1, 4, 4, static_cast<int>(normalBuffer.ringOffset() / sizeof(GLfloat)));
+  }
   const ElementArrayBuffer* currentEBO = nullptr;
   switch (type) {
     case DrawType::PARTICLE: [[fallthrough]];
@@ -27,59 +140,57 @@ void Cloth::draw(DrawType type) const {
   if (type == DrawType::FULL)
     glDrawElements(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, nullptr);
   else if (type == DrawType::PARTICLE)
-    glDrawArrays(GL_POINTS, 0, particlesPerEdge * particlesPerEdge);
+    glDrawArrays(GL_POINTS, 0, _particlesPerEdge * _particlesPerEdge);
   else
     glDrawElements(GL_LINES, indexCount, GL_UNSIGNED_INT, nullptr);
   glBindVertexArray(0);
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
+#endif
 
 void Cloth::initializeVertex() {
-  float wStep = 2.0f * clothWidth / (particlesPerEdge - 1);
-  float hStep = 2.0f * clothHeight / (particlesPerEdge - 1);
+  float wStep = 2.0f * clothWidth / (_particlesPerEdge - 1);
+  float hStep = 2.0f * clothHeight / (_particlesPerEdge - 1);
 
-  int current = 0;
-  for (int i = 0; i < particlesPerEdge; ++i) {
-    for (int j = 0; j < particlesPerEdge; ++j) {
-      _particles.position(current++) = Eigen::Vector4f(-clothWidth + j * wStep, 1, -clothHeight + i * hStep, 1);
-    }
-  }
-
-  std::vector<GLfloat> texCoords;
-  texCoords.reserve(particlesPerEdge * particlesPerEdge * 2);
-  for (int i = 0; i < particlesPerEdge; ++i) {
-    for (int j = 0; j < particlesPerEdge; ++j) {
-      texCoords.emplace_back(static_cast<float>(i) / (particlesPerEdge - 1));
-      texCoords.emplace_back(static_cast<float>(j) / (particlesPerEdge - 1));
+  for (int i = 0; i < _particlesPerEdge; ++i) {
+    for (int j = 0; j < _particlesPerEdge; ++j) {
+      _particles.position(particleIndex(i, j)) =
+          Eigen::Vector4f(-clothWidth + j * wStep, 1, -clothHeight + i * hStep, 1);
     }
   }
 
   // Four corners will not move
-  _particles.mass(0) = 0.0f;
-  _particles.mass(particlesPerEdge - 1) = 0.0f;
-  _particles.mass(particlesPerEdge * (particlesPerEdge - 1)) = 0.0f;
-  _particles.mass(particlesPerEdge * particlesPerEdge - 1) = 0.0f;
+  for (int i = 0; i < 4; ++i) _particles.setMass(cornerIndex(i), 0.0f);
 
-  std::vector<GLuint> indices;
-  indices.reserve((particlesPerEdge - 1) * (2 * particlesPerEdge + 1));
-  for (int i = 0; i < particlesPerEdge - 1; ++i) {
-    int offset = i * (particlesPerEdge);
-    for (int j = 0; j < particlesPerEdge - 1; ++j) {
-      indices.emplace_back(offset + j);
-      indices.emplace_back(offset + j + particlesPerEdge);
-      indices.emplace_back(offset + j + 1);
+  // Two triangles per quad, also used by self collision
+  _triangles.reserve(6 * (_particlesPerEdge - 1) * (_particlesPerEdge - 1));
+  for (int i = 0; i < _particlesPerEdge - 1; ++i) {
+    for (int j = 0; j < _particlesPerEdge - 1; ++j) {
+      _triangles.emplace_back(particleIndex(i, j));
+      _triangles.emplace_back(particleIndex(i + 1, j));
+      _triangles.emplace_back(particleIndex(i, j + 1));
 
-      indices.emplace_back(offset + j + 1);
-      indices.emplace_back(offset + j + particlesPerEdge);
-      indices.emplace_back(offset + j + particlesPerEdge + 1);
+      _triangles.emplace_back(particleIndex(i, j + 1));
+      _triangles.emplace_back(particleIndex(i + 1, j));
+      _triangles.emplace_back(particleIndex(i + 1, j + 1));
     }
   }
 
-  int vboSize = particlesPerEdge * particlesPerEdge * sizeof(GLfloat);
-  positionBuffer.allocate_load(vboSize * 4, _particles.getPositionData());
-  normalBuffer.allocate(particlesPerEdge * particlesPerEdge * sizeof(float) * 4);
+#ifndef HW1_HEADLESS
+  std::vector<GLfloat> texCoords(_particlesPerEdge * _particlesPerEdge * 2);
+  for (int i = 0; i < _particlesPerEdge; ++i) {
+    for (int j = 0; j < _particlesPerEdge; ++j) {
+      texCoords[2 * particleIndex(i, j)] = static_cast<float>(i) / (_particlesPerEdge - 1);
+      texCoords[2 * particleIndex(i, j) + 1] = static_cast<float>(j) / (_particlesPerEdge - 1);
+    }
+  }
+
+  int vboSize = _particlesPerEdge * _particlesPerEdge * sizeof(GLfloat);
+  // Positions and normals change every frame, they are written into rings and pointed at in draw()
+  positionBuffer.allocateRing(vboSize * 4);
+  normalBuffer.allocateRing(vboSize * 4);
   textureBuffer.allocate_load(vboSize * 2, texCoords.data());
-  ebo.allocate_load(indices.size() * sizeof(GLuint), indices.data());
+  ebo.allocate_load(_triangles.size() * sizeof(GLuint), _triangles.data());
 
   vao.bind();
   positionBuffer.bind();
@@ -95,6 +206,18 @@ void Cloth::initializeVertex() {
   glBindVertexArray(0);
   glBindBuffer(GL_ARRAY_BUFFER, 0);
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+#endif
+}
+
+float Cloth::longestEdge() {
+  Eigen::Ref<Eigen::Matrix4Xf> positions = _particles.position();
+  float longest2 = 0.0f;
+  for (const Spring& spring : _springs) {
+    if (spring.type() == Spring::Type::BEND) continue;
+    const Eigen::Vector4f edge = positions.col(spring.endParticleIndex()) - positions.col(spring.startParticleIndex());
+    longest2 = std::max(longest2, edge.head<3>().squaredNorm());
+  }
+  return std::sqrt(longest2);
 }
 
 void Cloth::initializeSpring() {
@@ -102,56 +225,59 @@ void Cloth::initializeSpring() {
   //   1. Compute spring length per type.
   //   2. Iterate the particles. Push spring objects into `_springs` vector
   // Note:
-  //   1. The particles index:
+  //   1. The particles index, particleIndex(i, j) of row i and column j. In GRID order:
   //   ===============================================
-  //   0 1 2 3 ... particlesPerEdge - 1
-  //   particlesPerEdge ... ...
-  //   ... ... particlesPerEdge * particlesPerEdge - 1
+  //   0 1 2 3 ... _particlesPerEdge - 1
+  //   _particlesPerEdge ... ...
+  //   ... ... _particlesPerEdge * _particlesPerEdge - 1
   //   ===============================================
   // Here is a simple example which connects the horizontal structrual springs.
-  float structrualLength = (_particles.position(0) - _particles.position(1)).norm();
-  for (int i = 0; i < particlesPerEdge; ++i) {
-    for (int j = 0; j < particlesPerEdge - 1; ++j) {
-      int index = i * particlesPerEdge + j;
-      _springs.emplace_back(index, index + 1, structrualLength, Spring::Type::STRUCTURAL);
+  float structrualLength = (_particles.position(particleIndex(0, 0)) - _particles.position(particleIndex(0, 1))).norm();
+  for (int i = 0; i < _particlesPerEdge; ++i) {
+    for (int j = 0; j < _particlesPerEdge - 1; ++j) {
+      _springs.emplace_back(particleIndex(i, j), particleIndex(i, j + 1), structrualLength, Spring::Type::STRUCTURAL);
     }
   }
-  for (int i = 0; i < particlesPerEdge - 1; ++i) {
-    for (int j = 0; j < particlesPerEdge; ++j) {
-      int index = i * particlesPerEdge + j;
-      _springs.emplace_back(index, index + particlesPerEdge, structrualLength, Spring::Type::STRUCTURAL);
+  for (int i = 0; i < _particlesPerEdge - 1; ++i) {
+    for (int j = 0; j < _particlesPerEdge; ++j) {
+      _springs.emplace_back(particleIndex(i, j), particleIndex(i + 1, j), structrualLength, Spring::Type::STRUCTURAL);
     }
   }
-  float shearlen = (_particles.position(0) - _particles.position(particlesPerEdge + 1)).norm();
-  for (int i = 0; i < particlesPerEdge - 1; ++i) {
-    for (int j = 0; j < particlesPerEdge-1; ++j) {
-      int index = i * particlesPerEdge + j;
-      _springs.emplace_back(index, index + particlesPerEdge+1, shearlen, Spring::Type::SHEAR);
+  float shearlen = (_particles.position(particleIndex(0, 0)) - _particles.position(particleIndex(1, 1))).norm();
+  for (int i = 0; i < _particlesPerEdge - 1; ++i) {
+    for (int j = 0; j < _particlesPerEdge-1; ++j) {
+      _springs.emplace_back(particleIndex(i, j), particleIndex(i + 1, j + 1), shearlen, Spring::Type::SHEAR);
     }
   }
-  for (int i = 0; i < particlesPerEdge - 1; ++i) {
-    for (int j = 1; j < particlesPerEdge; ++j) {
-      int index = i * particlesPerEdge + j;
-      _springs.emplace_back(index, index + particlesPerEdge-1, shearlen, Spring::Type::SHEAR);
+  for (int i = 0; i < _particlesPerEdge - 1; ++i) {
+    for (int j = 1; j < _particlesPerEdge; ++j) {
+      _springs.emplace_back(particleIndex(i, j), particleIndex(i + 1, j - 1), shearlen, Spring::Type::SHEAR);
     }
   }
-  float bendlen = (_particles.position(0) - _particles.position(2)).norm();
-  for (int i = 0; i < particlesPerEdge; ++i) {
-    for (int j = 0; j < particlesPerEdge-2; ++j) {
-      int index = i * particlesPerEdge + j;
-      _springs.emplace_back(index, index + 2, bendlen, Spring::Type::BEND);
+  _longestRestEdge = std::max(structrualLength, shearlen);
+  float bendlen = (_particles.position(particleIndex(0, 0)) - _particles.position(particleIndex(0, 2))).norm();
+  for (int i = 0; i < _particlesPerEdge; ++i) {
+    for (int j = 0; j < _particlesPerEdge-2; ++j) {
+      _springs.emplace_back(particleIndex(i, j), particleIndex(i, j + 2), bendlen, Spring::Type::BEND);
     }
   }
-  for (int i = 0; i < particlesPerEdge -2; ++i) {
-    for (int j = 0; j < particlesPerEdge; ++j) {
-      int index = i * particlesPerEdge + j;
-      _springs.emplace_back(index, index + 2*particlesPerEdge, bendlen, Spring::Type::BEND);
+  for (int i = 0; i < _particlesPerEdge -2; ++i) {
+    for (int j = 0; j < _particlesPerEdge; ++j) {
+      _springs.emplace_back(particleIndex(i, j), particleIndex(i + 2, j), bendlen, Spring::Type::BEND);
     }
   }
+  if (_order == ParticleOrder::MORTON) {
+    // Walk the springs along the curve too, grouped by type they would sweep the whole cloth six times
+    std::stable_sort(_springs.begin(), _springs.end(), [](const Spring& a, const Spring& b) {
+      return std::min(a.startParticleIndex(), a.endParticleIndex()) <
+             std::min(b.startParticleIndex(), b.endParticleIndex());
+    });
+  }
 
 
 
   // DO NOT MODIFY BELOW THIS LINE
+#ifndef HW1_HEADLESS
   std::vector<GLuint> structrualIndices, shearIndices, bendIndices;
   for (const auto& spring : _springs) {
     switch (spring.type()) {
@@ -172,6 +298,7 @@ void Cloth::initializeSpring() {
   structuralSpring.allocate_load(structrualIndices.size() * sizeof(GLuint), structrualIndices.data());
   shearSpring.allocate_load(shearIndices.size() * sizeof(GLuint), shearIndices.data());
   bendSpring.allocate_load(bendIndices.size() * sizeof(GLuint), bendIndices.data());
+#endif
 }
 void Cloth::computeSpringForce() {
   // TODO: Compute spring force and damper force for each spring.
@@ -185,49 +312,523 @@ void Cloth::computeSpringForce() {
   //   2. Use a.normalize() to normalize a inplace.
   //          a.normalized() will create a new vector.
   //   3. Use a.dot(b) to get dot product of a and b.
-    for (const auto& spring : _springs) {
-        int start = spring.startParticleIndex();
-        int end = spring.endParticleIndex();
-        //force direct is converse of the position
-        //springforce
-        Eigen::Vector4f direction = _particles.position(start) - _particles.position(end);  // xa-xb
-        float currlen = direction.norm();//|xa-xb|
-        direction.normalize();//l dirc
-        float delta_l = currlen - spring.length();
-        Eigen::Vector4f springforce = direction * (springCoef * delta_l);
-        //damperforce
-        Eigen::Vector4f relatev = _particles.velocity(start) - _particles.velocity(end);  //va-vb
-        float delta_v = relatev.dot(direction);
-        Eigen::Vector4f dampforce =direction * (damperCoef * delta_v);
-        _particles.acceleration(start) -= (dampforce + springforce) * _particles.inverseMass(start);
-        _particles.acceleration(end) += (dampforce + springforce) * _particles.inverseMass(end);
+  checkActiveRanges();
+  updateMaterial();
+  if (_order == ParticleOrder::MORTON || _sleepingTileCount > 0) {
+    gatherSpringForce();
+    return;
+  }
+  if (isVectorized) {
+    _springKernel.compute(_particles, springCoef, damperCoef, isMultithreaded);
+    return;
+  }
+  if (isMultithreaded) {
+    // Springs of the same color never share a particle, so a color can be scattered by many threads at once.
+    ThreadPool& pool = ThreadPool::getPool();
+    for (size_t color = 0; color + 1 < _springColorOffsets.size(); ++color) {
+      const int first = _springColorOffsets[color];
+      pool.parallelFor(
+          _springColorOffsets[color + 1] - first,
+          [this, first](int begin, int end) {
+            for (int i = first + begin; i < first + end; ++i) applySpringForce(_coloredSprings[i]);
+          },
+          parallelGrainSize);
     }
+    return;
+  }
+  for (int i = 0; i < static_cast<int>(_springs.size()); ++i) applySpringForce(i);
+}
+
+void Cloth::applySpringForce(int i) {
+    const Spring& spring = _springs[i];
+    const float stiffness = springCoef * _stiffnessScales[i];
+    const float damping = damperCoef * _dampingScales[i];
+    int start = spring.startParticleIndex();
+    int end = spring.endParticleIndex();
+    //force direct is converse of the position
+    //springforce
+    Eigen::Vector4f direction = _particles.position(start) - _particles.position(end);  // xa-xb
+    float currlen = direction.norm();//|xa-xb|
+    direction.normalize();//l dirc
+    float delta_l = currlen - spring.length();
+    Eigen::Vector4f springforce = direction * (stiffness * delta_l);
+    //damperforce
+    Eigen::Vector4f relatev = _particles.velocity(start) - _particles.velocity(end);  //va-vb
+    float delta_v = relatev.dot(direction);
+    Eigen::Vector4f dampforce =direction * (damping * delta_v);
+    _particles.acceleration(start) -= (dampforce + springforce) * _particles.inverseMass(start);
+    _particles.acceleration(end) += (dampforce + springforce) * _particles.inverseMass(end);
+}
+
+void Cloth::gatherSpringForce() {
+  const bool isPartial = _sleepingTileCount > 0;
+  auto evaluateSprings = [this, isPartial](int begin, int end) {
+    for (int k = begin; k < end; ++k) {
+      const int i = isPartial ? _activeSprings[k] : k;
+      const Spring& spring = _springs[i];
+      const int start = spring.startParticleIndex();
+      const int finish = spring.endParticleIndex();
+      Eigen::Vector4f direction = _particles.position(start) - _particles.position(finish);
+      float length = direction.norm();
+      direction.normalize();
+      float relativeSpeed = (_particles.velocity(start) - _particles.velocity(finish)).dot(direction);
+      _springForces.col(i) = direction * ((springCoef * _stiffnessScales[i]) * (length - spring.length()) +
+                                          (damperCoef * _dampingScales[i]) * relativeSpeed);
+    }
+  };
+  // Each particle sums its springs in spring order, so the result does not depend on the thread count either
+  auto gatherParticles = [this, isPartial](int begin, int end) {
+    for (int k = begin; k < end; ++k) {
+      const int i = isPartial ? _activeParticles[k] : k;
+      Eigen::Vector4f force = Eigen::Vector4f::Zero();
+      for (int a = _adjacencyOffsets[i]; a < _adjacencyOffsets[i + 1]; ++a) {
+        force += _adjacentSprings[a].sign * _springForces.col(_adjacentSprings[a].spring);
+      }
+      _particles.acceleration(i) += force * _particles.inverseMass(i);
+    }
+  };
+  const int springCount = static_cast<int>(isPartial ? _activeSprings.size() : _springs.size());
+  const int particleCount = isPartial ? static_cast<int>(_activeParticles.size()) : _particles.getCapacity();
+  if (isMultithreaded) {
+    ThreadPool& pool = ThreadPool::getPool();
+    pool.parallelFor(springCount, evaluateSprings, parallelGrainSize);
+    pool.parallelFor(particleCount, gatherParticles, parallelGrainSize);
+  } else {
+    evaluateSprings(0, springCount);
+    gatherParticles(0, particleCount);
+  }
+}
+
+void Cloth::setSpringMaterial(int spring, float stiffness, float damping) {
+  _springStiffness[spring] = stiffness;
+  _springDamping[spring] = damping;
+  _isMaterialChanged = true;
+}
+
+void Cloth::updateMaterial() {
+  if (!_isMaterialChanged && _typeStiffness == springTypeScale && _typeDamping == damperTypeScale) return;
+  _typeStiffness = springTypeScale;
+  _typeDamping = damperTypeScale;
+  _stiffnessScales.resize(_springs.size());
+  _dampingScales.resize(_springs.size());
+  for (size_t i = 0; i < _springs.size(); ++i) {
+    const int type = static_cast<int>(_springs[i].type());
+    _stiffnessScales[i] = _typeStiffness[type] * _springStiffness[i];
+    _dampingScales[i] = _typeDamping[type] * _springDamping[i];
+  }
+  _springKernel.setScales(_stiffnessScales, _dampingScales);
+  _isMaterialChanged = false;
+  ++_materialRevision;
+}
+
+void Cloth::limitStrain() {
+  if (!isStrainLimiting) return;
+  checkActiveRanges();
+  for (int iteration = 0; iteration < strainLimitIterations; ++iteration) {
+    _overstretchedSprings = 0;
+    for (size_t color = 0; color + 1 < _structuralColorOffsets.size(); ++color) {
+      const int first = _structuralColorOffsets[color];
+      const int count = _structuralColorOffsets[color + 1] - first;
+      if (isMultithreaded) {
+        ThreadPool::getPool().parallelFor(
+            count, [this, first](int begin, int end) { limitSprings(first + begin, first + end); }, parallelGrainSize);
+      } else {
+        limitSprings(first, first + count);
+      }
+    }
+    // Usually the first sweep already finds nothing to do
+    if (_overstretchedSprings == 0) break;
+  }
+}
+
+void Cloth::limitSprings(int begin, int end) {
+  const float limit = 1.0f + maxStrain;
+  int overstretched = 0;
+  for (int k = begin; k < end; ++k) {
+    const Spring& spring = _springs[_structuralSprings[k]];
+    const int start = spring.startParticleIndex();
+    const int finish = spring.endParticleIndex();
+    Eigen::Vector4f direction = _particles.position(start) - _particles.position(finish);
+    const float length = direction.norm();
+    const float maxLength = limit * spring.length();
+    if (length <= maxLength) continue;
+    // Sleeping particles are held like pinned ones
+    const float startWeight = isAsleep(start) ? 0.0f : _particles.inverseMass(start);
+    const float endWeight = isAsleep(finish) ? 0.0f : _particles.inverseMass(finish);
+    const float weight = startWeight + endWeight;
+    if (weight == 0.0f) continue;
+    ++overstretched;
+    direction /= length;
+    const Eigen::Vector4f correction = direction * ((length - maxLength) / weight);
+    _particles.position(start) -= startWeight * correction;
+    _particles.position(finish) += endWeight * correction;
+    // An inelastic stop along the spring, the ends keep their relative motion across it
+    const float separation = (_particles.velocity(start) - _particles.velocity(finish)).dot(direction);
+    if (separation <= 0.0f) continue;
+    const Eigen::Vector4f impulse = direction * (separation / weight);
+    _particles.velocity(start) -= startWeight * impulse;
+    _particles.velocity(finish) += endWeight * impulse;
+  }
+  if (overstretched > 0) _overstretchedSprings.fetch_add(overstretched);
+}
+
+void Cloth::initializeTiles() {
+  const int n = _particlesPerEdge;
+  _tilesPerEdge = (n + sleepTileSize - 1) / sleepTileSize;
+  const int tileCount = _tilesPerEdge * _tilesPerEdge;
+  _particleTile.resize(n * n);
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j) {
+      _particleTile[particleIndex(i, j)] = i / sleepTileSize * _tilesPerEdge + j / sleepTileSize;
+    }
+  }
+  // Counting sort of the particles by tile
+  _tileOffsets.assign(tileCount + 1, 0);
+  for (int tile : _particleTile) ++_tileOffsets[tile + 1];
+  for (int tile = 0; tile < tileCount; ++tile) _tileOffsets[tile + 1] += _tileOffsets[tile];
+  _tileParticles.resize(n * n);
+  std::vector<int> next(_tileOffsets.begin(), _tileOffsets.end() - 1);
+  for (int i = 0; i < n * n; ++i) _tileParticles[next[_particleTile[i]]++] = i;
+  _isTileAsleep.resize(tileCount);
+  // Atomics cannot be moved, so the flags are allocated anew instead of resized
+  _isTileDisturbed = std::vector<std::atomic<std::uint8_t>>(tileCount);
+  _quietSteps.resize(tileCount);
+  _tileEnergy.resize(tileCount);
+  _activeRanges.assign(1, Particles::Range{0, n * n});
+  resetSleep();
+}
+
+void Cloth::resetSleep() {
+  std::fill(_isTileAsleep.begin(), _isTileAsleep.end(), std::uint8_t{0});
+  for (auto& isDisturbed : _isTileDisturbed) isDisturbed.store(0, std::memory_order_relaxed);
+  std::fill(_quietSteps.begin(), _quietSteps.end(), 0);
+  std::fill(_tileEnergy.begin(), _tileEnergy.end(), 0.0f);
+  _sleepingTileCount = 0;
+  updateActiveSet();
+}
+
+void Cloth::checkActiveRanges() {
+  if (_sleepingTileCount > 0 && _particles.activeRanges() != _activeRanges) resetSleep();
+}
+
+void Cloth::updateActiveSet() {
+  const int particleCount = _particles.getCapacity();
+  _activeRanges.clear();
+  _activeParticles.clear();
+  _activeSprings.clear();
+  if (_sleepingTileCount == 0) {
+    _activeRanges.emplace_back(Particles::Range{0, particleCount});
+    _particles.setActiveRanges(_activeRanges);
+    return;
+  }
+  for (int i = 0; i < particleCount; ++i) {
+    if (isAsleep(i)) continue;
+    _activeParticles.emplace_back(i);
+    if (!_activeRanges.empty() && _activeRanges.back().end == i) {
+      ++_activeRanges.back().end;
+    } else {
+      _activeRanges.emplace_back(Particles::Range{i, i + 1});
+    }
+  }
+  _particles.setActiveRanges(_activeRanges);
+  for (size_t i = 0; i < _springs.size(); ++i) {
+    if (!isAsleep(_springs[i].startParticleIndex()) || !isAsleep(_springs[i].endParticleIndex())) {
+      _activeSprings.emplace_back(static_cast<int>(i));
+    }
+  }
+}
+
+void Cloth::updateSleep() {
+  checkActiveRanges();
+  if (!isSleeping) {
+    if (_sleepingTileCount > 0) resetSleep();
+    return;
+  }
+  const int tileCount = static_cast<int>(_isTileAsleep.size());
+  bool isChanged = false;
+  auto wake = [this, &isChanged](int tile) {
+    _isTileAsleep[tile] = 0;
+    _quietSteps[tile] = 0;
+    --_sleepingTileCount;
+    isChanged = true;
+  };
+  // Sleeping particles have no velocity, unless a collision just gave them one and disturbed their tile
+  for (int tile = 0; tile < tileCount; ++tile) {
+    if (_isTileAsleep[tile] && !_isTileDisturbed[tile].load(std::memory_order_relaxed)) continue;
+    _isTileDisturbed[tile].store(0, std::memory_order_relaxed);
+    float energy = 0.0f;
+    for (int k = _tileOffsets[tile]; k < _tileOffsets[tile + 1]; ++k) {
+      const int i = _tileParticles[k];
+      energy += 0.5f * _particles.mass(i) * _particles.velocity(i).squaredNorm();
+    }
+    energy /= static_cast<float>(_tileOffsets[tile + 1] - _tileOffsets[tile]);
+    _tileEnergy[tile] = energy;
+    if (_isTileAsleep[tile]) {
+      if (energy > 0.0f) wake(tile);
+    } else {
+      _quietSteps[tile] = energy < sleepEnergyThreshold ? _quietSteps[tile] + 1 : 0;
+    }
+  }
+  // Awake tiles above the threshold keep their neighbors awake, which also wakes a cloth tugged from one side
+  auto isNeighborMoving = [this](int tile) {
+    const int row = tile / _tilesPerEdge;
+    const int column = tile % _tilesPerEdge;
+    for (int r = std::max(row - 1, 0); r <= std::min(row + 1, _tilesPerEdge - 1); ++r) {
+      for (int c = std::max(column - 1, 0); c <= std::min(column + 1, _tilesPerEdge - 1); ++c) {
+        const int neighbor = r * _tilesPerEdge + c;
+        if (neighbor != tile && !_isTileAsleep[neighbor] && _tileEnergy[neighbor] >= sleepEnergyThreshold) return true;
+      }
+    }
+    return false;
+  };
+  for (int tile = 0; tile < tileCount; ++tile) {
+    if (_isTileAsleep[tile]) {
+      if (isNeighborMoving(tile)) wake(tile);
+    } else if (_quietSteps[tile] >= sleepSteps && !isNeighborMoving(tile)) {
+      _isTileAsleep[tile] = 1;
+      _tileEnergy[tile] = 0.0f;
+      ++_sleepingTileCount;
+      isChanged = true;
+      for (int k = _tileOffsets[tile]; k < _tileOffsets[tile + 1]; ++k) {
+        _particles.velocity(_tileParticles[k]).setZero();
+        _particles.acceleration(_tileParticles[k]).setZero();
+      }
+    }
+  }
+  if (isChanged) updateActiveSet();
+}
+
+int Cloth::awakeParticleCount() const {
+  int count = 0;
+  for (const Particles::Range& range : _activeRanges) count += range.end - range.begin;
+  return count;
+}
+
+void Cloth::saveState(std::ostream& stream) const {
+  writeBinary(stream, static_cast<std::int32_t>(_isTileAsleep.size()));
+  writeBinary(stream, _isTileAsleep.data(), _isTileAsleep.size());
+  writeBinary(stream, _quietSteps.data(), _quietSteps.size());
+}
+
+void Cloth::loadState(std::istream& stream) {
+  std::int32_t tileCount = 0;
+  readBinary(stream, tileCount);
+  if (!stream || tileCount != static_cast<std::int32_t>(_isTileAsleep.size())) {
+    stream.setstate(std::ios::failbit);
+    return;
+  }
+  readBinary(stream, _isTileAsleep.data(), _isTileAsleep.size());
+  readBinary(stream, _quietSteps.data(), _quietSteps.size());
+  for (auto& isDisturbed : _isTileDisturbed) isDisturbed.store(0, std::memory_order_relaxed);
+  _sleepingTileCount = static_cast<int>(std::count(_isTileAsleep.begin(), _isTileAsleep.end(), std::uint8_t{1}));
+  updateActiveSet();
+}
+
+void Cloth::initializeAdjacency() {
+  const int particleCount = _particles.getCapacity();
+  // Counting sort of both ends of every spring by particle
+  _adjacencyOffsets.assign(particleCount + 1, 0);
+  for (const Spring& spring : _springs) {
+    ++_adjacencyOffsets[spring.startParticleIndex() + 1];
+    ++_adjacencyOffsets[spring.endParticleIndex() + 1];
+  }
+  for (int i = 0; i < particleCount; ++i) _adjacencyOffsets[i + 1] += _adjacencyOffsets[i];
+  _adjacentSprings.resize(2 * _springs.size());
+  std::vector<int> next(_adjacencyOffsets.begin(), _adjacencyOffsets.end() - 1);
+  for (size_t i = 0; i < _springs.size(); ++i) {
+    const int spring = static_cast<int>(i);
+    _adjacentSprings[next[_springs[i].startParticleIndex()]++] = AdjacentSpring{spring, -1.0f};
+    _adjacentSprings[next[_springs[i].endParticleIndex()]++] = AdjacentSpring{spring, 1.0f};
+  }
+  _springForces = Eigen::Matrix4Xf::Zero(4, static_cast<Eigen::Index>(_springs.size()));
+}
+
+void Cloth::initializeSpringColors() {
+  // Greedy edge coloring: each spring takes the smallest color not used by another spring on its particles.
+  // A grid particle has at most 12 springs, so a spring conflicts with at most 22 others and 64 colors are plenty.
+  std::vector<std::uint64_t> usedColors(_particles.getCapacity(), 0);
+  std::vector<int> springColor(_springs.size());
+  int colorCount = 0;
+  for (size_t i = 0; i < _springs.size(); ++i) {
+    int start = _springs[i].startParticleIndex();
+    int end = _springs[i].endParticleIndex();
+    std::uint64_t used = usedColors[start] | usedColors[end];
+    int color = 0;
+    while (color < 63 && (used >> color & 1u)) ++color;
+    usedColors[start] |= std::uint64_t{1} << color;
+    usedColors[end] |= std::uint64_t{1} << color;
+    springColor[i] = color;
+    colorCount = std::max(colorCount, color + 1);
+  }
+  // Counting sort the spring indices by color
+  _springColorOffsets.assign(colorCount + 1, 0);
+  for (int color : springColor) ++_springColorOffsets[color + 1];
+  for (int color = 0; color < colorCount; ++color) _springColorOffsets[color + 1] += _springColorOffsets[color];
+  _coloredSprings.resize(_springs.size());
+  std::vector<int> next(_springColorOffsets.begin(), _springColorOffsets.end() - 1);
+  for (size_t i = 0; i < _springs.size(); ++i) _coloredSprings[next[springColor[i]]++] = static_cast<int>(i);
+  // Same order for the structural springs alone
+  _structuralSprings.clear();
+  _structuralColorOffsets.assign(1, 0);
+  for (int color = 0; color < colorCount; ++color) {
+    for (int k = _springColorOffsets[color]; k < _springColorOffsets[color + 1]; ++k) {
+      const int spring = _coloredSprings[k];
+      if (_springs[spring].type() == Spring::Type::STRUCTURAL) _structuralSprings.push_back(spring);
+    }
+    _structuralColorOffsets.push_back(static_cast<int>(_structuralSprings.size()));
+  }
 }
 
 void Cloth::collide(Shape* shape) { shape->collide(this); }
 void Cloth::collide(Spheres* sphere) { sphere->collide(this); }
+void Cloth::collide(Colliders* colliders) { colliders->collide(this); }
 
-void Cloth::computeNormal() {
-  static Eigen::Matrix<float, 4, particlesPerEdge * particlesPerEdge> normals;
-  normals.setZero();
-  for (int i = 0; i < particlesPerEdge - 1; ++i) {
-    int offset = i * (particlesPerEdge);
-    for (int j = 0; j < particlesPerEdge - 1; ++j) {
-      Eigen::Vector4f v1 = _particles.position(offset + j) - _particles.position(offset + j + particlesPerEdge);
-      Eigen::Vector4f v2 = _particles.position(offset + j + 1) - _particles.position(offset + j + particlesPerEdge);
-      Eigen::Vector4f n1 = v2.cross3(v1);
-      normals.col(offset + j) += n1;
-      normals.col(offset + j + 1) += n1;
-      normals.col(offset + j + particlesPerEdge) += n1;
-
-      Eigen::Vector4f v3 =
-          _particles.position(offset + j + particlesPerEdge + 1) - _particles.position(offset + j + particlesPerEdge);
-      Eigen::Vector4f n2 = v3.cross3(v2);
-      normals.col(offset + j + 1) += n2;
-      normals.col(offset + j + particlesPerEdge) += n2;
-      normals.col(offset + j + particlesPerEdge + 1) += n2;
-    }
-  }
-  normals.colwise().normalize();
-  normalBuffer.load(0, particlesPerEdge * particlesPerEdge * sizeof(float) * 4, normals.data());
+void Cloth::collide() {
+  if (!isSelfColliding) return;
+  const float thickness = selfCollisionThickness * 2.0f * clothWidth / (_particlesPerEdge - 1);
+  const int particleCount = _particles.getCapacity();
+  _triangleTree.refit(_particles.position());
+  _selfContacts.resize(particleCount);
+  for (SelfContact& contact : _selfContacts) {
+    contact.vertices[0] = -1;
+    contact.distance = thickness;
+  }
+  // Narrow phase: every particle keeps the closest triangle within `thickness` that it is not a corner of.
+  auto detect = [this, thickness](int beginLeaf, int endLeaf) {
+    _triangleTree.queryVertices(
+        beginLeaf, endLeaf, thickness, _particles.position(),
+        [this, thickness](int i, unsigned int a, unsigned int b, unsigned int c) {
+          const int vertices[3] = {static_cast<int>(a), static_cast<int>(b), static_cast<int>(c)};
+          if (vertices[0] == i || vertices[1] == i || vertices[2] == i) return;
+          SelfContact& contact = _selfContacts[i];
+          Eigen::Vector3f x = _particles.position(i).head<3>();
+          Eigen::Vector3f pa = _particles.position(vertices[0]).head<3>();
+          Eigen::Vector3f pb = _particles.position(vertices[1]).head<3>();
+          Eigen::Vector3f pc = _particles.position(vertices[2]).head<3>();
+          Eigen::Vector3f weights = closestPointWeights(x, pa, pb, pc);
+          Eigen::Vector3f offset = x - (weights[0] * pa + weights[1] * pb + weights[2] * pc);
+          float distance = offset.norm();
+          if (distance >= contact.distance) return;
+          // A particle lying on the triangle is pushed along the face normal instead
+          Eigen::Vector3f faceNormal = (pb - pa).cross(pc - pa);
+          if (distance > 1e-6f * thickness) {
+            contact.normal = offset / distance;
+          } else if (faceNormal.squaredNorm() > 0.0f) {
+            contact.normal = faceNormal.normalized();
+          } else {
+            return;
+          }
+          std::copy_n(vertices, 3, contact.vertices);
+          contact.weights = weights;
+          contact.distance = distance;
+        });
+  };
+  if (isMultithreaded) {
+    // A leaf covers a few particles, so use a smaller grain than for per particle loops
+    ThreadPool::getPool().parallelFor(_triangleTree.leafCount(), detect, parallelGrainSize / 4);
+  } else {
+    detect(0, _triangleTree.leafCount());
+  }
+
+  // Inelastic impulses, plus a gentle push back out of the thickness.
+  // Applied in particle order, so the result does not depend on the thread count.
+  for (int i = 0; i < particleCount; ++i) {
+    const SelfContact& contact = _selfContacts[i];
+    if (contact.vertices[0] < 0) continue;
+    Eigen::Vector4f normal(contact.normal.x(), contact.normal.y(), contact.normal.z(), 0.0f);
+    Eigen::Vector4f triangleVelocity = Eigen::Vector4f::Zero();
+    float inverseMass = _particles.inverseMass(i);
+    for (int k = 0; k < 3; ++k) {
+      triangleVelocity += contact.weights[k] * _particles.velocity(contact.vertices[k]);
+      inverseMass += contact.weights[k] * contact.weights[k] * _particles.inverseMass(contact.vertices[k]);
+    }
+    float normalVelocity = (_particles.velocity(i) - triangleVelocity).dot(normal);
+    float targetVelocity = selfCollisionRepulsion * (thickness - contact.distance);
+    if (normalVelocity >= targetVelocity || inverseMass == 0.0f) continue;
+    float impulse = (targetVelocity - normalVelocity) / inverseMass;
+    _particles.velocity(i) += impulse * _particles.inverseMass(i) * normal;
+    disturb(i);
+    for (int k = 0; k < 3; ++k) {
+      _particles.velocity(contact.vertices[k]) -=
+          impulse * contact.weights[k] * _particles.inverseMass(contact.vertices[k]) * normal;
+      disturb(contact.vertices[k]);
+    }
+  }
+}
+
+void Cloth::computeNormal(const Eigen::Matrix4Xf& positions, std::uint64_t frame) {
+  // Nothing moved since the last call, e.g. while paused
+  if (frame == _normalFrame) return;
+  _normalFrame = frame;
+  const int n = _particlesPerEdge;
+  // The rows below are walked in grid order
+  const Eigen::Matrix4Xf* gridPositions = &positions;
+  if (_order == ParticleOrder::MORTON) {
+    _gridPositions = positions(Eigen::all, _gridToParticle);
+    gridPositions = &_gridPositions;
+  }
+  // Area weighted normals of the two triangles of each quad in row i, see _triangles for their vertices.
+  auto computeFaceNormals = [&](int beginRow, int endRow) {
+    for (int i = beginRow; i < endRow; ++i) {
+      const float* top = gridPositions->data() + 4 * i * n;
+      const float* bottom = top + 4 * n;
+      float* first[3] = {&_faceNormals(1, 6 * i), &_faceNormals(1, 6 * i + 1), &_faceNormals(1, 6 * i + 2)};
+      float* second[3] = {&_faceNormals(1, 6 * i + 3), &_faceNormals(1, 6 * i + 4), &_faceNormals(1, 6 * i + 5)};
+      for (int j = 0; j < n - 1; ++j) {
+        const float* a = top + 4 * j;
+        const float* b = bottom + 4 * j;
+        // v1 = a(j) - b(j), v2 = a(j + 1) - b(j), v3 = b(j + 1) - b(j)
+        float v1x = a[0] - b[0], v1y = a[1] - b[1], v1z = a[2] - b[2];
+        float v2x = a[4] - b[0], v2y = a[5] - b[1], v2z = a[6] - b[2];
+        float v3x = b[4] - b[0], v3y = b[5] - b[1], v3z = b[6] - b[2];
+        first[0][j] = v2y * v1z - v2z * v1y;
+        first[1][j] = v2z * v1x - v2x * v1z;
+        first[2][j] = v2x * v1y - v2y * v1x;
+        second[0][j] = v3y * v2z - v3z * v2y;
+        second[1][j] = v3z * v2x - v3x * v2z;
+        second[2][j] = v3x * v2y - v3y * v2x;
+      }
+    }
+  };
+  // Each vertex sums the faces around it, so rows can be split between threads without any atomics.
+  // The zero padding of _faceNormals handles the left and right edges, so a whole row is a few array expressions.
+  auto gatherVertexNormals = [&](int beginRow, int endRow) {
+    for (int i = beginRow; i < endRow; ++i) {
+      auto sums = _normalSums.middleCols(4 * i, 4);
+      for (int c = 0; c < 3; ++c) {
+        auto sum = sums.col(c);
+        sum.setZero();
+        if (i < n - 1) {
+          sum += _faceNormals.col(6 * i + c).tail(n) + _faceNormals.col(6 * i + c).head(n) +
+                 _faceNormals.col(6 * i + 3 + c).head(n);
+        }
+        if (i > 0) {
+          sum += _faceNormals.col(6 * (i - 1) + c).tail(n) + _faceNormals.col(6 * (i - 1) + 3 + c).tail(n) +
+                 _faceNormals.col(6 * (i - 1) + 3 + c).head(n);
+        }
+      }
+      // Normalize a whole row at once, zero sums (degenerate faces) stay zero
+      sums.col(3) = sums.leftCols<3>().square().rowwise().sum();
+      sums.col(3) = (sums.col(3) > 0.0f).select(sums.col(3).rsqrt(), 0.0f);
+      for (int c = 0; c < 3; ++c) sums.col(c) *= sums.col(3);
+      _normals.middleCols(i * n, n).topRows<3>() = sums.leftCols<3>().transpose().matrix();
+    }
+  };
+  if (isMultithreaded) {
+    ThreadPool& pool = ThreadPool::getPool();
+    int grainRows = std::max(1, parallelGrainSize / n);
+    pool.parallelFor(n - 1, computeFaceNormals, grainRows);
+    pool.parallelFor(n, gatherVertexNormals, grainRows);
+  } else {
+    computeFaceNormals(0, n - 1);
+    gatherVertexNormals(0, n);
+  }
+#ifndef HW1_HEADLESS
+  const Eigen::Matrix4Xf* particleNormals = &_normals;
+  if (_order == ParticleOrder::MORTON) {
+    _particleNormals(Eigen::all, _gridToParticle) = _normals;
+    particleNormals = &_particleNormals;
+  }
+  normalBuffer.loadRing(frame, _particlesPerEdge * _particlesPerEdge * sizeof(float) * 4, particleNormals->data());
+#endif
 }
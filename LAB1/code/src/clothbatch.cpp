@@ -0,0 +1,141 @@
+#include "clothbatch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+#include "cloth.h"
+#include "configs.h"
+#include "threadpool.h"
+
+ClothBatch::ClothBatch(int particlesPerEdge, std::vector<ClothMaterial> materials, bool isPinned) :
+    _particleCount(particlesPerEdge * particlesPerEdge),
+    _materials(std::move(materials)),
+    _metrics(_materials.size()),
+    _particles(_particleCount * static_cast<int>(_materials.size()), particleMass) {
+  // Every instance starts as a copy of the same cloth
+  Cloth cloth(particlesPerEdge);
+  if (isPinned) {
+    for (int corner = 0; corner < 4; ++corner) cloth.particles().setMass(cloth.cornerIndex(corner), 0.0f);
+  }
+  _springs = cloth.springs();
+  _springKernels.resize(_materials.size());
+  for (SpringKernel& kernel : _springKernels) kernel.assign(_springs);
+  for (int i = 0; i < size(); ++i) {
+    const int offset = i * _particleCount;
+    _particles.position().middleCols(offset, _particleCount) = cloth.particles().position();
+    _particles.velocity().middleCols(offset, _particleCount) = cloth.particles().velocity();
+    _particles.acceleration().middleCols(offset, _particleCount).setZero();
+    for (int j = 0; j < _particleCount; ++j) _particles.setMass(offset + j, cloth.particles().mass(j));
+  }
+}
+
+void ClothBatch::addSphere(const Eigen::Vector4f& center, float radius) {
+  _sphereCenters.emplace_back(center);
+  _sphereRadii.emplace_back(radius);
+}
+
+void ClothBatch::updateMaterial() {
+  if (_typeStiffness == springTypeScale && _typeDamping == damperTypeScale) return;
+  _typeStiffness = springTypeScale;
+  _typeDamping = damperTypeScale;
+  _stiffnessScales.resize(_springs.size());
+  _dampingScales.resize(_springs.size());
+  for (size_t i = 0; i < _springs.size(); ++i) {
+    const int type = static_cast<int>(_springs[i].type());
+    _stiffnessScales[i] = _typeStiffness[type];
+    _dampingScales[i] = _typeDamping[type];
+  }
+  for (SpringKernel& kernel : _springKernels) kernel.setScales(_stiffnessScales, _dampingScales);
+}
+
+void ClothBatch::step(int steps) {
+  updateMaterial();
+  auto task = [this, steps](int begin, int end) {
+    for (int i = begin; i < end; ++i) simulateInstance(i, steps);
+  };
+  if (isMultithreaded) {
+    ThreadPool::getPool().parallelFor(size(), task, 1);
+  } else {
+    task(0, size());
+  }
+}
+
+void ClothBatch::simulateInstance(int instance, int steps) {
+  Metrics& metrics = _metrics[instance];
+  if (!metrics.isStable) return;
+  const ClothMaterial& material = _materials[instance];
+  const int offset = instance * _particleCount;
+  // Particles hands out temporary Refs, take the blocks as Refs too so they do not point into them
+  Eigen::Ref<Eigen::Matrix4Xf> position = _particles.position().middleCols(offset, _particleCount);
+  Eigen::Ref<Eigen::Matrix4Xf> velocity = _particles.velocity().middleCols(offset, _particleCount);
+  Eigen::Ref<Eigen::Matrix4Xf> acceleration = _particles.acceleration().middleCols(offset, _particleCount);
+  auto inverseMass = [&](int j) { return _particles.inverseMass(offset + j); };
+  const Eigen::Vector4f gravity(0, -gravityAcceleration, 0, 0);
+
+  for (int s = 0; s < steps; ++s) {
+    // Same forces as Shape::computeExternalForce and Cloth::computeSpringForce, with this instance's coefficients
+    for (int j = 0; j < _particleCount; ++j) {
+      const float w = inverseMass(j);
+      if (w == 0.0f) {
+        acceleration.col(j).setZero();
+      } else {
+        acceleration.col(j) = gravity - velocity.col(j) * (material.viscousCoef * w);
+      }
+    }
+    if (isVectorized) {
+      _springKernels[instance].compute(_particles, offset, _particleCount, material.springCoef, material.damperCoef);
+    } else {
+      for (size_t k = 0; k < _springs.size(); ++k) {
+        const Spring& spring = _springs[k];
+        const int a = static_cast<int>(spring.startParticleIndex());
+        const int b = static_cast<int>(spring.endParticleIndex());
+        Eigen::Vector4f direction = position.col(a) - position.col(b);
+        const float length = direction.norm();
+        if (length == 0.0f) continue;
+        direction /= length;
+        const float relativeSpeed = (velocity.col(a) - velocity.col(b)).dot(direction);
+        const float stiffness = material.springCoef * _stiffnessScales[k];
+        const float damping = material.damperCoef * _dampingScales[k];
+        const Eigen::Vector4f force = direction * (stiffness * (length - spring.length()) + damping * relativeSpeed);
+        acceleration.col(a) -= force * inverseMass(a);
+        acceleration.col(b) += force * inverseMass(b);
+      }
+    }
+    // Static spheres: remove the velocity towards the sphere, like Spheres::collide with an infinitely heavy sphere
+    for (size_t k = 0; k < _sphereCenters.size(); ++k) {
+      const float reach = _sphereRadii[k] + sphereCollisionMargin;
+      for (int j = 0; j < _particleCount; ++j) {
+        Eigen::Vector4f normal = _sphereCenters[k] - position.col(j);
+        const float distance = normal.norm();
+        if (distance > reach || distance == 0.0f || inverseMass(j) == 0.0f) continue;
+        normal /= distance;
+        const float approach = velocity.col(j).dot(normal);
+        if (approach > 0.0f) velocity.col(j) -= approach * normal;
+      }
+    }
+    // Same update as ExplicitEuler
+    position += deltaTime * velocity;
+    velocity += deltaTime * acceleration;
+    // Strain costs as much as a spring force pass, sample it once per displayed frame
+    if ((s + 1) % simulationPerFrame == 0 || s + 1 == steps) {
+      // A diverged instance would keep integrating NaNs, and std::max would hide them from maxStrain
+      if (!position.allFinite() || !velocity.allFinite()) {
+        metrics.isStable = false;
+        metrics.maxStrain = std::numeric_limits<float>::quiet_NaN();
+        break;
+      }
+      for (const Spring& spring : _springs) {
+        const float length = (position.col(spring.startParticleIndex()) - position.col(spring.endParticleIndex())).norm();
+        metrics.maxStrain = std::max(metrics.maxStrain, (length - spring.length()) / spring.length());
+      }
+    }
+  }
+
+  float kineticEnergy = 0.0f;
+  for (int j = 0; j < _particleCount; ++j) kineticEnergy += _particles.mass(offset + j) * velocity.col(j).squaredNorm();
+  metrics.kineticEnergy = 0.5f * kineticEnergy;
+  metrics.maxSpeed = std::sqrt(velocity.colwise().squaredNorm().maxCoeff());
+  metrics.meanHeight = position.row(1).mean();
+}
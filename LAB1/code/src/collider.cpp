@@ -0,0 +1,447 @@
+#include "collider.h"
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+#include "cloth.h"
+#include "configs.h"
+#include "threadpool.h"
+
+namespace {
+// Closest point on triangle abc to p, see Real-Time Collision Detection (Ericson) 5.1.5
+Eigen::Vector3f closestPointOnTriangle(const Eigen::Vector3f& p,
+                                       const Eigen::Vector3f& a,
+                                       const Eigen::Vector3f& b,
+                                       const Eigen::Vector3f& c) {
+  const Eigen::Vector3f ab = b - a;
+  const Eigen::Vector3f ac = c - a;
+  const Eigen::Vector3f ap = p - a;
+  const float d1 = ab.dot(ap);
+  const float d2 = ac.dot(ap);
+  if (d1 <= 0.0f && d2 <= 0.0f) return a;
+  const Eigen::Vector3f bp = p - b;
+  const float d3 = ab.dot(bp);
+  const float d4 = ac.dot(bp);
+  if (d3 >= 0.0f && d4 <= d3) return b;
+  const float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + d1 / (d1 - d3) * ab;
+  const Eigen::Vector3f cp = p - c;
+  const float d5 = ab.dot(cp);
+  const float d6 = ac.dot(cp);
+  if (d6 >= 0.0f && d5 <= d6) return c;
+  const float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + d2 / (d2 - d6) * ac;
+  const float va = d3 * d6 - d5 * d4;
+  if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) return b + (d4 - d3) / ((d4 - d3) + (d5 - d6)) * (c - b);
+  const float denominator = 1.0f / (va + vb + vc);
+  return a + ab * (vb * denominator) + ac * (vc * denominator);
+}
+
+// Inverse of a rigid transform
+Eigen::Matrix4f rigidInverse(const Eigen::Ref<const Eigen::Matrix4f>& pose) {
+  Eigen::Matrix4f inverse = Eigen::Matrix4f::Identity();
+  inverse.topLeftCorner<3, 3>() = pose.topLeftCorner<3, 3>().transpose();
+  inverse.topRightCorner<3, 1>() = -inverse.topLeftCorner<3, 3>() * pose.topRightCorner<3, 1>();
+  return inverse;
+}
+}  // namespace
+
+SignedDistanceField::SignedDistanceField(const Eigen::Ref<const Eigen::Matrix4Xf>& vertices,
+                                         const std::vector<unsigned int>& triangles,
+                                         float cellSize,
+                                         int padding) :
+    _cellSize(cellSize) {
+  padding = std::max(padding, 1);
+  const Eigen::Vector3f meshLower = vertices.topRows<3>().rowwise().minCoeff();
+  const Eigen::Vector3f meshUpper = vertices.topRows<3>().rowwise().maxCoeff();
+  _lower = meshLower - Eigen::Vector3f::Constant(padding * cellSize);
+  for (int axis = 0; axis < 3; ++axis) {
+    _size[axis] = static_cast<int>(std::ceil((meshUpper[axis] - meshLower[axis]) / cellSize)) + 2 * padding + 1;
+  }
+  const int sampleCount = _size.prod();
+  auto sampleIndex = [this](int x, int y, int z) { return (z * _size.y() + y) * _size.x() + x; };
+  auto samplePosition = [this](int x, int y, int z) {
+    return Eigen::Vector3f(_lower + _cellSize * Eigen::Vector3f(x, y, z));
+  };
+  auto vertex = [&](int triangle, int corner) {
+    return Eigen::Vector3f(vertices.col(triangles[3 * triangle + corner]).head<3>());
+  };
+  const int triangleCount = static_cast<int>(triangles.size() / 3);
+  _values.assign(sampleCount, std::numeric_limits<float>::max());
+  std::vector<int> closest(sampleCount, -1);
+  auto tryTriangle = [&](int x, int y, int z, int triangle) {
+    const Eigen::Vector3f p = samplePosition(x, y, z);
+    const float distance =
+        (p - closestPointOnTriangle(p, vertex(triangle, 0), vertex(triangle, 1), vertex(triangle, 2))).norm();
+    const int index = sampleIndex(x, y, z);
+    if (distance < _values[index]) {
+      _values[index] = distance;
+      closest[index] = triangle;
+    }
+  };
+  // Exact distances for the samples around each triangle
+  for (int t = 0; t < triangleCount; ++t) {
+    Eigen::Vector3f lower = vertex(t, 0).cwiseMin(vertex(t, 1)).cwiseMin(vertex(t, 2));
+    Eigen::Vector3f upper = vertex(t, 0).cwiseMax(vertex(t, 1)).cwiseMax(vertex(t, 2));
+    Eigen::Vector3i first = ((lower - _lower) / _cellSize).array().floor().cast<int>() - 1;
+    Eigen::Vector3i last = ((upper - _lower) / _cellSize).array().ceil().cast<int>() + 1;
+    first = first.cwiseMax(0);
+    last = last.cwiseMin(_size - Eigen::Vector3i::Ones());
+    for (int z = first.z(); z <= last.z(); ++z) {
+      for (int y = first.y(); y <= last.y(); ++y) {
+        for (int x = first.x(); x <= last.x(); ++x) tryTriangle(x, y, z, t);
+      }
+    }
+  }
+  // Propagate the closest triangles through the grid, sweeping it in all 8 diagonal directions twice.
+  // See "A Fast Sweeping Method for Eikonal Equations" (Zhao), as done by SDFGen (Batty).
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int direction = 0; direction < 8; ++direction) {
+      const int dx = (direction & 1) ? -1 : 1;
+      const int dy = (direction & 2) ? -1 : 1;
+      const int dz = (direction & 4) ? -1 : 1;
+      auto range = [](int step, int count) { return step > 0 ? std::pair{1, count} : std::pair{count - 2, -1}; };
+      const auto [beginX, endX] = range(dx, _size.x());
+      const auto [beginY, endY] = range(dy, _size.y());
+      const auto [beginZ, endZ] = range(dz, _size.z());
+      for (int z = beginZ; z != endZ; z += dz) {
+        for (int y = beginY; y != endY; y += dy) {
+          for (int x = beginX; x != endX; x += dx) {
+            // The 7 neighbors already visited by this sweep
+            for (int neighbor = 1; neighbor < 8; ++neighbor) {
+              const int triangle = closest[sampleIndex(x - ((neighbor & 1) ? dx : 0), y - ((neighbor & 2) ? dy : 0),
+                                                       z - ((neighbor & 4) ? dz : 0))];
+              if (triangle >= 0) tryTriangle(x, y, z, triangle);
+            }
+          }
+        }
+      }
+    }
+  }
+  // Sign: a ray along +x from each row of samples crosses a closed mesh an even number of times. The rays are shifted
+  // by a fraction of a cell so that they do not pass exactly through the edges of a regular mesh.
+  const float rayOffsetY = 0.0731f * cellSize;
+  const float rayOffsetZ = 0.0419f * cellSize;
+  std::vector<int> crossings(sampleCount, 0);
+  for (int t = 0; t < triangleCount; ++t) {
+    const Eigen::Vector3f a = vertex(t, 0);
+    const Eigen::Vector3f b = vertex(t, 1);
+    const Eigen::Vector3f c = vertex(t, 2);
+    const float lowerY = std::min({a.y(), b.y(), c.y()});
+    const float upperY = std::max({a.y(), b.y(), c.y()});
+    const float lowerZ = std::min({a.z(), b.z(), c.z()});
+    const float upperZ = std::max({a.z(), b.z(), c.z()});
+    // Rows of rays within the projected bounds
+    auto firstRow = [&](float lower, float offset, float origin) {
+      return std::max(0, static_cast<int>(std::ceil((lower - offset - origin) / cellSize)));
+    };
+    auto lastRow = [&](float upper, float offset, float origin, int size) {
+      return std::min(size - 1, static_cast<int>(std::floor((upper - offset - origin) / cellSize)));
+    };
+    const int firstY = firstRow(lowerY, rayOffsetY, _lower.y());
+    const int lastY = lastRow(upperY, rayOffsetY, _lower.y(), _size.y());
+    const int firstZ = firstRow(lowerZ, rayOffsetZ, _lower.z());
+    const int lastZ = lastRow(upperZ, rayOffsetZ, _lower.z(), _size.z());
+    // Twice the signed area of the triangle projected onto the yz plane
+    const float area = (b.y() - a.y()) * (c.z() - a.z()) - (b.z() - a.z()) * (c.y() - a.y());
+    if (area == 0.0f) continue;
+    for (int z = firstZ; z <= lastZ; ++z) {
+      for (int y = firstY; y <= lastY; ++y) {
+        const float py = _lower.y() + y * cellSize + rayOffsetY;
+        const float pz = _lower.z() + z * cellSize + rayOffsetZ;
+        // Barycentric coordinates of the ray in the projected triangle
+        const float wa = ((b.y() - py) * (c.z() - pz) - (b.z() - pz) * (c.y() - py)) / area;
+        const float wb = ((c.y() - py) * (a.z() - pz) - (c.z() - pz) * (a.y() - py)) / area;
+        const float wc = 1.0f - wa - wb;
+        if (wa < 0.0f || wb < 0.0f || wc < 0.0f) continue;
+        const float hitX = wa * a.x() + wb * b.x() + wc * c.x();
+        // Samples from this index on lie beyond the crossing
+        const int x = static_cast<int>(std::ceil((hitX - _lower.x()) / cellSize));
+        if (x < _size.x()) ++crossings[sampleIndex(std::max(x, 0), y, z)];
+      }
+    }
+  }
+  for (int z = 0; z < _size.z(); ++z) {
+    for (int y = 0; y < _size.y(); ++y) {
+      int count = 0;
+      for (int x = 0; x < _size.x(); ++x) {
+        const int index = sampleIndex(x, y, z);
+        count += crossings[index];
+        if (count % 2 == 1) _values[index] = -_values[index];
+      }
+    }
+  }
+}
+
+float SignedDistanceField::sample(const Eigen::Vector3f& point, Eigen::Vector3f& gradient) const {
+  // A diverged cloth gives NaN positions, which the clamp below lets through to the cell index
+  if (!point.allFinite()) {
+    gradient.setZero();
+    return std::numeric_limits<float>::max();
+  }
+  const Eigen::Vector3f clamped = point.cwiseMax(_lower).cwiseMin(upper());
+  const Eigen::Vector3f grid = (clamped - _lower) / _cellSize;
+  const Eigen::Vector3i cell = grid.array().floor().cast<int>().min((_size - Eigen::Vector3i::Constant(2)).array());
+  const Eigen::Vector3f f = grid - cell.cast<float>();
+  const int x = cell.x();
+  const int y = cell.y();
+  const int z = cell.z();
+  // Interpolate along x, then y, then z, keeping the partial derivatives along the way
+  const float v00 = value(x, y, z) + f.x() * (value(x + 1, y, z) - value(x, y, z));
+  const float v10 = value(x, y + 1, z) + f.x() * (value(x + 1, y + 1, z) - value(x, y + 1, z));
+  const float v01 = value(x, y, z + 1) + f.x() * (value(x + 1, y, z + 1) - value(x, y, z + 1));
+  const float v11 = value(x, y + 1, z + 1) + f.x() * (value(x + 1, y + 1, z + 1) - value(x, y + 1, z + 1));
+  const float dx00 = value(x + 1, y, z) - value(x, y, z);
+  const float dx10 = value(x + 1, y + 1, z) - value(x, y + 1, z);
+  const float dx01 = value(x + 1, y, z + 1) - value(x, y, z + 1);
+  const float dx11 = value(x + 1, y + 1, z + 1) - value(x, y + 1, z + 1);
+  const float v0 = v00 + f.y() * (v10 - v00);
+  const float v1 = v01 + f.y() * (v11 - v01);
+  const float dx0 = dx00 + f.y() * (dx10 - dx00);
+  const float dx1 = dx01 + f.y() * (dx11 - dx01);
+  gradient.x() = dx0 + f.z() * (dx1 - dx0);
+  gradient.y() = (v10 - v00) + f.z() * ((v11 - v01) - (v10 - v00));
+  gradient.z() = v1 - v0;
+  const float length = gradient.norm();
+  if (length > 0.0f) gradient /= length;
+  return v0 + f.z() * (v1 - v0) + (point - clamped).norm();
+}
+
+Colliders::Colliders() : Shape(0, 0.0f) {}
+
+int Colliders::add(Type type, const Eigen::Ref<const Eigen::Matrix4f>& pose, const Eigen::Vector3f& extent, int field) {
+  Collider collider;
+  collider.type = type;
+  collider.extent = extent;
+  collider.field = field;
+  _colliders.emplace_back(collider);
+  setPose(size() - 1, pose);
+  return size() - 1;
+}
+
+int Colliders::addPlane(const Eigen::Ref<const Eigen::Vector4f>& point,
+                        const Eigen::Ref<const Eigen::Vector4f>& normal) {
+  const Eigen::Vector3f y = normal.head<3>().normalized();
+  // Any tangent works, take the axis least aligned with the normal
+  Eigen::Index axis;
+  y.cwiseAbs().minCoeff(&axis);
+  const Eigen::Vector3f x = y.cross(Eigen::Vector3f::Unit(axis)).normalized();
+  Eigen::Matrix4f pose = Eigen::Matrix4f::Identity();
+  pose.block<3, 1>(0, 0) = x;
+  pose.block<3, 1>(0, 1) = y;
+  pose.block<3, 1>(0, 2) = x.cross(y);
+  pose.block<3, 1>(0, 3) = point.head<3>();
+  return add(Type::PLANE, pose, Eigen::Vector3f::Zero());
+}
+
+int Colliders::addCapsule(const Eigen::Ref<const Eigen::Matrix4f>& pose, float halfHeight, float radius) {
+  return add(Type::CAPSULE, pose, Eigen::Vector3f(halfHeight, radius, 0.0f));
+}
+
+int Colliders::addBox(const Eigen::Ref<const Eigen::Matrix4f>& pose,
+                      const Eigen::Ref<const Eigen::Vector3f>& halfExtents) {
+  return add(Type::BOX, pose, halfExtents);
+}
+
+int Colliders::addField(const Eigen::Ref<const Eigen::Matrix4f>& pose, SignedDistanceField field) {
+  _fields.emplace_back(std::move(field));
+  return add(Type::FIELD, pose, Eigen::Vector3f::Zero(), static_cast<int>(_fields.size()) - 1);
+}
+
+void Colliders::setPose(int i,
+                        const Eigen::Ref<const Eigen::Matrix4f>& pose,
+                        const Eigen::Ref<const Eigen::Vector4f>& velocity) {
+  Collider& collider = _colliders[i];
+  collider.localToWorld = pose;
+  collider.worldToLocal = rigidInverse(pose);
+  collider.velocity = velocity;
+  updateBounds(collider);
+}
+
+void Colliders::updateBounds(Collider& collider) const {
+  Eigen::Vector3f lower;
+  Eigen::Vector3f upper;
+  switch (collider.type) {
+    case Type::PLANE:
+      collider.lower.setConstant(-std::numeric_limits<float>::infinity());
+      collider.upper.setConstant(std::numeric_limits<float>::infinity());
+      return;
+    case Type::CAPSULE: {
+      const float radius = collider.extent.y();
+      upper = Eigen::Vector3f(radius, collider.extent.x() + radius, radius);
+      lower = -upper;
+      break;
+    }
+    case Type::BOX:
+      upper = collider.extent;
+      lower = -upper;
+      break;
+    case Type::FIELD:
+      lower = _fields[collider.field].lower();
+      upper = _fields[collider.field].upper();
+      break;
+  }
+  // Box around the rotated local box
+  const Eigen::Matrix3f rotation = collider.localToWorld.topLeftCorner<3, 3>();
+  const Eigen::Vector3f center = rotation * (0.5f * (lower + upper)) + collider.localToWorld.topRightCorner<3, 1>();
+  const Eigen::Vector3f extent = rotation.cwiseAbs() * (0.5f * (upper - lower));
+  collider.lower = center - extent;
+  collider.upper = center + extent;
+}
+
+void Colliders::distance(const Collider& collider,
+                         const Batch& positions,
+                         int count,
+                         BatchRow& distances,
+                         Batch& normals) const {
+  // Into the local frame, a plane only needs its height
+  const Eigen::Matrix4f& toLocal = collider.worldToLocal;
+  auto localRow = [&](int r) {
+    return BatchRow(toLocal(r, 0) * positions.row(0) + toLocal(r, 1) * positions.row(1) +
+                    toLocal(r, 2) * positions.row(2) + toLocal(r, 3));
+  };
+  Batch local;
+  switch (collider.type) {
+    case Type::PLANE:
+      distances = localRow(1);
+      normals.row(0).setConstant(collider.localToWorld(0, 1));
+      normals.row(1).setConstant(collider.localToWorld(1, 1));
+      normals.row(2).setConstant(collider.localToWorld(2, 1));
+      return;
+    case Type::CAPSULE: {
+      const float halfHeight = collider.extent.x();
+      local.row(0) = localRow(0);
+      local.row(1) = localRow(1);
+      local.row(2) = localRow(2);
+      // Offset from the closest point on the segment
+      local.row(1) -= local.row(1).max(-halfHeight).min(halfHeight);
+      const BatchRow length = local.matrix().colwise().norm().array();
+      distances = length - collider.extent.y();
+      // Points on the segment itself keep a zero normal
+      const BatchRow inverseLength = (length > 0.0f).select(length.inverse(), 0.0f);
+      local.rowwise() *= inverseLength;
+      break;
+    }
+    case Type::BOX: {
+      Batch sign;
+      Batch outside;
+      for (int r = 0; r < 3; ++r) {
+        local.row(r) = localRow(r);
+        sign.row(r) = (local.row(r) < 0.0f).select(BatchRow::Constant(-1.0f), BatchRow::Constant(1.0f));
+        // Distance beyond each pair of faces, negative inside the slab
+        local.row(r) = local.row(r).abs() - collider.extent[r];
+        outside.row(r) = local.row(r).max(0.0f);
+      }
+      const BatchRow outsideLength = outside.matrix().colwise().norm().array();
+      const BatchRow deepest = local.row(0).max(local.row(1)).max(local.row(2));
+      distances = outsideLength + deepest.min(0.0f);
+      // Outside it points away from the closest point, inside along the axis of the closest face
+      const BatchRow inverseLength = (outsideLength > 0.0f).select(outsideLength.inverse(), 0.0f);
+      const BatchRow isInside = (outsideLength > 0.0f).select(BatchRow::Zero(), BatchRow::Ones());
+      const BatchRow isFaceX = (local.row(0) == deepest).cast<float>();
+      const BatchRow isFaceY = (local.row(1) == deepest).cast<float>() * (1.0f - isFaceX);
+      const BatchRow isFaceZ = (1.0f - isFaceX) * (1.0f - isFaceY);
+      local.row(0) = sign.row(0) * (outside.row(0) * inverseLength + isInside * isFaceX);
+      local.row(1) = sign.row(1) * (outside.row(1) * inverseLength + isInside * isFaceY);
+      local.row(2) = sign.row(2) * (outside.row(2) * inverseLength + isInside * isFaceZ);
+      break;
+    }
+    case Type::FIELD: {
+      const SignedDistanceField& field = _fields[collider.field];
+      local.row(0) = localRow(0);
+      local.row(1) = localRow(1);
+      local.row(2) = localRow(2);
+      // Trilinear lookups gather from the grid, they stay one particle at a time
+      Eigen::Vector3f gradient;
+      for (int k = 0; k < count; ++k) {
+        distances(k) = field.sample(local.col(k).matrix(), gradient);
+        local.col(k) = gradient.array();
+      }
+      break;
+    }
+  }
+  // Normals back to the world
+  const Eigen::Matrix4f& toWorld = collider.localToWorld;
+  for (int r = 0; r < 3; ++r) {
+    normals.row(r) = toWorld(r, 0) * local.row(0) + toWorld(r, 1) * local.row(1) + toWorld(r, 2) * local.row(2);
+  }
+}
+
+void Colliders::distance(int i,
+                         const Eigen::Ref<const Eigen::Matrix4Xf>& positions,
+                         Eigen::Ref<Eigen::ArrayXf> distances,
+                         Eigen::Ref<Eigen::Matrix3Xf> normals) const {
+  const int count = static_cast<int>(positions.cols());
+  if (count == 0) return;
+  Batch batch;
+  Batch batchNormals;
+  BatchRow batchDistances;
+  for (int k = 0; k < batchSize; ++k) batch.col(k) = positions.col(std::min(k, count - 1)).head<3>().array();
+  distance(_colliders[i], batch, count, batchDistances, batchNormals);
+  distances = batchDistances.head(count).transpose();
+  normals = batchNormals.leftCols(count).matrix();
+}
+
+void Colliders::collide(Shape* shape) { shape->collide(this); }
+
+void Colliders::collide(Cloth* cloth) {
+  if (_colliders.empty()) return;
+  Particles& clothParticles = cloth->particles();
+  const int particleCount = clothParticles.getCapacity();
+  const float* positionData = clothParticles.getPositionData();
+  float* velocityData = clothParticles.velocity().data();
+  auto collideBatches = [&](int beginBatch, int endBatch) {
+    Batch batch;
+    Batch normals;
+    BatchRow distances;
+    for (int b = beginBatch; b < endBatch; ++b) {
+      const int begin = b * batchSize;
+      const int count = std::min(batchSize, particleCount - begin);
+      // The tail of the last batch repeats its last particle
+      const float* position = positionData + 4 * begin;
+      for (int k = 0; k < batchSize; ++k) {
+        const int column = 4 * std::min(k, count - 1);
+        batch(0, k) = position[column];
+        batch(1, k) = position[column + 1];
+        batch(2, k) = position[column + 2];
+      }
+      // Row by row, a partial reduction over the rows does not vectorize
+      Eigen::Vector3f lower;
+      Eigen::Vector3f upper;
+      for (int r = 0; r < 3; ++r) {
+        lower[r] = batch.row(r).minCoeff() - colliderMargin;
+        upper[r] = batch.row(r).maxCoeff() + colliderMargin;
+      }
+      for (const Collider& collider : _colliders) {
+        if ((lower.array() > collider.upper.array()).any() || (upper.array() < collider.lower.array()).any()) continue;
+        const bool isStatic = collider.velocity.isZero();
+        distance(collider, batch, count, distances, normals);
+        for (int k = 0; k < count; ++k) {
+          if (distances(k) >= colliderMargin) continue;
+          const int i = begin + k;
+          if (clothParticles.mass(i) == 0.0f || (isStatic && cloth->isAsleep(i))) continue;
+          Eigen::Map<Eigen::Vector4f> velocity(velocityData + 4 * i);
+          // Component by component, assembling a Vector4f from the rows would go through memory
+          const Eigen::Vector4f relative = velocity - collider.velocity;
+          const float normalSpeed =
+              normals(0, k) * relative.x() + normals(1, k) * relative.y() + normals(2, k) * relative.z();
+          // Particles inside leave at a speed growing with their depth, the others stop approaching
+          const float targetSpeed = std::max(0.0f, -distances(k)) * colliderRepulsion;
+          if (normalSpeed < targetSpeed) {
+            velocity.head<3>() += (targetSpeed - normalSpeed) * normals.col(k).matrix();
+            cloth->disturb(i);
+          }
+        }
+      }
+    }
+  };
+  const int batchCount = (particleCount + batchSize - 1) / batchSize;
+  if (isMultithreaded) {
+    ThreadPool::getPool().parallelFor(batchCount, collideBatches, std::max(1, parallelGrainSize / batchSize));
+  } else {
+    collideBatches(0, batchCount);
+  }
+}
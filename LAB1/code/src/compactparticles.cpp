@@ -0,0 +1,127 @@
+#include "compactparticles.h"
+
+#include <algorithm>
+
+#include "cloth.h"
+#include "configs.h"
+
+// MSVC does not define __F16C__, but /arch:AVX2 implies it.
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define COMPACT_PARTICLES_F16C
+#include <immintrin.h>
+#endif
+
+namespace {
+// Particles per chunk of the velocity update
+constexpr int chunkSize = 256;
+
+// Velocities of a chunk as floats, a float row is used in place. Eigen converts half one value at a time in software
+// on some compilers, so whole chunks are converted here instead.
+float* loadVelocity(float* velocity, float*, int) { return velocity; }
+float* loadVelocity(const Eigen::half* velocity, float* buffer, int count) {
+  int i = 0;
+#if defined(COMPACT_PARTICLES_F16C)
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_ps(buffer + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(velocity + i))));
+  }
+#endif
+  for (; i < count; ++i) buffer[i] = static_cast<float>(velocity[i]);
+  return buffer;
+}
+
+// Write back a chunk given by loadVelocity, rounding to nearest
+void storeVelocity(const float*, float*, int) {}
+void storeVelocity(const float* buffer, Eigen::half* velocity, int count) {
+  int i = 0;
+#if defined(COMPACT_PARTICLES_F16C)
+  for (; i + 8 <= count; i += 8) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(velocity + i),
+                     _mm256_cvtps_ph(_mm256_loadu_ps(buffer + i), _MM_FROUND_TO_NEAREST_INT));
+  }
+#endif
+  for (; i < count; ++i) velocity[i] = static_cast<Eigen::half>(buffer[i]);
+}
+}  // namespace
+
+template <typename VelocityScalar>
+CompactParticles<VelocityScalar>::CompactParticles(int size) {
+  resize(size);
+}
+
+template <typename VelocityScalar>
+void CompactParticles<VelocityScalar>::resize(int size) {
+  const int stride = (size + alignment - 1) / alignment * alignment;
+  _size = size;
+  _position.setZero(3, stride);
+  _velocity.setZero(3, stride);
+  _inverseMass.setZero(stride);
+}
+
+template <typename VelocityScalar>
+void CompactParticles<VelocityScalar>::load(const Particles& particles) {
+  const Eigen::Map<const Eigen::Matrix4Xf> position(particles.getPositionData(), 4, _size);
+  const Eigen::Map<const Eigen::Matrix4Xf> velocity(particles.getVelocityData(), 4, _size);
+  _position.leftCols(_size) = position.topRows<3>();
+  _velocity.leftCols(_size) = velocity.topRows<3>().template cast<VelocityScalar>();
+  _inverseMass.head(_size) = Eigen::Map<const Eigen::RowVectorXf>(particles.getInverseMassData(), _size);
+}
+
+template <typename VelocityScalar>
+void CompactParticles<VelocityScalar>::store(Particles& particles) const {
+  particles.position().topRows<3>() = _position.leftCols(_size);
+  particles.velocity().topRows<3>() = _velocity.leftCols(_size).template cast<float>();
+}
+
+template <typename VelocityScalar>
+std::size_t CompactParticles<VelocityScalar>::bytes() const {
+  return static_cast<std::size_t>(_position.size()) * sizeof(float) +
+         static_cast<std::size_t>(_velocity.size()) * sizeof(VelocityScalar) +
+         static_cast<std::size_t>(_inverseMass.size()) * sizeof(float);
+}
+
+template <typename VelocityScalar>
+CompactEulerStep<VelocityScalar>::CompactEulerStep(Cloth& cloth) :
+    _cloth(cloth), _particles(cloth.particles().getCapacity()) {
+  _springKernel.assign(cloth.springs());
+  _particles.load(cloth.particles());
+  _force.resize(3, _particles.stride());
+}
+
+template <typename VelocityScalar>
+void CompactEulerStep<VelocityScalar>::step() {
+  _cloth.updateMaterial();
+  if (_materialRevision != _cloth.materialRevision()) {
+    _springKernel.setScales(_cloth.stiffnessScales(), _cloth.dampingScales());
+    _materialRevision = _cloth.materialRevision();
+  }
+  const int stride = _particles.stride();
+  _force.setZero();
+  const float* position[3] = {_particles.position(0), _particles.position(1), _particles.position(2)};
+  const VelocityScalar* velocity[3] = {_particles.velocity(0), _particles.velocity(1), _particles.velocity(2)};
+  float* force[3] = {_force.row(0).data(), _force.row(1).data(), _force.row(2).data()};
+  _springKernel.computeRows(position, velocity, force, springCoef, damperCoef);
+
+  alignas(32) float buffer[chunkSize];
+  for (int axis = 0; axis < 3; ++axis) {
+    const float gravity = (axis == 1) ? -gravityAcceleration : 0.0f;
+    for (int begin = 0; begin < stride; begin += chunkSize) {
+      const int count = std::min(chunkSize, stride - begin);
+      VelocityScalar* velocityRow = _particles.velocity(axis) + begin;
+      Eigen::Map<Eigen::ArrayXf> x(_particles.position(axis) + begin, count);
+      Eigen::Map<Eigen::ArrayXf> v(loadVelocity(velocityRow, buffer, count), count);
+      Eigen::Map<Eigen::ArrayXf> acceleration(force[axis] + begin, count);
+      const Eigen::Map<const Eigen::ArrayXf> inverseMass(_particles.inverseMass() + begin, count);
+      // Same sums as computeExternalForce then computeSpringForce, a pinned particle gets no acceleration
+      acceleration = gravity * (inverseMass > 0.0f).cast<float>() - v * viscousCoef * inverseMass +
+                     acceleration * inverseMass;
+      x += deltaTime * v;
+      v += deltaTime * acceleration;
+      storeVelocity(v.data(), velocityRow, count);
+    }
+  }
+}
+
+template class CompactParticles<float>;
+template class CompactParticles<Eigen::half>;
+template class CompactEulerStep<float>;
+template class CompactEulerStep<Eigen::half>;
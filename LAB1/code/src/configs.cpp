@@ -8,9 +8,20 @@ int speedMultiplier = 1;
 
 float deltaTime = 1e-4f;
 int simulationPerFrame = static_cast<int>(baseSpeed / deltaTime);
+bool isAdaptive = false;
+float minDeltaTime = 1e-5f;
+float maxDeltaTime = 1e-3f;
+float adaptiveTolerance = 1e-4f;
+bool isMultigrid = false;
+bool isFused = false;
+int substepsPerFrame = 0;
 
 float springCoef = 20000.0f;
 float damperCoef = 750.0f;
+Eigen::Vector3f springTypeScale = Eigen::Vector3f::Ones();
+Eigen::Vector3f damperTypeScale = Eigen::Vector3f::Ones();
+bool isStrainLimiting = false;
+float maxStrain = 0.1f;
 float viscousCoef = 3.4e-4f;
 
 Eigen::Vector4f sphereColor = Eigen::Vector4f(0.28f, 0.65f, 0.8f, 1.0f);
@@ -24,5 +35,21 @@ bool isDrawingBendSprings = false;
 bool isDrawingCloth = true;
 bool isPaused = true;
 bool isStateSwitched = false;
+bool isMultithreaded = false;
+bool isVectorized = true;
+bool isSelfColliding = false;
+bool isContinuousCollision = true;
+bool isGroundColliding = false;
+bool isSleeping = false;
+int awakeParticles = 0;
+bool isRecording = false;
+bool isCheckpointRequested = false;
+bool isBaking = false;
+bool isCacheQuantized = true;
+bool isPlayingCache = false;
+int cacheFrame = 0;
+int cacheFrameCount = 0;
+bool isProfiling = false;
+bool isTracing = false;
 
 int currentIntegrator = 0;
@@ -0,0 +1,158 @@
+#include "fusedstep.h"
+
+#include <algorithm>
+
+#include "cloth.h"
+#include "configs.h"
+#include "integrator.h"
+#include "sphere.h"
+#include "threadpool.h"
+
+FusedEulerStep::FusedEulerStep(Cloth& cloth) : _cloth(cloth) {
+  const int particleCount = cloth.particles().getCapacity();
+  const int tileCount = (particleCount + fusedTileSize - 1) / fusedTileSize;
+  _springKernel.assignTiles(cloth.springs(), particleCount, fusedTileSize);
+  _finalTile.resize(particleCount);
+  std::vector<int> counts(tileCount + 1, 0);
+  for (int i = 0; i < particleCount; ++i) {
+    int farthest = i;
+    for (int k = cloth.adjacencyOffsets()[i]; k < cloth.adjacencyOffsets()[i + 1]; ++k) {
+      const Spring& spring = cloth.springs()[cloth.adjacentSprings()[k].spring];
+      farthest = std::max({farthest, static_cast<int>(spring.startParticleIndex()),
+                           static_cast<int>(spring.endParticleIndex())});
+    }
+    _finalTile[i] = farthest / fusedTileSize;
+    _lag = std::max(_lag, _finalTile[i] - i / fusedTileSize);
+    ++counts[_finalTile[i] + 1];
+  }
+  for (int t = 0; t < tileCount; ++t) counts[t + 1] += counts[t];
+  std::vector<int> finalParticles(particleCount);
+  for (int i = 0; i < particleCount; ++i) finalParticles[counts[_finalTile[i]]++] = i;
+  // Cut the sorted particles of each tile into runs of consecutive ones, on the grid mostly one per tile
+  _finalOffsets.assign(tileCount + 1, 0);
+  _finalRanges.clear();
+  for (int t = 0, k = 0; t < tileCount; ++t) {
+    for (; k < counts[t]; ++k) {
+      const int i = finalParticles[k];
+      if (_finalRanges.size() > static_cast<size_t>(_finalOffsets[t]) && _finalRanges.back().end == i &&
+          _finalRanges.back().end - _finalRanges.back().begin < fusedTileSize) {
+        ++_finalRanges.back().end;
+      } else {
+        _finalRanges.push_back({i, i + 1});
+      }
+    }
+    _finalOffsets[t + 1] = static_cast<int>(_finalRanges.size());
+  }
+}
+
+bool FusedEulerStep::isApplicable(const Integrator& integrator, Cloth& cloth, const Spheres& spheres,
+                                  bool hasColliders) {
+  return isFused && integrator.getType() == Integrator::Type::EXPLICIT_EULER &&
+         cloth.particleOrder() == Cloth::ParticleOrder::GRID && !isContinuousCollision &&
+         !isSelfColliding && !hasColliders && spheres.size() < broadPhaseMinSpheres &&
+         cloth.awakeParticleCount() == cloth.particles().getCapacity();
+}
+
+void FusedEulerStep::step(Spheres& spheres) {
+  _cloth.updateMaterial();
+  if (_materialRevision != _cloth.materialRevision()) {
+    _springKernel.setScales(_cloth.stiffnessScales(), _cloth.dampingScales());
+    _materialRevision = _cloth.materialRevision();
+  }
+  Particles& sphereParticles = spheres.particles();
+  const int sphereCount = spheres.size();
+  const int tileCount = static_cast<int>(_finalOffsets.size()) - 1;
+  if (_sphereImpulses.cols() != tileCount * sphereCount) _sphereImpulses.resize(4, tileCount * sphereCount);
+  _sphereImpulses.setZero();
+
+  // Small captures keep the std::function of parallelFor from allocating
+  auto loadTiles = [this](int begin, int end) {
+    Particles& particles = _cloth.particles();
+    for (int t = begin; t < end; ++t) {
+      const int last = std::min(particles.getCapacity(), (t + 1) * fusedTileSize);
+      _springKernel.loadTile(particles, t * fusedTileSize, last);
+    }
+  };
+  if (isMultithreaded) {
+    ThreadPool& pool = ThreadPool::getPool();
+    pool.parallelFor(tileCount, loadTiles, std::max(1, parallelGrainSize / fusedTileSize));
+    pool.parallelFor(
+        tileCount,
+        [this, &spheres](int begin, int end) {
+          const int totalTiles = static_cast<int>(_finalOffsets.size()) - 1;
+          for (int t = std::max(0, begin - _lag); t < end; ++t) {
+            // Tiles near either end of the run also hold springs of particles the neighbor runs finish
+            const bool isShared = t < begin || (end < totalTiles && t + _lag >= end);
+            _springKernel.computeTile(t, springCoef, damperCoef, isShared ? _finalTile.data() : nullptr, begin, end);
+            if (t >= begin) finishTile(t, spheres);
+          }
+        },
+        std::max(1, 4 * _lag));
+  } else {
+    for (int t = 0; t < tileCount; ++t) {
+      loadTiles(t, t + 1);
+      _springKernel.computeTile(t, springCoef, damperCoef);
+      finishTile(t, spheres);
+    }
+  }
+
+  for (int t = 0; t < tileCount; ++t) {
+    for (int s = 0; s < sphereCount; ++s) {
+      sphereParticles.velocity(s) += _sphereImpulses.col(t * sphereCount + s) * sphereParticles.inverseMass(s);
+    }
+  }
+  // Same update as ExplicitEuler::integrate
+  for (const Particles::Range& range : sphereParticles.activeRanges()) {
+    sphereParticles.position(range) += deltaTime * sphereParticles.velocity(range);
+    sphereParticles.velocity(range) += deltaTime * sphereParticles.acceleration(range);
+  }
+}
+
+void FusedEulerStep::finishTile(int tile, Spheres& spheres) {
+  for (int k = _finalOffsets[tile]; k < _finalOffsets[tile + 1]; ++k) finishRange(tile, _finalRanges[k], spheres);
+}
+
+void FusedEulerStep::finishRange(int tile, Particles::Range range, Spheres& spheres) {
+  using Rows = Eigen::Matrix<float, 3, fusedTileSize, Eigen::RowMajor>;
+  Particles& clothParticles = _cloth.particles();
+  Particles& sphereParticles = spheres.particles();
+  const int sphereCount = spheres.size();
+  const int begin = range.begin;
+  const int count = range.end - range.begin;
+  // Everything below reads the state copied into the kernel, which is still the one at the start of the step
+  const auto position = _springKernel.state().block(0, begin, 3, count);
+  const auto inverseMass = _springKernel.state().row(6).segment(begin, count).array();
+  Rows velocityRows;
+  Rows accelerationRows;
+  auto velocity = velocityRows.leftCols(count);
+  auto acceleration = accelerationRows.leftCols(count);
+  velocity = _springKernel.state().block(3, begin, 3, count);
+  // Forces of computeExternalForce and computeSpringForce, a pinned particle gets no acceleration
+  acceleration =
+      ((_springKernel.force().block(0, begin, 3, count) - viscousCoef * velocity).array().rowwise() * inverseMass)
+          .matrix();
+  acceleration.row(1).array() += -gravityAcceleration * (inverseMass > 0.0f).cast<float>();
+  // Contacts of Spheres::collide without continuous collision, against the spheres at the start of the step
+  Eigen::Array<float, 1, fusedTileSize> distances;
+  for (int s = 0; s < sphereCount; ++s) {
+    const Eigen::Vector3f center = sphereParticles.position(s).head<3>();
+    const float reach = spheres.radius(s) + sphereCollisionMargin;
+    distances.head(count) = (position.row(0).array() - center.x()).square() +
+                            (position.row(1).array() - center.y()).square() +
+                            (position.row(2).array() - center.z()).square();
+    if (!(distances.head(count) <= reach * reach).any()) continue;
+    const Eigen::Vector3f sphereVelocity = sphereParticles.velocity(s).head<3>();
+    const float sphereInverseMass = sphereParticles.inverseMass(s);
+    for (int i = 0; i < count; ++i) {
+      if (distances(i) > reach * reach) continue;
+      const Eigen::Vector3f normal = (center - position.col(i)).normalized();
+      const float approach = (sphereVelocity - velocity.col(i)).dot(normal);
+      if (approach >= 0.0f) continue;
+      const Eigen::Vector3f impulse = -normal * approach / (sphereInverseMass + inverseMass(i));
+      velocity.col(i) -= impulse * inverseMass(i);
+      _sphereImpulses.col(tile * sphereCount + s).head<3>() += impulse;
+    }
+  }
+  clothParticles.position().block(0, begin, 3, count) = position + deltaTime * velocity;
+  clothParticles.velocity().block(0, begin, 3, count) = velocity + deltaTime * acceleration;
+}
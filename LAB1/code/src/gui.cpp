@@ -1,7 +1,10 @@
 #include "gui.h"
+#include <cfloat>
 #include <cmath>
+#include <cstdio>
 
 #include "configs.h"
+#include "profiler.h"
 
 namespace {
 void renderColorPanel() {
@@ -29,6 +32,26 @@ void renderDrawingTypes() {
   ImGui::Checkbox("Surface", &isDrawingCloth);
 }
 
+// Per-phase histograms of the last profileHistoryFrames frames, the overlay shows their mean. Phases that took no time
+// over the whole history, e.g. the stages of the other integrators, are left out.
+void renderProfile() {
+  ImGui::Checkbox("Profile", &isProfiling);
+  ImGui::SameLine();
+  ImGui::Checkbox("Chrome trace", &isTracing);
+  if (!isProfiling) return;
+  const Profiler& profiler = Profiler::getProfiler();
+  char overlay[64];
+  for (int i = 0; i < Profiler::phaseCount; ++i) {
+    const auto phase = static_cast<Profiler::Phase>(i);
+    if (profiler.average(phase) == 0.0f) continue;
+    std::snprintf(overlay, sizeof(overlay), "%s: %.3f ms", Profiler::name(phase), profiler.average(phase));
+    ImGui::PushID(i);
+    ImGui::PlotHistogram("", profiler.history(phase), profileHistoryFrames, profiler.historyOffset(), overlay, 0.0f,
+                         FLT_MAX, ImVec2(0.0f, 40.0f));
+    ImGui::PopID();
+  }
+}
+
 void renderMainPanel() {
   ImGui::SetNextWindowSize(ImVec2(450.0f, 300.0f), ImGuiCond_Once);
   ImGui::SetNextWindowCollapsed(0, ImGuiCond_Once);
@@ -46,6 +69,18 @@ void renderMainPanel() {
     if (ImGui::InputFloat("damperCoef", &damperCoef, 1.0f, 1e2f, "%.0f")) {
       damperCoef = std::max(0.0f, damperCoef);
     }
+    // Structural, shear and bend
+    if (ImGui::InputFloat3("spring type scale", springTypeScale.data(), "%.2f")) {
+      springTypeScale = springTypeScale.cwiseMax(0.0f);
+    }
+    if (ImGui::InputFloat3("damper type scale", damperTypeScale.data(), "%.2f")) {
+      damperTypeScale = damperTypeScale.cwiseMax(0.0f);
+    }
+    ImGui::Checkbox("Strain limiting", &isStrainLimiting);
+    if (isStrainLimiting) {
+      ImGui::SameLine();
+      if (ImGui::InputFloat("maxStrain", &maxStrain, 0.01f, 0.1f, "%.2f")) maxStrain = std::max(0.0f, maxStrain);
+    }
 
     ImGui::Text("%s", "---------------------- Integrator ----------------------");
     ImGui::RadioButton("Explicit Euler", &currentIntegrator, 0);
@@ -54,13 +89,57 @@ void renderMainPanel() {
     ImGui::RadioButton("Midpoint Euler", &currentIntegrator, 2);
     ImGui::SameLine();
     ImGui::RadioButton("Runge Kutta Fourth", &currentIntegrator, 3);
+    ImGui::RadioButton("Backward Euler (large steps)", &currentIntegrator, 4);
+    ImGui::SameLine();
+    ImGui::RadioButton("XPBD", &currentIntegrator, 5);
+    ImGui::Checkbox("Multigrid (Backward Euler)", &isMultigrid);
+    ImGui::Checkbox("Fused step (Explicit Euler)", &isFused);
+    ImGui::Checkbox("Adaptive step (Midpoint, RK4)", &isAdaptive);
+    if (isAdaptive) {
+      if (ImGui::InputFloat("minDeltaTime", &minDeltaTime, 1e-5f, 1e-4f, "%.6f")) {
+        minDeltaTime = std::max(1e-7f, minDeltaTime);
+      }
+      if (ImGui::InputFloat("maxDeltaTime", &maxDeltaTime, 1e-4f, 1e-3f, "%.5f")) {
+        maxDeltaTime = std::max(minDeltaTime, maxDeltaTime);
+      }
+      if (ImGui::InputFloat("tolerance", &adaptiveTolerance, 1e-5f, 1e-4f, "%.6f")) {
+        adaptiveTolerance = std::max(1e-8f, adaptiveTolerance);
+      }
+    }
+    ImGui::Text("Substeps last frame: %d", substepsPerFrame);
 
     ImGui::Text("%s", "-------------------- Drawing Config --------------------");
     renderColorPanel();
     renderDrawingTypes();
     ImGui::Text("%s", "-------------------- Miscellaneous ---------------------");
     if ((isStateSwitched = ImGui::Button(isPaused ? "Start" : "Stop"))) isPaused = !isPaused;
+    ImGui::SameLine();
+    ImGui::Checkbox("Multithreading", &isMultithreaded);
+    ImGui::SameLine();
+    ImGui::Checkbox("SIMD", &isVectorized);
+    ImGui::SameLine();
+    ImGui::Checkbox("Self collision", &isSelfColliding);
+    ImGui::Checkbox("Continuous collision", &isContinuousCollision);
+    ImGui::SameLine();
+    ImGui::Checkbox("Ground", &isGroundColliding);
+    ImGui::SameLine();
+    ImGui::Checkbox("Sleeping", &isSleeping);
+    if (isSleeping) {
+      ImGui::SameLine();
+      ImGui::Text("Awake particles: %d", awakeParticles);
+    }
+    if (ImGui::Button("Save checkpoint")) isCheckpointRequested = true;
+    ImGui::SameLine();
+    ImGui::Checkbox("Record inputs", &isRecording);
+    ImGui::Checkbox("Bake point cache", &isBaking);
+    ImGui::SameLine();
+    ImGui::Checkbox("16-bit", &isCacheQuantized);
+    if (cacheFrameCount > 0) {
+      ImGui::Checkbox("Play cache", &isPlayingCache);
+      if (isPlayingCache) ImGui::SliderInt("Cache frame", &cacheFrame, 0, cacheFrameCount - 1);
+    }
     ImGui::Text("Current framerate: %.0f", ImGui::GetIO().Framerate);
+    renderProfile();
   }
   ImGui::End();
 }
@@ -1,8 +1,52 @@
 #include "integrator.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "binaryio.h"
+#include "cloth.h"
 #include "configs.h"
+#include "profiler.h"
+#include "threadpool.h"
+
+namespace {
+// Index of entry (row, col) in valuePtr() of a compressed row-major matrix, the entry must exist.
+int entryOffset(const Eigen::SparseMatrix<float, Eigen::RowMajor> &matrix, int row, int col) {
+  const int *columns = matrix.innerIndexPtr();
+  const int *begin = columns + matrix.outerIndexPtr()[row];
+  const int *end = columns + matrix.outerIndexPtr()[row + 1];
+  return static_cast<int>(std::lower_bound(begin, end, col) - columns);
+}
+
+// Accumulate a 3x3 block whose rows start at values[offsets[0..2]].
+void addBlock(float *values, const int *offsets, const Eigen::Matrix3f &block) {
+  for (int r = 0; r < 3; ++r) {
+    for (int c = 0; c < 3; ++c) values[offsets[r] + c] += block(r, c);
+  }
+}
+}  // namespace
+
+void Integrator::reserveScratch(const std::vector<Particles *> &particles, std::vector<Particles> &scratch) {
+  if (scratch.size() != particles.size()) scratch.resize(particles.size(), Particles(0));
+  for (size_t i = 0; i < particles.size(); ++i) {
+    if (scratch[i].getCapacity() != particles[i]->getCapacity()) scratch[i].resize(particles[i]->getCapacity());
+  }
+}
+
+void Integrator::backupState(const std::vector<Particles *> &particles, std::vector<Particles> &backup) {
+  reserveScratch(particles, backup);
+  for (size_t i = 0; i < particles.size(); ++i) {
+    for (const Particles::Range &range : particles[i]->activeRanges()) {
+      backup[i].position(range) = particles[i]->position(range);
+      backup[i].velocity(range) = particles[i]->velocity(range);
+    }
+  }
+}
 
-void ExplicitEuler::integrate(const std::vector<Particles *> &particles, std::function<void(void)>) const {
+int Integrator::stepsPerFrame() const { return simulationPerFrame; }
+
+void ExplicitEuler::integrate(const std::vector<Particles *> &particles, const std::function<void(void)> &) const {
   // TODO: Integrate velocity and acceleration
   //   1. Integrate velocity.
   //   2. Integrate acceleration.
@@ -11,128 +55,517 @@ void ExplicitEuler::integrate(const std::vector<Particles *> &particles, std::fu
   //   1. You don't need the simulation function in explicit euler.
   //   2. You should do this first because it is very simple. Then you can chech your collision is correct or not.
   //   3. This can be done in 5 lines. (Hint: You can add / multiply all particles at once since it is a large matrix.)
+  ScopedTimer timer(Profiler::Phase::INTEGRATOR_STAGES);
   for (auto &p : particles) {
     //deltatime in config.h
-    //change position first or it will get wrong position    
-    p->position() += deltaTime * p->velocity();
-    p->velocity() += deltaTime * p->acceleration();
+    //change position first or it will get wrong position
+    // sleeping particles are skipped
+    for (const Particles::Range &range : p->activeRanges()) {
+      p->position(range) += deltaTime * p->velocity(range);
+      p->velocity(range) += deltaTime * p->acceleration(range);
+    }
   }
 }
 
 void ImplicitEuler::integrate(const std::vector<Particles *> &particles,
-                              std::function<void(void)> simulateOneStep) const {
+                              const std::function<void(void)> &simulateOneStep) const {
     // TODO: Integrate velocity and acceleration
     //   1. Backup original particles' data.
     //   2. Integrate velocity and acceleration using explicit euler to get Xn+1.
     //   3. Compute refined Xn+1 using (1.) and (2.).
     // Note:
     //   1. Use simulateOneStep with modified position and velocity to get Xn+1.
-    //step1
-    std::vector<Particles> backup;
-    for (int i = 0; i < particles.size(); ++i) {
-      backup.push_back(*particles[i]);  // backup the particle
-    }
-    // step2
-    for (auto &p : particles) {
-        p->position() += deltaTime * p->velocity();
-        p->velocity() += deltaTime * p->acceleration();
+    {
+        ScopedTimer timer(Profiler::Phase::INTEGRATOR_STAGES);
+        //step1
+        backupState(particles, _backup);
+        // step2
+        for (auto &p : particles) {
+            for (const Particles::Range &range : p->activeRanges()) {
+                p->position(range) += deltaTime * p->velocity(range);
+                p->velocity(range) += deltaTime * p->acceleration(range);
+            }
+        }
     }
     simulateOneStep();
     // step3
-    for (int i = 0; i < particles.size(); ++i) {
-        particles[i]->position() = backup[i].position() + particles[i]->velocity() * deltaTime;
-        particles[i]->velocity() = backup[i].velocity() + particles[i]->acceleration() * deltaTime;
+    ScopedTimer timer(Profiler::Phase::INTEGRATOR_STAGES);
+    for (size_t i = 0; i < particles.size(); ++i) {
+        for (const Particles::Range &range : particles[i]->activeRanges()) {
+            particles[i]->position(range) = _backup[i].position(range) + particles[i]->velocity(range) * deltaTime;
+            particles[i]->velocity(range) = _backup[i].velocity(range) + particles[i]->acceleration(range) * deltaTime;
+        }
+    }
+}
+
+void AdaptiveIntegrator::integrate(const std::vector<Particles *> &particles,
+                                   const std::function<void(void)> &simulateOneStep) const {
+  if (!isAdaptive) {
+    step(particles, simulateOneStep, deltaTime);
+    _substepCount = 1;
+    return;
+  }
+  // Same simulated time per frame as the fixed step integrators
+  const float frameTime = static_cast<float>(simulationPerFrame) * deltaTime;
+  // Error of the two halves, estimated from their difference to the whole step
+  const float errorScale = 1.0f / static_cast<float>((1 << order()) - 1);
+  const float lowerBound = std::min(minDeltaTime, maxDeltaTime);
+  const float upperBound = std::max(minDeltaTime, maxDeltaTime);
+  if (_stepSize == 0.0f) _stepSize = deltaTime;
+  reserveScratch(particles, _start);
+  reserveScratch(particles, _whole);
+  _substepCount = 0;
+  float remaining = frameTime;
+  // Copy the active particles of every set from one buffer to another
+  auto copyState = [&particles](auto from, auto to, bool isAccelerationCopied) {
+    ScopedTimer timer(Profiler::Phase::STEP_DOUBLING);
+    for (size_t i = 0; i < particles.size(); ++i) {
+      for (const Particles::Range &range : particles[i]->activeRanges()) {
+        to(i).position(range) = from(i).position(range);
+        to(i).velocity(range) = from(i).velocity(range);
+        if (isAccelerationCopied) to(i).acceleration(range) = from(i).acceleration(range);
+      }
+    }
+  };
+  auto current = [&particles](size_t i) -> Particles & { return *particles[i]; };
+  auto start = [this](size_t i) -> Particles & { return _start[i]; };
+  auto whole = [this](size_t i) -> Particles & { return _whole[i]; };
+  while (remaining > 0.0f) {
+    _stepSize = std::clamp(_stepSize, lowerBound, upperBound);
+    // Stretch the step over a remainder too small to be worth its own substep
+    const float h = remaining < 1.01f * _stepSize ? remaining : _stepSize;
+    // simulateOneStep already ran for the current state, keep its acceleration for the second attempt
+    copyState(current, start, true);
+    step(particles, simulateOneStep, h);
+    copyState(current, whole, false);
+    copyState(start, current, true);
+    step(particles, simulateOneStep, 0.5f * h);
+    simulateOneStep();
+    step(particles, simulateOneStep, 0.5f * h);
+
+    // Velocity errors are weighted by h so that both terms are distances
+    float error = 0.0f;
+    bool isFinite = true;
+    {
+      ScopedTimer timer(Profiler::Phase::STEP_DOUBLING);
+      for (size_t i = 0; i < particles.size(); ++i) {
+        for (const Particles::Range &range : particles[i]->activeRanges()) {
+          if (range.begin == range.end) continue;
+          isFinite = isFinite && particles[i]->position(range).allFinite() && particles[i]->velocity(range).allFinite();
+          error = std::max(error, (particles[i]->position(range) - _whole[i].position(range)).cwiseAbs().maxCoeff());
+          error =
+              std::max(error, h * (particles[i]->velocity(range) - _whole[i].velocity(range)).cwiseAbs().maxCoeff());
+        }
+      }
+    }
+    error *= errorScale;
+    // std::max drops NaN, so a step that blew up would read as exact and grow h, retry it smaller instead
+    const bool isDiverged = !isFinite || !std::isfinite(error);
+    bool isAccepted = (!isDiverged && error <= adaptiveTolerance) || h <= lowerBound;
+    if (isDiverged) {
+      _stepSize = std::max(lowerBound, 0.25f * h);
+    } else {
+      // Usual controller: aim a bit below the tolerance, do not change h too much at once
+      float factor = error == 0.0f ? 4.0f : 0.9f * std::pow(adaptiveTolerance / error, 1.0f / (order() + 1));
+      if (h == _stepSize || factor < 1.0f) _stepSize = h * std::clamp(factor, 0.25f, 4.0f);
     }
+    if (!isAccepted) {
+      copyState(start, current, true);
+      continue;
+    }
+    ++_substepCount;
+    remaining = h == remaining ? 0.0f : remaining - h;
+    // Every substep but the last needs the acceleration of its start, the caller does that for the next call
+    if (remaining > 0.0f) simulateOneStep();
+  }
 }
 
-void MidpointEuler::integrate(const std::vector<Particles *> &particles,
-                              std::function<void(void)> simulateOneStep) const {
+int AdaptiveIntegrator::stepsPerFrame() const { return isAdaptive ? 1 : simulationPerFrame; }
+
+void AdaptiveIntegrator::saveState(std::ostream &stream) const { writeBinary(stream, _stepSize); }
+
+void AdaptiveIntegrator::loadState(std::istream &stream) { readBinary(stream, _stepSize); }
+
+void MidpointEuler::step(const std::vector<Particles *> &particles, const std::function<void(void)> &simulateOneStep,
+                         float h) const {
   // TODO: Integrate velocity and acceleration
   //   1. Backup original particles' data.
   //   2. Integrate velocity and acceleration using explicit euler to get Xn+1.
   //   3. Compute refined Xn+1 using (1.) and (2.).
   // Note:
   //   1. Use simulateOneStep with modified position and velocity to get Xn+1.
-  // step1
-  std::vector<Particles> backup;
-  for (int i = 0; i < particles.size(); ++i) {
-    backup.push_back(*particles[i]);  // backup the particle
+  {
+    ScopedTimer timer(Profiler::Phase::INTEGRATOR_STAGES);
+    // step1
+    backupState(particles, _backup);
+    // step2
+    for (auto &p : particles) {
+      for (const Particles::Range &range : p->activeRanges()) {
+        p->position(range) += 0.5f*h * p->velocity(range);
+        p->velocity(range) += 0.5f*h * p->acceleration(range);
+      }
+    }
   }
+  // the acceleration at the midpoint, without it the velocity would only be first order
   simulateOneStep();
-  // step2
-  for (auto &p : particles) {
-    p->position() += 0.5f*deltaTime * p->velocity();
-    p->velocity() += 0.5f*deltaTime * p->acceleration();
-  }
   // step3
-  for (int i = 0; i < particles.size(); ++i) {
-    particles[i]->position() = backup[i].position() + particles[i]->velocity() * deltaTime;
-    particles[i]->velocity() = backup[i].velocity() + particles[i]->acceleration() * deltaTime;
+  ScopedTimer timer(Profiler::Phase::INTEGRATOR_STAGES);
+  for (size_t i = 0; i < particles.size(); ++i) {
+    for (const Particles::Range &range : particles[i]->activeRanges()) {
+      particles[i]->position(range) = _backup[i].position(range) + particles[i]->velocity(range) * h;
+      particles[i]->velocity(range) = _backup[i].velocity(range) + particles[i]->acceleration(range) * h;
+    }
   }
 }
 
-void RungeKuttaFourth::integrate(const std::vector<Particles *> &particles,
-                                 std::function<void(void)> simulateOneStep) const {
+void RungeKuttaFourth::step(const std::vector<Particles *> &particles,
+                            const std::function<void(void)> &simulateOneStep, float h) const {
     // TODO: Integrate velocity and acceleration
     //   1. Backup original particles' data.
     //   2. Compute k1, k2, k3, k4
     //   3. Compute refined Xn+1 using (1.) and (2.).
     // Note:
     //   1. Use simulateOneStep with modified position and velocity to get Xn+1.
-    //backup
-    std::vector<Particles> backup;
-    
-
-    for (int i = 0; i < particles.size(); ++i) {
-        backup.push_back(*particles[i]);  // backup the particle
+    // Each stage updates the active ranges of every particle set, timed on its own
+    auto stage = [&particles](auto &&update) {
+      ScopedTimer timer(Profiler::Phase::INTEGRATOR_STAGES);
+      for (size_t i = 0; i < particles.size(); ++i) {
+        for (const Particles::Range &range : particles[i]->activeRanges()) update(i, range);
+      }
+    };
+    {
+      ScopedTimer timer(Profiler::Phase::INTEGRATOR_STAGES);
+      //backup
+      backupState(particles, _backup);
+      // k1 .. k4 are accumulated into _increment instead of being stored separately
+      reserveScratch(particles, _increment);
     }
-    std::vector<Particles> k1(backup);
-    std::vector<Particles> k2(backup);
-    std::vector<Particles> k3(backup);
-    std::vector<Particles> k4(backup);
+    // Each k is read from the particles before they move to the state the next k is evaluated at.
     //k1
-    for (int i = 0; i < backup.size(); ++i) {
-        //update the particle
-        particles[i]->position() = backup[i].position() + (particles[i]->velocity() * deltaTime * 0.5f);
-        particles[i]->velocity() = backup[i].velocity() + (particles[i]->acceleration() * deltaTime * 0.5f);
-        //store k1
-        k1[i].position() = particles[i]->velocity()*deltaTime;
-        k1[i].velocity() = particles[i]->acceleration() * deltaTime;
-    }
+    stage([&](size_t i, const Particles::Range &range) {
+      //store k1
+      _increment[i].position(range) = particles[i]->velocity(range) * h;
+      _increment[i].velocity(range) = particles[i]->acceleration(range) * h;
+      //update the particle
+      particles[i]->position(range) = _backup[i].position(range) + (particles[i]->velocity(range) * h * 0.5f);
+      particles[i]->velocity(range) = _backup[i].velocity(range) + (particles[i]->acceleration(range) * h * 0.5f);
+    });
     simulateOneStep();
-    for (int i = 0; i < backup.size(); ++i) {
+    stage([&](size_t i, const Particles::Range &range) {
+      // add 2 * k2
+      _increment[i].position(range) += 2.0f * (particles[i]->velocity(range) * h);
+      _increment[i].velocity(range) += 2.0f * (particles[i]->acceleration(range) * h);
       // update the particle
-      particles[i]->position() = backup[i].position() + (particles[i]->velocity() * deltaTime * 0.5f);
-      particles[i]->velocity() = backup[i].velocity() + (particles[i]->acceleration() * deltaTime * 0.5f);
-      // store k2
-      k2[i].position() = particles[i]->velocity() * deltaTime;
-      k2[i].velocity() = particles[i]->acceleration() * deltaTime;
-    }
+      particles[i]->position(range) = _backup[i].position(range) + (particles[i]->velocity(range) * h * 0.5f);
+      particles[i]->velocity(range) = _backup[i].velocity(range) + (particles[i]->acceleration(range) * h * 0.5f);
+    });
     simulateOneStep();
-    for (int i = 0; i < backup.size(); ++i) {
-      // update the particle
-      particles[i]->position() = backup[i].position() + (particles[i]->velocity() * deltaTime * 0.5f);
-      particles[i]->velocity() = backup[i].velocity() + (particles[i]->acceleration() * deltaTime * 0.5f);
-      // store k3
-      k3[i].position() = particles[i]->velocity() * deltaTime;
-      k3[i].velocity() = particles[i]->acceleration() * deltaTime;
-    }
+    stage([&](size_t i, const Particles::Range &range) {
+      // add 2 * k3
+      _increment[i].position(range) += 2.0f * (particles[i]->velocity(range) * h);
+      _increment[i].velocity(range) += 2.0f * (particles[i]->acceleration(range) * h);
+      // update the particle, k4 is evaluated at the end of the step
+      particles[i]->position(range) = _backup[i].position(range) + (particles[i]->velocity(range) * h);
+      particles[i]->velocity(range) = _backup[i].velocity(range) + (particles[i]->acceleration(range) * h);
+    });
     simulateOneStep();
-    for (int i = 0; i < backup.size(); ++i) {
-      // store k4
-      k4[i].position() = particles[i]->velocity() * deltaTime;
-      k4[i].velocity() = particles[i]->acceleration() * deltaTime;
-    }
-    for (int i = 0; i < backup.size(); ++i) {
+    stage([&](size_t i, const Particles::Range &range) {
+      // add k4
+      _increment[i].position(range) += particles[i]->velocity(range) * h;
+      _increment[i].velocity(range) += particles[i]->acceleration(range) * h;
       //  Runge-Kutta
-      particles[i]->position() =
-          backup[i].position() +
-          (k1[i].position() + 2.0f * k2[i].position() + 2.0f * k3[i].position() + k4[i].position()) / 6.0f;
+      particles[i]->position(range) = _backup[i].position(range) + _increment[i].position(range) / 6.0f;
+      particles[i]->velocity(range) = _backup[i].velocity(range) + _increment[i].velocity(range) / 6.0f;
+    });
+}
 
-      particles[i]->velocity() =
-          backup[i].velocity() +
-          (k1[i].velocity() + 2.0f * k2[i].velocity() + 2.0f * k3[i].velocity() + k4[i].velocity()) / 6.0f;
+void BackwardEuler::integrate(const std::vector<Particles *> &particles, const std::function<void(void)> &) const {
+  Particles &cloth = _cloth.particles();
+  {
+    ScopedTimer timer(Profiler::Phase::ASSEMBLE);
+    if (_system.rows() != 3 * cloth.getCapacity() || _springOffsets.size() != 6 * _cloth.springs().size()) {
+      buildPattern();
     }
+    assemble();
+  }
+  if (isMultigrid) {
+    ScopedTimer timer(Profiler::Phase::MULTIGRID_UPDATE);
+    _multigrid.update();
+  }
+  {
+    ScopedTimer timer(Profiler::Phase::SOLVE);
+    solve();
+  }
+  ScopedTimer timer(Profiler::Phase::INTEGRATOR_STAGES);
+  // v(n+1) = v(n) + dv, x(n+1) = x(n) + h * v(n+1)
+  for (const Particles::Range &range : cloth.activeRanges()) {
+    for (int i = range.begin; i < range.end; ++i) {
+      if (cloth.mass(i) != 0.0f) cloth.velocity(i).head<3>() += _deltaVelocity.segment<3>(3 * i);
+    }
+    cloth.position(range) += deltaTime * cloth.velocity(range);
+  }
+  for (auto &p : particles) {
+    if (p == &cloth) continue;
+    p->position() += deltaTime * p->velocity();
+    p->velocity() += deltaTime * p->acceleration();
+  }
+}
+
+void BackwardEuler::saveState(std::ostream &stream) const {
+  writeBinary(stream, static_cast<std::int32_t>(_deltaVelocity.size()));
+  writeBinary(stream, _deltaVelocity.data(), _deltaVelocity.size());
+}
+
+void BackwardEuler::loadState(std::istream &stream) {
+  std::int32_t size = 0;
+  readBinary(stream, size);
+  // Build the pattern now, the first integrate would otherwise clear the warm start
+  if (size != 0) buildPattern();
+  if (size != _deltaVelocity.size()) {
+    stream.setstate(std::ios::failbit);
+    return;
+  }
+  readBinary(stream, _deltaVelocity.data(), _deltaVelocity.size());
+}
+
+void BackwardEuler::buildPattern() const {
+  const std::vector<Spring> &springs = _cloth.springs();
+  int particleCount = _cloth.particles().getCapacity();
+  std::vector<Eigen::Triplet<float>> triplets;
+  triplets.reserve(9 * (particleCount + 2 * springs.size()));
+  auto addBlockPattern = [&triplets](int i, int j) {
+    for (int r = 0; r < 3; ++r) {
+      for (int c = 0; c < 3; ++c) triplets.emplace_back(3 * i + r, 3 * j + c, 0.0f);
+    }
+  };
+  for (int i = 0; i < particleCount; ++i) addBlockPattern(i, i);
+  for (const auto &spring : springs) {
+    addBlockPattern(spring.startParticleIndex(), spring.endParticleIndex());
+    addBlockPattern(spring.endParticleIndex(), spring.startParticleIndex());
+  }
+  _system.resize(3 * particleCount, 3 * particleCount);
+  _system.setFromTriplets(triplets.begin(), triplets.end());
+  _system.makeCompressed();
+
+  _diagonalOffsets.resize(3 * particleCount);
+  for (int i = 0; i < 3 * particleCount; ++i) _diagonalOffsets[i] = entryOffset(_system, i, i - i % 3);
+  _springOffsets.resize(6 * springs.size());
+  for (size_t k = 0; k < springs.size(); ++k) {
+    int start = springs[k].startParticleIndex();
+    int end = springs[k].endParticleIndex();
+    for (int r = 0; r < 3; ++r) {
+      _springOffsets[6 * k + r] = entryOffset(_system, 3 * start + r, 3 * end);
+      _springOffsets[6 * k + 3 + r] = entryOffset(_system, 3 * end + r, 3 * start);
+    }
+  }
+
+  _rhs.resize(3 * particleCount);
+  _deltaVelocity.setZero(3 * particleCount);
+  _inverseDiagonal.resize(3 * particleCount);
+  _residual.resize(3 * particleCount);
+  _direction.resize(3 * particleCount);
+  _preconditioned.resize(3 * particleCount);
+  _product.resize(3 * particleCount);
+  _freeRows.resize(3 * particleCount);
+  _multigrid.build(_cloth, _system);
+}
 
+void BackwardEuler::assemble() const {
+  Particles &cloth = _cloth.particles();
+  const std::vector<Spring> &springs = _cloth.springs();
+  _cloth.updateMaterial();
+  const std::vector<float> &stiffnessScales = _cloth.stiffnessScales();
+  const std::vector<float> &dampingScales = _cloth.dampingScales();
+  const float h = deltaTime;
+  float *values = _system.valuePtr();
+  std::fill(values, values + _system.nonZeros(), 0.0f);
+
+  // Sleeping particles are held like pinned ones
+  auto isHeld = [this, &cloth](int i) { return cloth.mass(i) == 0.0f || _cloth.isAsleep(i); };
+  // Mass and viscous damping (df/dv = -viscousCoef * I), pinned particles get an identity row and dv = 0.
+  for (int i = 0; i < cloth.getCapacity(); ++i) {
+    float diagonal = 1.0f;
+    _freeRows.segment<3>(3 * i).setConstant(isHeld(i) ? 0.0f : 1.0f);
+    if (isHeld(i)) {
+      _rhs.segment<3>(3 * i).setZero();
+      _deltaVelocity.segment<3>(3 * i).setZero();
+    } else {
+      diagonal = cloth.mass(i) + h * viscousCoef;
+      // h * f(n), simulateOneStep already left f / m in acceleration
+      _rhs.segment<3>(3 * i) = h * cloth.mass(i) * cloth.acceleration(i).head<3>();
+    }
+    for (int r = 0; r < 3; ++r) values[_diagonalOffsets[3 * i + r] + r] = diagonal;
+  }
+
+  for (size_t k = 0; k < springs.size(); ++k) {
+    int start = springs[k].startParticleIndex();
+    int end = springs[k].endParticleIndex();
+    Eigen::Vector3f direction = (cloth.position(start) - cloth.position(end)).head<3>();
+    float length = direction.norm();
+    if (length == 0.0f) continue;
+    direction /= length;
+    Eigen::Matrix3f outer = direction * direction.transpose();
+    // Drop the transverse term when compressed, otherwise df/dx is indefinite and CG may diverge.
+    float stretch = std::max(0.0f, 1.0f - springs[k].length() / length);
+    const float stiffness = springCoef * stiffnessScales[k];
+    const float damping = damperCoef * dampingScales[k];
+    Eigen::Matrix3f dfdx = -stiffness * (outer + stretch * (Eigen::Matrix3f::Identity() - outer));
+    Eigen::Matrix3f dfdv = -damping * outer;
+    Eigen::Matrix3f block = -h * dfdv - h * h * dfdx;
+    Eigen::Vector3f rhs = h * h * dfdx * (cloth.velocity(start) - cloth.velocity(end)).head<3>();
+
+    bool isStartFree = !isHeld(start);
+    bool isEndFree = !isHeld(end);
+    if (isStartFree) {
+      addBlock(values, &_diagonalOffsets[3 * start], block);
+      _rhs.segment<3>(3 * start) += rhs;
+    }
+    if (isEndFree) {
+      addBlock(values, &_diagonalOffsets[3 * end], block);
+      _rhs.segment<3>(3 * end) -= rhs;
+    }
+    if (isStartFree && isEndFree) {
+      addBlock(values, &_springOffsets[6 * k], -block);
+      addBlock(values, &_springOffsets[6 * k + 3], -block);
+    }
+  }
 
+  for (int i = 0; i < _inverseDiagonal.size(); ++i) {
+    _inverseDiagonal[i] = 1.0f / values[_diagonalOffsets[i] + i % 3];
+  }
+}
+
+void BackwardEuler::solve() const {
+  _product.noalias() = _system * _deltaVelocity;
+  _residual = _rhs - _product;
+  precondition();
+  _direction = _preconditioned;
+  float residualDotPreconditioned = _residual.dot(_preconditioned);
+  const float threshold = implicitSolverTolerance * implicitSolverTolerance * _rhs.squaredNorm();
+
+  _iterations = 0;
+  while (_iterations < implicitSolverMaxIterations && _residual.squaredNorm() > threshold) {
+    _product.noalias() = _system * _direction;
+    float alpha = residualDotPreconditioned / _direction.dot(_product);
+    _deltaVelocity += alpha * _direction;
+    _residual -= alpha * _product;
+    precondition();
+    float nextResidualDotPreconditioned = _residual.dot(_preconditioned);
+    _direction = _preconditioned + (nextResidualDotPreconditioned / residualDotPreconditioned) * _direction;
+    residualDotPreconditioned = nextResidualDotPreconditioned;
+    ++_iterations;
+  }
+}
+
+void BackwardEuler::precondition() const {
+  if (!isMultigrid) {
+    _preconditioned = _inverseDiagonal.cwiseProduct(_residual);
+    return;
+  }
+  // The coarse levels blur corrections into held particles, drop them so that their dv stays 0
+  _multigrid.apply(_residual, _preconditioned);
+  _preconditioned.array() *= _freeRows.array();
+}
+
+void XPBD::integrate(const std::vector<Particles *> &particles, const std::function<void(void)> &) const {
+  Particles &cloth = _cloth.particles();
+  const std::vector<Spring> &springs = _cloth.springs();
+  const std::vector<int> &coloredSprings = _cloth.coloredSprings();
+  const std::vector<int> &colorOffsets = _cloth.springColorOffsets();
+  _cloth.updateMaterial();
+  const std::vector<float> &stiffnessScales = _cloth.stiffnessScales();
+  const std::vector<float> &dampingScales = _cloth.dampingScales();
+  const float h = deltaTime;
+  if (h == 0.0f) return;
+  {
+    ScopedTimer timer(Profiler::Phase::XPBD_PREDICT);
+    // Sleeping particles are held like pinned ones
+    _inverseMass.resize(cloth.getCapacity());
+    for (int i = 0; i < cloth.getCapacity(); ++i) _inverseMass[i] = _cloth.isAsleep(i) ? 0.0f : cloth.inverseMass(i);
+    _constraints.resize(coloredSprings.size());
+    for (size_t slot = 0; slot < coloredSprings.size(); ++slot) {
+      const int i = coloredSprings[slot];
+      const Spring &spring = springs[i];
+      Constraint &constraint = _constraints[slot];
+      constraint.start = spring.startParticleIndex();
+      constraint.end = spring.endParticleIndex();
+      constraint.restLength = spring.length();
+      constraint.lambda = 0.0f;
+      // alpha~ = alpha / h^2 with alpha = 1 / k, gamma = alpha~ * beta~ / h with beta~ = h^2 * beta.
+      const float stiffness = springCoef * stiffnessScales[i];
+      constraint.compliance = 1.0f / (stiffness * h * h);
+      constraint.damping = (damperCoef * dampingScales[i]) / (stiffness * h);
+      float weight = _inverseMass[constraint.start] + _inverseMass[constraint.end];
+      // Both ends pinned: the projection must not move anything. A zero stiffness means infinite compliance, which
+      // leaves the spring inactive.
+      if (weight == 0.0f || stiffness == 0.0f) {
+        constraint.compliance = 0.0f;
+        constraint.damping = 0.0f;
+        constraint.inverseDenominator = 0.0f;
+      } else {
+        constraint.inverseDenominator = 1.0f / ((1.0f + constraint.damping) * weight + constraint.compliance);
+      }
+    }
+
+    // Predict with the external force only: v = v(n) + h * a, x = x(n) + h * v
+    _previousPosition = cloth.position();
+    for (const Particles::Range &range : cloth.activeRanges()) {
+      cloth.velocity(range) += h * cloth.acceleration(range);
+      cloth.position(range) += h * cloth.velocity(range);
+    }
+  }
+  if (springCoef != 0.0f) {
+    ScopedTimer timer(Profiler::Phase::XPBD_PROJECT);
+    for (int iteration = 0; iteration < xpbdIterations; ++iteration) {
+      for (size_t color = 0; color + 1 < colorOffsets.size(); ++color) {
+        const int first = colorOffsets[color];
+        const int count = colorOffsets[color + 1] - first;
+        if (isMultithreaded) {
+          // Springs of the same color never share a particle, so the result does not depend on the thread count.
+          ThreadPool::getPool().parallelFor(
+              count, [this, first](int begin, int end) { projectSprings(first + begin, first + end); },
+              parallelGrainSize);
+        } else {
+          projectSprings(first, first + count);
+        }
+      }
+    }
+  }
+  // v(n+1) = (x(n+1) - x(n)) / h
+  ScopedTimer timer(Profiler::Phase::INTEGRATOR_STAGES);
+  for (const Particles::Range &range : cloth.activeRanges()) {
+    auto previousPosition = _previousPosition.middleCols(range.begin, range.end - range.begin);
+    cloth.velocity(range) = (cloth.position(range) - previousPosition) / h;
+  }
+
+  for (auto &p : particles) {
+    if (p == &cloth) continue;
+    p->position() += deltaTime * p->velocity();
+    p->velocity() += deltaTime * p->acceleration();
+  }
+}
+
+void XPBD::projectSprings(int beginSlot, int endSlot) const {
+  using Column = Eigen::Map<Eigen::Vector4f, Eigen::Aligned16>;
+  using ConstColumn = Eigen::Map<const Eigen::Vector4f, Eigen::Aligned16>;
+  float *position = _cloth.particles().position().data();
+  const float *previousPosition = _previousPosition.data();
+  for (int slot = beginSlot; slot < endSlot; ++slot) {
+    Constraint &constraint = _constraints[slot];
+    Column start(position + 4 * constraint.start), end(position + 4 * constraint.end);
+    // w is 1 at both ends, so the 4D difference is the 3D one with a zero w
+    Eigen::Vector4f direction = start - end;
+    float length = direction.norm();
+    if (length == 0.0f) continue;
+    direction /= length;
+    // C = |xa - xb| - l, grad C = (n, -n); the damping term uses the displacement made in this step
+    Eigen::Vector4f displacement = (start - ConstColumn(previousPosition + 4 * constraint.start)) -
+                                   (end - ConstColumn(previousPosition + 4 * constraint.end));
+    float deltaLambda = (constraint.restLength - length - constraint.compliance * constraint.lambda -
+                         constraint.damping * direction.dot(displacement)) *
+                        constraint.inverseDenominator;
+    constraint.lambda += deltaLambda;
+    start += (_inverseMass[constraint.start] * deltaLambda) * direction;
+    end -= (_inverseMass[constraint.end] * deltaLambda) * direction;
+  }
 }
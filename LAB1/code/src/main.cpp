@@ -1,5 +1,8 @@
 #include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <memory>
@@ -24,8 +27,6 @@ int uboAlign(int i) { return ((i + 1 * (alignSize - 1)) / alignSize) * alignSize
 
 // Control the pin of each corner
 bool pin[4] = {true, true, true, true};
-int cornerIndices[4] = {0, particlesPerEdge - 1, particlesPerEdge*(particlesPerEdge - 1),
-                        particlesPerEdge* particlesPerEdge - 1};
 
 // Velocity of the sphere
 Eigen::Vector4f vel(0, 0, 0, 0);
@@ -94,7 +95,21 @@ void loadTexture(unsigned int& texture, const char* fileName) {
   stbi_image_free(data);
 }
 
-int main() {
+int main(int argc, char** argv) {
+  // Optional cloth resolution and particle layout: ./HW1 [particlesPerEdge] [--morton]
+  int clothResolution = defaultParticlesPerEdge;
+  Cloth::ParticleOrder particleOrder = Cloth::ParticleOrder::GRID;
+  for (int i = 1; i < argc; ++i) {
+    if (std::string(argv[i]) == "--morton") {
+      particleOrder = Cloth::ParticleOrder::MORTON;
+    } else {
+      clothResolution = std::atoi(argv[i]);
+    }
+  }
+  if (clothResolution < 3) {
+    std::cerr << "Usage: " << argv[0] << " [particlesPerEdge >= 3] [--morton]" << std::endl;
+    return EXIT_FAILURE;
+  }
   // Initialize OpenGL context.
   OpenGLContext& context = OpenGLContext::getContext();
   // TODO: change the title to your student ID
@@ -150,8 +165,8 @@ int main() {
   }
 
   // Create softbody
-  Cloth cloth;
-  cloth.computeNormal();
+  Cloth cloth(clothResolution, particleOrder);
+  cloth.computeNormal(cloth.particles().position(), 0);
   UniformBuffer meshUBO;
   int meshOffset = uboAlign(32 * sizeof(GLfloat));
   meshUBO.allocate(2 * meshOffset);
@@ -164,6 +179,9 @@ int main() {
   spheres.addSphere(Eigen::Vector4f(0, 0, 0, 1), 1.0f);
   meshUBO.load(meshOffset, 16 * sizeof(GLfloat), spheres.getModelMatrix().data());
   meshUBO.load(meshOffset + 16 * sizeof(GLfloat), 16 * sizeof(GLfloat), spheres.getNormalMatrix().data());
+  // The ground the sphere stands on, it is not drawn
+  Colliders colliders;
+  colliders.addPlane(Eigen::Vector4f(0, -1, 0, 1), Eigen::Vector4f(0, 1, 0, 0));
 
   Camera camera(Eigen::Vector4f(0, 2, -10, 1));
   UniformBuffer cameraUBO;
@@ -171,27 +189,125 @@ int main() {
   cameraUBO.load(0, 16 * sizeof(GLfloat), camera.viewProjectionMatrix().data());
   cameraUBO.load(16 * sizeof(GLfloat), 4 * sizeof(GLfloat), camera.position().data());
   cameraUBO.bindUniformBlockIndex(1, 0, uboAlign(20 * sizeof(GLfloat)));
-  // Do one step simulation, used in some implicit methods
-  std::function<void(void)> simulateOneStep = [&]() {
-    cloth.computeExternalForce();
-    cloth.computeSpringForce();
-    spheres.collide(&cloth);
-  };
-
   ExplicitEuler explicitEuler;
   ImplicitEuler implicitEuler;
   MidpointEuler midpointEuler;
   RungeKuttaFourth rk4;
+  BackwardEuler backwardEuler(cloth);
+  XPBD xpbd(cloth);
+  // Stands in for explicit euler's step when `isFused` is set
+  FusedEulerStep fusedStep(cloth);
   Integrator* integrator = &explicitEuler;
+  // Do one step simulation, used in some implicit methods
+  std::function<void(void)> simulateOneStep = [&]() {
+    {
+      ScopedTimer timer(Profiler::Phase::EXTERNAL_FORCE);
+      cloth.computeExternalForce();
+    }
+    // XPBD solves the springs as constraints instead
+    if (integrator->getType() != Integrator::Type::XPBD) {
+      ScopedTimer timer(Profiler::Phase::SPRING_FORCE);
+      cloth.computeSpringForce();
+    }
+    ScopedTimer timer(Profiler::Phase::COLLISION);
+    spheres.collide(&cloth);
+    if (isGroundColliding) colliders.collide(&cloth);
+    cloth.collide();
+  };
 
   std::vector<Particles*> particles{&cloth.particles(), &spheres.particles()};
+  // Same order as HW1Replay
+  std::vector<const Integrator*> integrators{&explicitEuler, &implicitEuler, &midpointEuler, &rk4, &backwardEuler, &xpbd};
   // Backup initial state
   Particles initialCloth = cloth.particles();
   Particles initialSpheres = spheres.particles();
+  // The controls only reach the particles through these inputs, applied by the simulation thread before its next step.
+  // That pins down the step each change takes effect at, so a recording of them replays bit for bit.
+  SimulationInputs pendingInputs = SimulationInputs::fromConfigs();
+  SimulationInputs appliedInputs = pendingInputs;
+  bool isInputPending = true;
+  // Steps taken since launch
+  std::uint64_t stepCount = 0;
+  InputRecorder recorder;
+  // The bake streams to disk, playback maps the file, neither keeps the frames in memory
+  PointCacheWriter bakeWriter;
+  PointCacheReader cacheReader;
+  std::string bakePath;
+  Eigen::Matrix4Xf cachePosition;
+  auto requestInputs = [&]() {
+    std::uint32_t resetCount = pendingInputs.resetCount;
+    pendingInputs = SimulationInputs::fromConfigs();
+    pendingInputs.resetCount = resetCount;
+    pendingInputs.pinnedCorners = 0;
+    for (int i = 0; i < 4; i++) pendingInputs.pinnedCorners |= pin[i] ? 1u << i : 0u;
+    pendingInputs.sphereVelocity = vel;
+    isInputPending = true;
+  };
+  auto checkpointHeader = [&]() {
+    return CheckpointHeader{cloth.particlesPerEdge(), static_cast<std::int32_t>(cloth.particleOrder()), stepCount,
+                            appliedInputs};
+  };
+  // Simulate one step and then integrate it, on the simulation thread.
+  SimulationThread simulation(
+      cloth, spheres,
+      [&]() {
+        if (isInputPending) {
+          isInputPending = false;
+          if (pendingInputs.resetCount != appliedInputs.resetCount) {
+            cloth.particles() = initialCloth;
+            spheres.particles() = initialSpheres;
+          }
+          // The controls are read every frame, only changes are recorded
+          if (pendingInputs != appliedInputs) recorder.record(stepCount, pendingInputs);
+          appliedInputs = pendingInputs;
+        }
+        // Every step, so sphere 0 keeps its velocity against the cloth's impulses the same way in a replay
+        appliedInputs.applyToScene(cloth, spheres);
+        if (FusedEulerStep::isApplicable(*integrator, cloth, spheres, isGroundColliding)) {
+          ScopedTimer timer(Profiler::Phase::FUSED_STEP);
+          fusedStep.step(spheres);
+        } else {
+          simulateOneStep();
+          // Includes the stages the integrator evaluates through simulateOneStep
+          ScopedTimer timer(Profiler::Phase::INTEGRATE);
+          integrator->integrate(particles, simulateOneStep);
+        }
+        {
+          ScopedTimer timer(Profiler::Phase::STRAIN_LIMIT);
+          cloth.limitStrain();
+        }
+        {
+          ScopedTimer timer(Profiler::Phase::SLEEP);
+          cloth.updateSleep();
+        }
+        ++stepCount;
+        return integrator->substepCount();
+      },
+      [&]() { return integrator->stepsPerFrame(); },
+      [&]() {
+        if (bakeWriter.isOpen()) bakeWriter.append(cloth.particles().getPositionData());
+      },
+      context.getRefreshRate());
 
   while (!glfwWindowShouldClose(window)) {
-    // Polling events.
-    glfwPollEvents();
+    {
+      // Key callbacks and the code below change what the steps read, keep the simulation between two steps.
+      auto controls = simulation.lockControls();
+      // Polling events.
+      glfwPollEvents();
+      // Check which integrator is selected in GUI.
+      switch (currentIntegrator) {
+        case 0: integrator = &explicitEuler; break;
+        case 1: integrator = &implicitEuler; break;
+        case 2: integrator = &midpointEuler; break;
+        case 3: integrator = &rk4; break;
+        case 4: integrator = &backwardEuler; break;
+        case 5: integrator = &xpbd; break;
+        default: break;
+      }
+      // Fix corners and set velocity of the sphere
+      requestInputs();
+    }
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     bool cameraChanged = mouseBinded ? camera.move(window) : false;
     if (isWindowSizeChanged) {
@@ -203,84 +319,146 @@ int main() {
       cameraUBO.load(0, 16 * sizeof(GLfloat), camera.viewProjectionMatrix().data());
       cameraUBO.load(16 * sizeof(GLfloat), 4 * sizeof(GLfloat), camera.position().data());
     }
-    // Check which integrator is selected in GUI.
-    switch (currentIntegrator) {
-      case 0: integrator = &explicitEuler; break;
-      case 1: integrator = &implicitEuler; break;
-      case 2: integrator = &midpointEuler; break;
-      case 3: integrator = &rk4; break;
-      default: break;
+    // Latest frame finished by the simulation thread, drawn without waiting for it
+    const SimulationThread::Snapshot& snapshot = simulation.latestSnapshot();
+    const Eigen::Matrix4Xf* clothPosition = &snapshot.clothPosition;
+    std::uint64_t clothFrame = snapshot.frame;
+    if (isPlayingCache && cacheReader.readFrame(static_cast<std::uint64_t>(cacheFrame), cachePosition)) {
+      clothPosition = &cachePosition;
+      // Keep the ids of cached frames apart from the snapshots' for the normal cache
+      clothFrame = std::uint64_t{1} << 63 | static_cast<std::uint64_t>(cacheFrame);
     }
-
-    // Fix corners
-    for (int i = 0; i < 4; i++) {
-      int idx = cornerIndices[i];
-      if (pin[i]) {
-        cloth.particles().mass(idx) = 0.0f;
-        cloth.particles().velocity(idx).setZero();
-        cloth.particles().acceleration(idx).setZero();
+    // One upload per simulated frame, shared by every draw mode below and skipped while the frame does not change
+    {
+      ScopedTimer timer(Profiler::Phase::UPLOAD);
+      cloth.upload(*clothPosition, clothFrame);
+      spheres.upload(snapshot.spherePosition, snapshot.frame);
+    }
+    if (isDrawingCloth) {
+      // This is very slow because it is done in CPU. Since GL4.1 doesn't support compute shader.
+      ScopedTimer timer(Profiler::Phase::NORMALS);
+      cloth.computeNormal(*clothPosition, clothFrame);
+    }
+    {
+      ScopedTimer timer(Profiler::Phase::DRAW);
+      particleRenderer.use();
+      meshUBO.bindUniformBlockIndex(0, 0, meshOffset);
+      if (isDrawingStructuralSprings) {
+        particleRenderer.setUniform("color", Eigen::Vector4f(0, 1, 1, 1));
+        cloth.draw(Cloth::DrawType::STRUCTURAL);
+      }
+      if (isDrawingShearSprings) {
+        particleRenderer.setUniform("color", Eigen::Vector4f(1, 0, 1, 1));
+        cloth.draw(Cloth::DrawType::SHEAR);
+      }
+      if (isDrawingBendSprings) {
+        particleRenderer.setUniform("color", Eigen::Vector4f(1, 1, 0, 1));
+        cloth.draw(Cloth::DrawType::BEND);
+      }
+      if (isDrawingCloth) {
+        glDisable(GL_CULL_FACE);
+        particleRenderer.setUniform("isSurface", 1);
+        particleRenderer.setUniform("useTexture", 1);
+        particleRenderer.setUniform("diffuseTexture", 0);
+        cloth.draw(Cloth::DrawType::FULL);
+        particleRenderer.setUniform("useTexture", 0);
+        glEnable(GL_CULL_FACE);
       } else {
-        cloth.particles().mass(idx) = 1.0f;
+        particleRenderer.setUniform("isSurface", 0);
+        particleRenderer.setUniform("color", Eigen::Vector4f(1, 0, 0, 1));
+        cloth.draw(Cloth::DrawType::PARTICLE);
       }
-    }
 
-    // Set velocity of the sphere
-    spheres.setVelocity(0, vel);
+      sphereRenderer.use();
+      if (isSphereColorChange) sphereRenderer.setUniform("color", sphereColor);
+      meshUBO.bindUniformBlockIndex(0, meshOffset, meshOffset);
+      spheres.draw();
+    }
 
-    if (!isPaused) {
-      // Stop -> Start: Restore initial state
-      if (isStateSwitched) {
-        cloth.particles() = initialCloth;
-        spheres.particles() = initialSpheres;
+    {
+      // The GUI edits the configs read by the steps
+      auto controls = simulation.lockControls();
+      substepsPerFrame = snapshot.substeps;
+      awakeParticles = cloth.awakeParticleCount();
+      Profiler& profiler = Profiler::getProfiler();
+      profiler.endFrame();
+      gui.render();
+      // Stop -> Start: Restore initial state before the simulation thread takes another step
+      if (!isPaused && isStateSwitched) ++pendingInputs.resetCount;
+      if (isCheckpointRequested) {
+        isCheckpointRequested = false;
+        std::string path = "checkpoint_" + std::to_string(stepCount) + ".hw1c";
+        std::ofstream file(path, std::ios::binary);
+        if (saveCheckpoint(file, checkpointHeader(), cloth, particles, integrators)) {
+          std::cout << "Saved " << path << std::endl;
+        } else {
+          std::cerr << "Cannot write " << path << std::endl;
+        }
       }
-      // Simulate one step and then integrate it.
-      for (int i = 0; i < simulationPerFrame; i++) {
-        simulateOneStep();
-        integrator->integrate(particles, simulateOneStep);
+      if (isRecording != recorder.isRecording()) {
+        if (isRecording) {
+          std::string path = "recording_" + std::to_string(stepCount) + ".hw1r";
+          isRecording = recorder.start(path, checkpointHeader(), cloth, particles, integrators);
+          if (isRecording) {
+            std::cout << "Recording to " << path << std::endl;
+          } else {
+            std::cerr << "Cannot write " << path << std::endl;
+          }
+        } else {
+          recorder.stop(stepCount);
+        }
       }
+      // Stop a bake whose writes fail, e.g. on a full disk
+      if (bakeWriter.hasFailed()) isBaking = false;
+      if (isBaking != bakeWriter.isOpen()) {
+        if (isBaking) {
+          // The new bake may overwrite the mapped one
+          cacheReader.close();
+          isPlayingCache = false;
+          cacheFrameCount = 0;
+          bakePath = "bake_" + std::to_string(stepCount) + ".hw1p";
+          isBaking = bakeWriter.open(bakePath, cloth.particles().getCapacity(), isCacheQuantized);
+          if (isBaking) {
+            std::cout << "Baking to " << bakePath << std::endl;
+          } else {
+            std::cerr << "Cannot write " << bakePath << std::endl;
+          }
+        } else {
+          if (!bakeWriter.close()) std::cerr << "Cannot write " << bakePath << std::endl;
+          // Scrub the bake that just finished
+          isPlayingCache = false;
+          cacheFrame = 0;
+          cacheFrameCount = cacheReader.open(bakePath) ? static_cast<int>(cacheReader.frameCount()) : 0;
+        }
+      }
+      if (isTracing != profiler.isTracing()) {
+        if (isTracing) {
+          profiler.startTrace();
+          std::cout << "Tracing from step " << stepCount << std::endl;
+        } else {
+          std::string path = "trace_" + std::to_string(stepCount) + ".json";
+          std::ofstream file(path);
+          if (profiler.writeTrace(file)) {
+            std::cout << "Saved " << path << std::endl;
+          } else {
+            std::cerr << "Cannot write " << path << std::endl;
+          }
+        }
+      }
+      cacheFrame = std::clamp(cacheFrame, 0, std::max(cacheFrameCount - 1, 0));
+      requestInputs();
     }
-
-    particleRenderer.use();
-    meshUBO.bindUniformBlockIndex(0, 0, meshOffset);
-    if (isDrawingStructuralSprings) {
-      particleRenderer.setUniform("color", Eigen::Vector4f(0, 1, 1, 1));
-      cloth.draw(Cloth::DrawType::STRUCTURAL);
-    }
-    if (isDrawingShearSprings) {
-      particleRenderer.setUniform("color", Eigen::Vector4f(1, 0, 1, 1));
-      cloth.draw(Cloth::DrawType::SHEAR);
-    }
-    if (isDrawingBendSprings) {
-      particleRenderer.setUniform("color", Eigen::Vector4f(1, 1, 0, 1));
-      cloth.draw(Cloth::DrawType::BEND);
-    }
-    if (isDrawingCloth) {
-      glDisable(GL_CULL_FACE);
-      // This is very slow because it is done in CPU. Since GL4.1 doesn't support compute shader.
-      cloth.computeNormal();
-      particleRenderer.setUniform("isSurface", 1);
-      particleRenderer.setUniform("useTexture", 1);
-      particleRenderer.setUniform("diffuseTexture", 0);
-      cloth.draw(Cloth::DrawType::FULL);
-      particleRenderer.setUniform("useTexture", 0);
-      glEnable(GL_CULL_FACE);
-    } else {
-      particleRenderer.setUniform("isSurface", 0);
-      particleRenderer.setUniform("color", Eigen::Vector4f(1, 0, 0, 1));
-      cloth.draw(Cloth::DrawType::PARTICLE);
-    }
-
-    sphereRenderer.use();
-    if (isSphereColorChange) sphereRenderer.setUniform("color", sphereColor);
-    meshUBO.bindUniformBlockIndex(0, meshOffset, meshOffset);
-    spheres.draw();
-
-    gui.render();
 #ifdef __APPLE__
     glFlush();
 #endif
     glfwSwapBuffers(window);
   }
+  {
+    // Close a running recording with the length of the run
+    auto controls = simulation.lockControls();
+    recorder.stop(stepCount);
+    if (!bakeWriter.close()) std::cerr << "Cannot write " << bakePath << std::endl;
+  }
   glfwDestroyWindow(window);
   return 0;
 }
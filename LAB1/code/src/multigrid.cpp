@@ -0,0 +1,274 @@
+#include "multigrid.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "cloth.h"
+#include "configs.h"
+
+namespace {
+// One fine lattice line onto the coarse one: coarse node k sits on fine node min(2k, edge - 1), so both ends are kept.
+struct EdgeWeight {
+  int lower;
+  // Weight of coarse node lower + 1, lower gets the rest
+  float upperWeight;
+};
+
+int coarseEdge(int edge) { return edge / 2 + 1; }
+
+std::vector<EdgeWeight> edgeWeights(int edge) {
+  const int coarse = coarseEdge(edge);
+  auto finePosition = [edge](int k) { return std::min(2 * k, edge - 1); };
+  std::vector<EdgeWeight> weights(edge);
+  for (int f = 0; f < edge; ++f) {
+    // Last coarse node at or before f, the one on edge - 1 is closer than 2k when edge is even
+    int k = std::min(f / 2, coarse - 1);
+    if (k + 1 < coarse && finePosition(k + 1) <= f) ++k;
+    const int lower = finePosition(k);
+    weights[f].lower = k;
+    weights[f].upperWeight =
+        f == lower ? 0.0f : static_cast<float>(f - lower) / static_cast<float>(finePosition(k + 1) - lower);
+  }
+  return weights;
+}
+}  // namespace
+
+void ClothMultigrid::build(const Cloth& cloth, const SystemMatrix& system) {
+  _system = &system;
+  _levels.clear();
+  const int n = cloth.particlesPerEdge();
+  Level fine;
+  fine.edge = n;
+  fine.rows.resize(n * n);
+  fine.columns.resize(n * n);
+  for (int row = 0; row < n; ++row) {
+    for (int column = 0; column < n; ++column) {
+      fine.rows[cloth.particleIndex(row, column)] = row;
+      fine.columns[cloth.particleIndex(row, column)] = column;
+    }
+  }
+  _levels.emplace_back(std::move(fine));
+  // Always keep one coarse level, even a small cloth gets its direct solve
+  do {
+    const int edge = coarseEdge(_levels.back().edge);
+    Level level;
+    level.edge = edge;
+    level.rows.resize(edge * edge);
+    level.columns.resize(edge * edge);
+    for (int i = 0; i < edge * edge; ++i) {
+      level.rows[i] = i / edge;
+      level.columns[i] = i % edge;
+    }
+    _levels.emplace_back(std::move(level));
+  } while (_levels.back().edge > multigridCoarsestEdge);
+
+  for (size_t l = 0; l < _levels.size(); ++l) {
+    Level& level = _levels[l];
+    const int nodeCount = level.edge * level.edge;
+    level.inverseDiagonal.resize(nodeCount);
+    level.rhs.setZero(3 * nodeCount);
+    level.solution.setZero(3 * nodeCount);
+    level.residual.setZero(3 * nodeCount);
+    if (l + 1 == _levels.size()) break;
+    // Bilinear interpolation from the four surrounding coarse nodes, the ones with zero weight are padding
+    const std::vector<EdgeWeight> weights = edgeWeights(level.edge);
+    const int coarse = _levels[l + 1].edge;
+    level.parents.resize(4 * nodeCount);
+    for (int i = 0; i < nodeCount; ++i) {
+      const EdgeWeight& row = weights[level.rows[i]];
+      const EdgeWeight& column = weights[level.columns[i]];
+      const float rowWeights[2] = {1.0f - row.upperWeight, row.upperWeight};
+      const float columnWeights[2] = {1.0f - column.upperWeight, column.upperWeight};
+      for (int k = 0; k < 4; ++k) {
+        const int r = std::min(row.lower + k / 2, coarse - 1);
+        const int c = std::min(column.lower + k % 2, coarse - 1);
+        level.parents[4 * i + k] = Parent{r * coarse + c, rowWeights[k / 2] * columnWeights[k % 2]};
+      }
+    }
+  }
+
+  // Level 0 blocks follow the block rows of the system, whose 3 rows share their columns
+  Level& finest = _levels[0];
+  const int* columns = system.innerIndexPtr();
+  const int* outer = system.outerIndexPtr();
+  finest.blockStarts.resize(n * n + 1);
+  finest.blockColumns.clear();
+  finest.diagonalBlocks.resize(n * n);
+  for (int i = 0; i < n * n; ++i) {
+    finest.blockStarts[i] = static_cast<int>(finest.blockColumns.size());
+    for (int k = outer[3 * i]; k < outer[3 * i + 1]; k += 3) {
+      if (columns[k] / 3 == i) finest.diagonalBlocks[i] = static_cast<int>(finest.blockColumns.size());
+      finest.blockColumns.emplace_back(columns[k] / 3);
+    }
+  }
+  finest.blockStarts[n * n] = static_cast<int>(finest.blockColumns.size());
+  finest.blocks.resize(finest.blockColumns.size());
+  for (size_t l = 0; l + 1 < _levels.size(); ++l) buildGalerkin(static_cast<int>(l));
+
+  const int coarsestSize = 3 * _levels.back().edge * _levels.back().edge;
+  _coarsest.resize(coarsestSize, coarsestSize);
+  _coarsestFactor = Eigen::LLT<Eigen::MatrixXf>(coarsestSize);
+}
+
+void ClothMultigrid::buildGalerkin(int l) {
+  const Level& fine = _levels[l];
+  Level& coarse = _levels[l + 1];
+  // Block (i, j) adds w_ia * w_jb * A_ij to the coarse block (a, b) for each pair of parents
+  struct Contribution {
+    int row;
+    int column;
+    int block;
+    float weight;
+  };
+  std::vector<Contribution> contributions;
+  for (int i = 0; i < fine.edge * fine.edge; ++i) {
+    for (int k = fine.blockStarts[i]; k < fine.blockStarts[i + 1]; ++k) {
+      const int j = fine.blockColumns[k];
+      for (int a = 0; a < 4; ++a) {
+        const Parent& first = fine.parents[4 * i + a];
+        if (first.weight == 0.0f) continue;
+        for (int b = 0; b < 4; ++b) {
+          const Parent& second = fine.parents[4 * j + b];
+          if (second.weight == 0.0f) continue;
+          contributions.push_back(Contribution{first.node, second.node, k, first.weight * second.weight});
+        }
+      }
+    }
+  }
+  std::sort(contributions.begin(), contributions.end(), [](const Contribution& lhs, const Contribution& rhs) {
+    if (lhs.row != rhs.row) return lhs.row < rhs.row;
+    if (lhs.column != rhs.column) return lhs.column < rhs.column;
+    return lhs.block < rhs.block;
+  });
+
+  const int nodeCount = coarse.edge * coarse.edge;
+  coarse.blockStarts.assign(nodeCount + 1, 0);
+  coarse.blockColumns.clear();
+  coarse.diagonalBlocks.resize(nodeCount);
+  coarse.galerkinStarts.clear();
+  coarse.galerkinTerms.clear();
+  for (size_t c = 0; c < contributions.size(); ++c) {
+    const Contribution& contribution = contributions[c];
+    const bool isNewBlock = c == 0 || contribution.row != contributions[c - 1].row ||
+                            contribution.column != contributions[c - 1].column;
+    if (isNewBlock) {
+      if (contribution.row == contribution.column) {
+        coarse.diagonalBlocks[contribution.row] = static_cast<int>(coarse.blockColumns.size());
+      }
+      coarse.blockColumns.emplace_back(contribution.column);
+      coarse.galerkinStarts.emplace_back(static_cast<int>(coarse.galerkinTerms.size()));
+      ++coarse.blockStarts[contribution.row + 1];
+    } else if (contribution.block == contributions[c - 1].block) {
+      // Padding parents may repeat a pair, fold them into one term
+      coarse.galerkinTerms.back().weight += contribution.weight;
+      continue;
+    }
+    coarse.galerkinTerms.push_back(GalerkinTerm{contribution.block, contribution.weight});
+  }
+  coarse.galerkinStarts.emplace_back(static_cast<int>(coarse.galerkinTerms.size()));
+  for (int i = 0; i < nodeCount; ++i) coarse.blockStarts[i + 1] += coarse.blockStarts[i];
+  coarse.blocks.resize(coarse.blockColumns.size());
+}
+
+void ClothMultigrid::update() {
+  const SystemMatrix& system = *_system;
+  const float* values = system.valuePtr();
+  const int* outer = system.outerIndexPtr();
+  // Level 0: copy the blocks out of the block rows of the sparse matrix
+  Level& fine = _levels[0];
+  for (int i = 0; i < fine.edge * fine.edge; ++i) {
+    for (int k = fine.blockStarts[i]; k < fine.blockStarts[i + 1]; ++k) {
+      const int offset = 3 * (k - fine.blockStarts[i]);
+      Eigen::Matrix3f& block = fine.blocks[k];
+      for (int r = 0; r < 3; ++r) {
+        for (int c = 0; c < 3; ++c) block(r, c) = values[outer[3 * i + r] + offset + c];
+      }
+    }
+  }
+  for (size_t l = 0; l < _levels.size(); ++l) {
+    Level& level = _levels[l];
+    const int nodeCount = level.edge * level.edge;
+    for (int i = 0; i < nodeCount; ++i) level.inverseDiagonal[i] = level.blocks[level.diagonalBlocks[i]].inverse();
+    if (l + 1 == _levels.size()) break;
+    Level& coarse = _levels[l + 1];
+    for (size_t k = 0; k < coarse.blocks.size(); ++k) {
+      Eigen::Matrix3f sum = Eigen::Matrix3f::Zero();
+      for (int t = coarse.galerkinStarts[k]; t < coarse.galerkinStarts[k + 1]; ++t) {
+        sum += coarse.galerkinTerms[t].weight * level.blocks[coarse.galerkinTerms[t].block];
+      }
+      coarse.blocks[k] = sum;
+    }
+  }
+  // Dense copy of the coarsest operator
+  const Level& last = _levels.back();
+  _coarsest.setZero();
+  for (int i = 0; i < last.edge * last.edge; ++i) {
+    for (int k = last.blockStarts[i]; k < last.blockStarts[i + 1]; ++k) {
+      _coarsest.block<3, 3>(3 * i, 3 * last.blockColumns[k]) = last.blocks[k];
+    }
+  }
+  _coarsestFactor.compute(_coarsest);
+}
+
+void ClothMultigrid::computeResidual(int l) {
+  Level& level = _levels[l];
+  for (int i = 0; i < level.edge * level.edge; ++i) {
+    Eigen::Vector3f sum = level.rhs.segment<3>(3 * i);
+    for (int k = level.blockStarts[i]; k < level.blockStarts[i + 1]; ++k) {
+      sum -= level.blocks[k] * level.solution.segment<3>(3 * level.blockColumns[k]);
+    }
+    level.residual.segment<3>(3 * i) = sum;
+  }
+}
+
+void ClothMultigrid::smooth(int l, bool isZero) {
+  Level& level = _levels[l];
+  const int nodeCount = level.edge * level.edge;
+  if (isZero) {
+    for (int i = 0; i < nodeCount; ++i) {
+      level.solution.segment<3>(3 * i) =
+          multigridSmoothingWeight * (level.inverseDiagonal[i] * level.rhs.segment<3>(3 * i));
+    }
+    return;
+  }
+  computeResidual(l);
+  for (int i = 0; i < nodeCount; ++i) {
+    level.solution.segment<3>(3 * i) +=
+        multigridSmoothingWeight * (level.inverseDiagonal[i] * level.residual.segment<3>(3 * i));
+  }
+}
+
+void ClothMultigrid::cycle(int l) {
+  Level& level = _levels[l];
+  if (l + 1 == static_cast<int>(_levels.size())) {
+    level.solution = level.rhs;
+    _coarsestFactor.solveInPlace(level.solution);
+    return;
+  }
+  // The same number of sweeps before and after keeps the cycle symmetric
+  for (int sweep = 0; sweep < multigridSmoothingSweeps; ++sweep) smooth(l, sweep == 0);
+  computeResidual(l);
+  Level& coarse = _levels[l + 1];
+  coarse.rhs.setZero();
+  const int nodeCount = level.edge * level.edge;
+  for (int i = 0; i < nodeCount; ++i) {
+    for (int k = 0; k < 4; ++k) {
+      const Parent& parent = level.parents[4 * i + k];
+      coarse.rhs.segment<3>(3 * parent.node) += parent.weight * level.residual.segment<3>(3 * i);
+    }
+  }
+  cycle(l + 1);
+  for (int i = 0; i < nodeCount; ++i) {
+    for (int k = 0; k < 4; ++k) {
+      const Parent& parent = level.parents[4 * i + k];
+      level.solution.segment<3>(3 * i) += parent.weight * coarse.solution.segment<3>(3 * parent.node);
+    }
+  }
+  for (int sweep = 0; sweep < multigridSmoothingSweeps; ++sweep) smooth(l, false);
+}
+
+void ClothMultigrid::apply(const Eigen::VectorXf& residual, Eigen::VectorXf& correction) {
+  _levels[0].rhs = residual;
+  cycle(0);
+  correction = _levels[0].solution;
+}
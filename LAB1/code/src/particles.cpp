@@ -1,7 +1,12 @@
 #include "particles.h"
 
 Particles::Particles(int size, float mass_) noexcept :
-    _position(4, size), _velocity(4, size), _acceleration(4, size), _mass(size, mass_) {
+    _position(4, size),
+    _velocity(4, size),
+    _acceleration(4, size),
+    _mass(size, mass_),
+    _inverseMass(size, inverse(mass_)),
+    _activeRanges{{0, size}} {
   _position.setZero();
   _velocity.setZero();
   _acceleration.setZero();
@@ -18,4 +23,15 @@ void Particles::resize(int newSize) {
   _velocity.conservativeResize(Eigen::NoChange, newSize);
   _acceleration.conservativeResize(Eigen::NoChange, newSize);
   _mass.resize(newSize, 0.0f);
+  _inverseMass.resize(newSize, 0.0f);
+  _activeRanges.assign(1, Range{0, newSize});
+}
+
+std::size_t Particles::bytes() const {
+  return static_cast<std::size_t>(_position.size() + _velocity.size() + _acceleration.size()) * sizeof(float) +
+         (_mass.size() + _inverseMass.size()) * sizeof(float);
+}
+
+void Particles::setMass(const float* masses) {
+  for (int i = 0; i < getCapacity(); ++i) setMass(i, masses[i]);
 }
@@ -0,0 +1,253 @@
+#include "pointcache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "binaryio.h"
+#include "configs.h"
+
+namespace {
+constexpr char pointCacheMagic[4] = {'H', 'W', '1', 'P'};
+constexpr std::uint32_t formatVersion = 1;
+constexpr std::uint32_t quantizedFlag = 1;
+// Magic, version, particle count, flags, frame count
+constexpr std::size_t headerSize = 4 + 4 + 4 + 4 + 8;
+constexpr std::size_t frameCountOffset = headerSize - 8;
+constexpr float quantizedMax = 65535.0f;
+
+// Bytes per frame, quantized frames are padded so that every frame's box stays 4 byte aligned
+std::size_t frameSize(int particleCount, bool isQuantized) {
+  const std::size_t count = static_cast<std::size_t>(particleCount);
+  if (!isQuantized) return 3 * sizeof(float) * count;
+  const std::size_t size = 6 * sizeof(float) + 3 * sizeof(std::uint16_t) * count;
+  return (size + 3) & ~std::size_t{3};
+}
+}  // namespace
+
+bool PointCacheWriter::open(const std::filesystem::path& path, int particleCount, bool isQuantized) {
+  close();
+  _file.open(path, std::ios::binary | std::ios::trunc);
+  if (!_file) return false;
+  _particleCount = particleCount;
+  _isQuantized = isQuantized;
+  _frameSize = frameSize(particleCount, isQuantized);
+  _frameCount = 0;
+  _chunk.clear();
+  _chunk.reserve(_frameSize * pointCacheChunkFrames);
+  _pending.clear();
+  _pending.reserve(_frameSize * pointCacheChunkFrames);
+  _hasPending = false;
+  _isClosing = false;
+  _hasFailed.store(false, std::memory_order_relaxed);
+  writeBinary(_file, pointCacheMagic, 4);
+  writeBinary(_file, formatVersion);
+  writeBinary(_file, static_cast<std::uint32_t>(particleCount));
+  writeBinary(_file, isQuantized ? quantizedFlag : std::uint32_t{0});
+  // Filled in by close(), until then readers count the complete frames instead
+  writeBinary(_file, std::uint64_t{0});
+  if (!_file) {
+    _file.close();
+    return false;
+  }
+  _writer = std::thread(&PointCacheWriter::writeLoop, this);
+  return true;
+}
+
+void PointCacheWriter::append(const float* positions) {
+  if (!_file.is_open()) return;
+  const std::size_t offset = _chunk.size();
+  _chunk.resize(offset + _frameSize);
+  char* frame = _chunk.data() + offset;
+  if (!_isQuantized) {
+    float* xyz = reinterpret_cast<float*>(frame);
+    for (int i = 0; i < _particleCount; ++i) std::memcpy(xyz + 3 * i, positions + 4 * i, 3 * sizeof(float));
+  } else {
+    float lower[3] = {INFINITY, INFINITY, INFINITY};
+    float upper[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int i = 0; i < _particleCount; ++i) {
+      for (int axis = 0; axis < 3; ++axis) {
+        // A diverged cloth must not stretch the box to infinity
+        if (!std::isfinite(positions[4 * i + axis])) continue;
+        lower[axis] = std::min(lower[axis], positions[4 * i + axis]);
+        upper[axis] = std::max(upper[axis], positions[4 * i + axis]);
+      }
+    }
+    float extent[3];
+    float scale[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      if (lower[axis] > upper[axis]) lower[axis] = upper[axis] = 0.0f;
+      extent[axis] = std::max(upper[axis] - lower[axis], 0.0f);
+      // A flat axis encodes every particle as 0
+      scale[axis] = extent[axis] > 0.0f ? quantizedMax / extent[axis] : 0.0f;
+    }
+    std::memcpy(frame, lower, sizeof(lower));
+    std::memcpy(frame + sizeof(lower), extent, sizeof(extent));
+    std::uint16_t* quantized = reinterpret_cast<std::uint16_t*>(frame + sizeof(lower) + sizeof(extent));
+    for (int i = 0; i < _particleCount; ++i) {
+      for (int axis = 0; axis < 3; ++axis) {
+        float value = std::round((positions[4 * i + axis] - lower[axis]) * scale[axis]);
+        // NaN fails every comparison, it is stored as the box minimum instead of reaching the cast
+        value = value > 0.0f ? std::min(value, quantizedMax) : 0.0f;
+        quantized[3 * i + axis] = static_cast<std::uint16_t>(value);
+      }
+    }
+  }
+  ++_frameCount;
+  if (_chunk.size() >= _frameSize * pointCacheChunkFrames) flush();
+}
+
+void PointCacheWriter::flush() {
+  if (_chunk.empty()) return;
+  std::unique_lock<std::mutex> lock(_mutex);
+  _condition.wait(lock, [this]() { return !_hasPending; });
+  _chunk.swap(_pending);
+  _hasPending = true;
+  _condition.notify_all();
+}
+
+void PointCacheWriter::writeLoop() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  for (;;) {
+    _condition.wait(lock, [this]() { return _hasPending || _isClosing; });
+    if (!_hasPending) return;
+    // flush() leaves _pending and the file alone until _hasPending is cleared
+    lock.unlock();
+    if (!hasFailed()) {
+      writeBinary(_file, _pending.data(), _pending.size());
+      if (!_file) _hasFailed.store(true, std::memory_order_relaxed);
+    }
+    _pending.clear();
+    lock.lock();
+    _hasPending = false;
+    _condition.notify_all();
+  }
+}
+
+bool PointCacheWriter::close() {
+  if (!_file.is_open()) return true;
+  flush();
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _isClosing = true;
+  }
+  _condition.notify_all();
+  _writer.join();
+  if (!hasFailed()) {
+    _file.seekp(static_cast<std::streamoff>(frameCountOffset));
+    writeBinary(_file, _frameCount);
+  }
+  _file.close();
+  if (!_file) _hasFailed.store(true, std::memory_order_relaxed);
+  return !hasFailed();
+}
+
+bool PointCacheReader::open(const std::filesystem::path& path) {
+  close();
+#ifdef _WIN32
+  HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) return false;
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < static_cast<LONGLONG>(headerSize)) {
+    CloseHandle(file);
+    return false;
+  }
+  HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+  if (!view) {
+    if (mapping) CloseHandle(mapping);
+    CloseHandle(file);
+    return false;
+  }
+  _fileHandle = file;
+  _mappingHandle = mapping;
+  _size = static_cast<std::size_t>(fileSize.QuadPart);
+  _data = static_cast<const unsigned char*>(view);
+#else
+  int file = ::open(path.c_str(), O_RDONLY);
+  if (file < 0) return false;
+  struct stat status;
+  if (fstat(file, &status) != 0 || status.st_size < static_cast<off_t>(headerSize)) {
+    ::close(file);
+    return false;
+  }
+  void* view = mmap(nullptr, static_cast<std::size_t>(status.st_size), PROT_READ, MAP_SHARED, file, 0);
+  // The mapping stays valid without the descriptor
+  ::close(file);
+  if (view == MAP_FAILED) return false;
+  _size = static_cast<std::size_t>(status.st_size);
+  _data = static_cast<const unsigned char*>(view);
+#endif
+
+  std::uint32_t version = 0;
+  std::uint32_t particleCount = 0;
+  std::uint32_t flags = 0;
+  std::uint64_t frameCount = 0;
+  std::memcpy(&version, _data + 4, sizeof(version));
+  std::memcpy(&particleCount, _data + 8, sizeof(particleCount));
+  std::memcpy(&flags, _data + 12, sizeof(flags));
+  std::memcpy(&frameCount, _data + frameCountOffset, sizeof(frameCount));
+  if (std::memcmp(_data, pointCacheMagic, 4) != 0 || version != formatVersion || particleCount == 0) {
+    close();
+    return false;
+  }
+  _particleCount = static_cast<int>(particleCount);
+  _isQuantized = (flags & quantizedFlag) != 0;
+  _frameSize = frameSize(_particleCount, _isQuantized);
+  // An unfinished cache has no frame count yet, and a truncated one must not be read past its end
+  const std::uint64_t completeFrames = (_size - headerSize) / _frameSize;
+  _frameCount = frameCount == 0 ? completeFrames : std::min(frameCount, completeFrames);
+  return true;
+}
+
+void PointCacheReader::close() {
+  if (!_data) return;
+#ifdef _WIN32
+  UnmapViewOfFile(_data);
+  CloseHandle(static_cast<HANDLE>(_mappingHandle));
+  CloseHandle(static_cast<HANDLE>(_fileHandle));
+  _fileHandle = nullptr;
+  _mappingHandle = nullptr;
+#else
+  munmap(const_cast<unsigned char*>(_data), _size);
+#endif
+  _data = nullptr;
+  _size = 0;
+  _frameCount = 0;
+}
+
+bool PointCacheReader::readFrame(std::uint64_t frame, Eigen::Matrix4Xf& positions) const {
+  if (frame >= _frameCount) return false;
+  positions.resize(4, _particleCount);
+  const unsigned char* data = _data + headerSize + frame * _frameSize;
+  if (!_isQuantized) {
+    const float* xyz = reinterpret_cast<const float*>(data);
+    for (int i = 0; i < _particleCount; ++i) {
+      positions.col(i) << xyz[3 * i], xyz[3 * i + 1], xyz[3 * i + 2], 1.0f;
+    }
+    return true;
+  }
+  Eigen::Vector3f lower;
+  Eigen::Vector3f extent;
+  std::memcpy(lower.data(), data, 3 * sizeof(float));
+  std::memcpy(extent.data(), data + 3 * sizeof(float), 3 * sizeof(float));
+  const Eigen::Vector3f step = extent / quantizedMax;
+  const std::uint16_t* quantized = reinterpret_cast<const std::uint16_t*>(data + 6 * sizeof(float));
+  for (int i = 0; i < _particleCount; ++i) {
+    Eigen::Vector3f value(quantized[3 * i], quantized[3 * i + 1], quantized[3 * i + 2]);
+    positions.col(i).head<3>() = lower + value.cwiseProduct(step);
+    positions(3, i) = 1.0f;
+  }
+  return true;
+}
@@ -0,0 +1,99 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <numeric>
+#include <unordered_map>
+
+Profiler::Profiler() : _origin(Clock::now()) {}
+
+Profiler& Profiler::getProfiler() {
+  static Profiler profiler;
+  return profiler;
+}
+
+const char* Profiler::name(Phase phase) {
+  switch (phase) {
+    case Phase::EXTERNAL_FORCE: return "External force";
+    case Phase::SPRING_FORCE: return "Spring force";
+    case Phase::COLLISION: return "Collision";
+    case Phase::INTEGRATE: return "Integrate";
+    case Phase::INTEGRATOR_STAGES: return "Integrator stages";
+    case Phase::STEP_DOUBLING: return "Step doubling";
+    case Phase::ASSEMBLE: return "Assemble";
+    case Phase::MULTIGRID_UPDATE: return "Multigrid update";
+    case Phase::SOLVE: return "Solve";
+    case Phase::XPBD_PREDICT: return "XPBD predict";
+    case Phase::XPBD_PROJECT: return "XPBD project";
+    case Phase::FUSED_STEP: return "Fused step";
+    case Phase::STRAIN_LIMIT: return "Strain limit";
+    case Phase::SLEEP: return "Sleep";
+    case Phase::UPLOAD: return "Upload";
+    case Phase::NORMALS: return "Normals";
+    case Phase::DRAW: return "Draw";
+    default: return "Unknown";
+  }
+}
+
+void Profiler::add(Phase phase, Clock::time_point begin, Clock::time_point end) {
+  const std::int64_t duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+  _pending[static_cast<int>(phase)].fetch_add(duration, std::memory_order_relaxed);
+  if (!_isTracing.load(std::memory_order_relaxed)) return;
+  const std::int64_t start = std::chrono::duration_cast<std::chrono::nanoseconds>(begin - _origin).count();
+  std::lock_guard<std::mutex> lock(_traceMutex);
+  // The buffer was reserved by startTrace, never grow it from the timed threads
+  if (_events.size() < _events.capacity()) {
+    _events.push_back({phase, std::this_thread::get_id(), start, duration});
+  } else {
+    ++_droppedEvents;
+  }
+}
+
+void Profiler::endFrame() {
+  const int slot = _frame % profileHistoryFrames;
+  for (int i = 0; i < phaseCount; ++i) {
+    _history[i][slot] = static_cast<float>(_pending[i].exchange(0, std::memory_order_relaxed)) * 1e-6f;
+  }
+  ++_frame;
+}
+
+float Profiler::average(Phase phase) const {
+  const int count = std::min(_frame, profileHistoryFrames);
+  if (count == 0) return 0.0f;
+  const auto& history = _history[static_cast<int>(phase)];
+  return std::accumulate(history.begin(), history.begin() + count, 0.0f) / static_cast<float>(count);
+}
+
+void Profiler::startTrace() {
+  std::lock_guard<std::mutex> lock(_traceMutex);
+  _events.clear();
+  _events.reserve(profileTraceMaxEvents);
+  _droppedEvents = 0;
+  _isTracing.store(true, std::memory_order_relaxed);
+}
+
+bool Profiler::writeTrace(std::ostream& stream) {
+  _isTracing.store(false, std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lock(_traceMutex);
+  // Number the threads in order of their first event, the simulation thread usually comes first
+  std::unordered_map<std::thread::id, int> threads;
+  const std::ios::fmtflags flags = stream.flags();
+  const std::streamsize precision = stream.precision();
+  stream << std::fixed << std::setprecision(3);
+  stream << "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":" << _droppedEvents << "},\"traceEvents\":[";
+  bool isFirst = true;
+  for (const Event& event : _events) {
+    const int thread = threads.emplace(event.thread, static_cast<int>(threads.size())).first->second;
+    // Chrome traces count in microseconds
+    stream << (isFirst ? "\n" : ",\n") << "{\"name\":\"" << name(event.phase) << "\",\"cat\":\"hw1\",\"ph\":\"X\",\"ts\":"
+           << static_cast<double>(event.begin) * 1e-3 << ",\"dur\":" << static_cast<double>(event.duration) * 1e-3
+           << ",\"pid\":1,\"tid\":" << thread << '}';
+    isFirst = false;
+  }
+  stream << "\n]}\n";
+  stream.flags(flags);
+  stream.precision(precision);
+  _events.clear();
+  _events.shrink_to_fit();
+  return static_cast<bool>(stream);
+}
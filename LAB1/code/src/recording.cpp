@@ -0,0 +1,266 @@
+#include "recording.h"
+
+#include <cstring>
+
+#include "binaryio.h"
+#include "cloth.h"
+#include "configs.h"
+#include "integrator.h"
+#include "particles.h"
+#include "sphere.h"
+
+namespace {
+constexpr char checkpointMagic[4] = {'H', 'W', '1', 'C'};
+constexpr char recordingMagic[4] = {'H', 'W', '1', 'R'};
+constexpr std::uint32_t formatVersion = 4;
+// Record types of a recording
+constexpr std::uint8_t inputRecord = 0;
+constexpr std::uint8_t endRecord = 1;
+
+void writeMagic(std::ostream& stream, const char (&magic)[4]) {
+  writeBinary(stream, magic, 4);
+  writeBinary(stream, formatVersion);
+}
+
+bool readMagic(std::istream& stream, const char (&magic)[4]) {
+  char found[4] = {};
+  std::uint32_t version = 0;
+  readBinary(stream, found, 4);
+  readBinary(stream, version);
+  return stream && std::memcmp(found, magic, 4) == 0 && version == formatVersion;
+}
+
+bool readCheckpointHeader(std::istream& stream, CheckpointHeader& header) {
+  if (!readMagic(stream, checkpointMagic)) return false;
+  readBinary(stream, header.particlesPerEdge);
+  readBinary(stream, header.particleOrder);
+  readBinary(stream, header.step);
+  header.inputs.read(stream);
+  return static_cast<bool>(stream);
+}
+}  // namespace
+
+SimulationInputs SimulationInputs::fromConfigs() {
+  // The members share their names with the globals, hence the ::
+  SimulationInputs inputs;
+  inputs.flags = 0;
+  inputs.integrator = ::currentIntegrator;
+  if (::isMultithreaded) inputs.flags |= MULTITHREADED;
+  if (::isVectorized) inputs.flags |= VECTORIZED;
+  if (::isSelfColliding) inputs.flags |= SELF_COLLIDING;
+  if (::isAdaptive) inputs.flags |= ADAPTIVE;
+  if (::isSleeping) inputs.flags |= SLEEPING;
+  if (::isContinuousCollision) inputs.flags |= CONTINUOUS_COLLISION;
+  if (::isGroundColliding) inputs.flags |= GROUND_COLLIDING;
+  if (::isMultigrid) inputs.flags |= MULTIGRID;
+  if (::isFused) inputs.flags |= FUSED;
+  if (::isStrainLimiting) inputs.flags |= STRAIN_LIMITING;
+  inputs.simulationPerFrame = ::simulationPerFrame;
+  inputs.deltaTime = ::deltaTime;
+  inputs.springCoef = ::springCoef;
+  inputs.damperCoef = ::damperCoef;
+  inputs.springTypeScale = ::springTypeScale;
+  inputs.damperTypeScale = ::damperTypeScale;
+  inputs.maxStrain = ::maxStrain;
+  inputs.minDeltaTime = ::minDeltaTime;
+  inputs.maxDeltaTime = ::maxDeltaTime;
+  inputs.adaptiveTolerance = ::adaptiveTolerance;
+  return inputs;
+}
+
+void SimulationInputs::applyConfigs() const {
+  ::currentIntegrator = integrator;
+  ::isMultithreaded = (flags & MULTITHREADED) != 0;
+  ::isVectorized = (flags & VECTORIZED) != 0;
+  ::isSelfColliding = (flags & SELF_COLLIDING) != 0;
+  ::isAdaptive = (flags & ADAPTIVE) != 0;
+  ::isSleeping = (flags & SLEEPING) != 0;
+  ::isContinuousCollision = (flags & CONTINUOUS_COLLISION) != 0;
+  ::isGroundColliding = (flags & GROUND_COLLIDING) != 0;
+  ::isMultigrid = (flags & MULTIGRID) != 0;
+  ::isFused = (flags & FUSED) != 0;
+  ::isStrainLimiting = (flags & STRAIN_LIMITING) != 0;
+  ::simulationPerFrame = simulationPerFrame;
+  ::deltaTime = deltaTime;
+  ::springCoef = springCoef;
+  ::damperCoef = damperCoef;
+  ::springTypeScale = springTypeScale;
+  ::damperTypeScale = damperTypeScale;
+  ::maxStrain = maxStrain;
+  ::minDeltaTime = minDeltaTime;
+  ::maxDeltaTime = maxDeltaTime;
+  ::adaptiveTolerance = adaptiveTolerance;
+}
+
+void SimulationInputs::applyToScene(Cloth& cloth, Spheres& spheres) const {
+  for (int i = 0; i < 4; i++) {
+    int idx = cloth.cornerIndex(i);
+    if (pinnedCorners >> i & 1u) {
+      cloth.particles().setMass(idx, 0.0f);
+      cloth.particles().velocity(idx).setZero();
+      cloth.particles().acceleration(idx).setZero();
+    } else {
+      cloth.particles().setMass(idx, particleMass);
+    }
+  }
+  spheres.setVelocity(0, sphereVelocity);
+}
+
+void SimulationInputs::write(std::ostream& stream) const {
+  writeBinary(stream, resetCount);
+  writeBinary(stream, integrator);
+  writeBinary(stream, pinnedCorners);
+  writeBinary(stream, flags);
+  writeBinary(stream, simulationPerFrame);
+  writeBinary(stream, deltaTime);
+  writeBinary(stream, springCoef);
+  writeBinary(stream, damperCoef);
+  writeBinary(stream, springTypeScale.data(), 3);
+  writeBinary(stream, damperTypeScale.data(), 3);
+  writeBinary(stream, maxStrain);
+  writeBinary(stream, minDeltaTime);
+  writeBinary(stream, maxDeltaTime);
+  writeBinary(stream, adaptiveTolerance);
+  writeBinary(stream, sphereVelocity.data(), 4);
+}
+
+void SimulationInputs::read(std::istream& stream) {
+  readBinary(stream, resetCount);
+  readBinary(stream, integrator);
+  readBinary(stream, pinnedCorners);
+  readBinary(stream, flags);
+  readBinary(stream, simulationPerFrame);
+  readBinary(stream, deltaTime);
+  readBinary(stream, springCoef);
+  readBinary(stream, damperCoef);
+  readBinary(stream, springTypeScale.data(), 3);
+  readBinary(stream, damperTypeScale.data(), 3);
+  readBinary(stream, maxStrain);
+  readBinary(stream, minDeltaTime);
+  readBinary(stream, maxDeltaTime);
+  readBinary(stream, adaptiveTolerance);
+  readBinary(stream, sphereVelocity.data(), 4);
+}
+
+bool SimulationInputs::operator==(const SimulationInputs& other) const {
+  return resetCount == other.resetCount && integrator == other.integrator && pinnedCorners == other.pinnedCorners &&
+         flags == other.flags && simulationPerFrame == other.simulationPerFrame && deltaTime == other.deltaTime &&
+         springCoef == other.springCoef && damperCoef == other.damperCoef &&
+         springTypeScale == other.springTypeScale && damperTypeScale == other.damperTypeScale &&
+         maxStrain == other.maxStrain && minDeltaTime == other.minDeltaTime && maxDeltaTime == other.maxDeltaTime &&
+         adaptiveTolerance == other.adaptiveTolerance && sphereVelocity == other.sphereVelocity;
+}
+
+bool saveCheckpoint(std::ostream& stream,
+                    const CheckpointHeader& header,
+                    const Cloth& cloth,
+                    const std::vector<Particles*>& particles,
+                    const std::vector<const Integrator*>& integrators) {
+  writeMagic(stream, checkpointMagic);
+  writeBinary(stream, header.particlesPerEdge);
+  writeBinary(stream, header.particleOrder);
+  writeBinary(stream, header.step);
+  header.inputs.write(stream);
+  writeBinary(stream, static_cast<std::uint32_t>(particles.size()));
+  for (Particles* set : particles) {
+    const std::size_t count = set->getCapacity();
+    writeBinary(stream, static_cast<std::int32_t>(count));
+    writeBinary(stream, set->getPositionData(), 4 * count);
+    writeBinary(stream, set->getVelocityData(), 4 * count);
+    writeBinary(stream, set->getAccelerationData(), 4 * count);
+    writeBinary(stream, set->getMassData(), count);
+  }
+  cloth.saveState(stream);
+  writeBinary(stream, static_cast<std::uint32_t>(integrators.size()));
+  for (const Integrator* integrator : integrators) integrator->saveState(stream);
+  return static_cast<bool>(stream);
+}
+
+bool loadCheckpoint(std::istream& stream,
+                    CheckpointHeader& header,
+                    Cloth& cloth,
+                    const std::vector<Particles*>& particles,
+                    const std::vector<Integrator*>& integrators) {
+  if (!readCheckpointHeader(stream, header)) return false;
+  std::uint32_t setCount = 0;
+  readBinary(stream, setCount);
+  if (!stream || setCount != particles.size()) return false;
+  for (Particles* set : particles) {
+    std::int32_t count = 0;
+    readBinary(stream, count);
+    // The scene owns the layout (e.g. the cloth's springs), only matching sizes can be restored
+    if (!stream || count != set->getCapacity()) return false;
+    readBinary(stream, set->position().data(), 4 * static_cast<std::size_t>(count));
+    readBinary(stream, set->velocity().data(), 4 * static_cast<std::size_t>(count));
+    readBinary(stream, set->acceleration().data(), 4 * static_cast<std::size_t>(count));
+    // Goes through setMass so that the inverse masses follow
+    std::vector<float> mass(count);
+    readBinary(stream, mass.data(), count);
+    set->setMass(mass.data());
+  }
+  cloth.loadState(stream);
+  std::uint32_t integratorCount = 0;
+  readBinary(stream, integratorCount);
+  if (!stream || integratorCount != integrators.size()) return false;
+  for (Integrator* integrator : integrators) integrator->loadState(stream);
+  return static_cast<bool>(stream);
+}
+
+bool InputRecorder::start(const std::filesystem::path& path,
+                          const CheckpointHeader& header,
+                          const Cloth& cloth,
+                          const std::vector<Particles*>& particles,
+                          const std::vector<const Integrator*>& integrators) {
+  _file.open(path, std::ios::binary | std::ios::trunc);
+  if (!_file) return false;
+  writeMagic(_file, recordingMagic);
+  if (!saveCheckpoint(_file, header, cloth, particles, integrators)) {
+    _file.close();
+    return false;
+  }
+  return true;
+}
+
+void InputRecorder::record(std::uint64_t step, const SimulationInputs& inputs) {
+  if (!_file.is_open()) return;
+  writeBinary(_file, inputRecord);
+  writeBinary(_file, step);
+  inputs.write(_file);
+}
+
+void InputRecorder::stop(std::uint64_t step) {
+  if (!_file.is_open()) return;
+  writeBinary(_file, endRecord);
+  writeBinary(_file, step);
+  _file.close();
+}
+
+bool InputReplay::open(const std::filesystem::path& path, CheckpointHeader& header) {
+  _file.open(path, std::ios::binary);
+  if (!_file || !readMagic(_file, recordingMagic)) return false;
+  _start = _file.tellg();
+  if (!readCheckpointHeader(_file, header)) return false;
+  _file.seekg(_start);
+  return static_cast<bool>(_file);
+}
+
+bool InputReplay::loadStart(CheckpointHeader& header,
+                            Cloth& cloth,
+                            const std::vector<Particles*>& particles,
+                            const std::vector<Integrator*>& integrators) {
+  _file.clear();
+  _file.seekg(_start);
+  return loadCheckpoint(_file, header, cloth, particles, integrators);
+}
+
+bool InputReplay::next(std::uint64_t& step, SimulationInputs& inputs) {
+  std::uint8_t type = endRecord;
+  std::uint64_t recordStep = 0;
+  readBinary(_file, type);
+  readBinary(_file, recordStep);
+  if (!_file) return false;
+  step = recordStep;
+  if (type != inputRecord) return false;
+  inputs.read(_file);
+  return static_cast<bool>(_file);
+}
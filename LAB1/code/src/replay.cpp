@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "cloth.h"
+#include "collider.h"
+#include "configs.h"
+#include "fusedstep.h"
+#include "integrator.h"
+#include "pointcache.h"
+#include "recording.h"
+#include "sphere.h"
+
+namespace {
+struct Options {
+  std::string recording;
+  // Stop after this many steps instead of at the end of the recording
+  std::uint64_t until = ~std::uint64_t{0};
+  std::uint64_t saveAt = ~std::uint64_t{0};
+  std::string savePath;
+  std::string resumePath;
+  // Point cache of the replayed cloth, one frame per `simulationPerFrame` steps
+  std::string bakePath;
+  bool isBakeQuantized = true;
+};
+
+void printUsage(const char* program) {
+  std::cerr << "Usage: " << program << " RECORDING.hw1r [--until STEP] [--save-at STEP CHECKPOINT.hw1c]"
+            << " [--resume CHECKPOINT.hw1c] [--bake CACHE.hw1p] [--bake-float]" << std::endl;
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--until") == 0 && i + 1 < argc) {
+      options.until = std::strtoull(argv[++i], nullptr, 10);
+    } else if (std::strcmp(argv[i], "--save-at") == 0 && i + 2 < argc) {
+      options.saveAt = std::strtoull(argv[++i], nullptr, 10);
+      options.savePath = argv[++i];
+    } else if (std::strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+      options.resumePath = argv[++i];
+    } else if (std::strcmp(argv[i], "--bake") == 0 && i + 1 < argc) {
+      options.bakePath = argv[++i];
+    } else if (std::strcmp(argv[i], "--bake-float") == 0) {
+      options.isBakeQuantized = false;
+    } else if (argv[i][0] != '-' && options.recording.empty()) {
+      options.recording = argv[i];
+    } else {
+      return false;
+    }
+  }
+  return !options.recording.empty();
+}
+
+// FNV-1a over the bits of every position and velocity, equal checksums mean bit identical runs.
+std::uint64_t checksum(const std::vector<Particles*>& particles) {
+  std::uint64_t hash = 14695981039346656037ull;
+  auto add = [&hash](const float* data, std::size_t count) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    for (std::size_t i = 0; i < count * sizeof(float); ++i) hash = (hash ^ bytes[i]) * 1099511628211ull;
+  };
+  for (Particles* set : particles) {
+    add(set->getPositionData(), 4 * static_cast<std::size_t>(set->getCapacity()));
+    add(set->getVelocityData(), 4 * static_cast<std::size_t>(set->getCapacity()));
+  }
+  return hash;
+}
+}  // namespace
+
+// Replay a recording made by the viewer without a window, optionally saving or resuming from a checkpoint.
+int main(int argc, char** argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  InputReplay replay;
+  CheckpointHeader header;
+  if (!replay.open(options.recording, header)) {
+    std::cerr << "Not a recording: " << options.recording << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Same scene as HW1, the initial state is what a reset restores.
+  Cloth cloth(header.particlesPerEdge, static_cast<Cloth::ParticleOrder>(header.particleOrder));
+  Spheres& spheres = Spheres::initSpheres();
+  spheres.addSphere(Eigen::Vector4f(0, 0, 0, 1), 1.0f);
+  Colliders colliders;
+  colliders.addPlane(Eigen::Vector4f(0, -1, 0, 1), Eigen::Vector4f(0, 1, 0, 0));
+  Particles initialCloth = cloth.particles();
+  Particles initialSpheres = spheres.particles();
+  ExplicitEuler explicitEuler;
+  ImplicitEuler implicitEuler;
+  MidpointEuler midpointEuler;
+  RungeKuttaFourth rk4;
+  BackwardEuler backwardEuler(cloth);
+  XPBD xpbd(cloth);
+  FusedEulerStep fusedStep(cloth);
+  // Same order as the viewer, indexed by currentIntegrator
+  std::vector<Integrator*> integrators{&explicitEuler, &implicitEuler, &midpointEuler, &rk4, &backwardEuler, &xpbd};
+  std::vector<const Integrator*> savedIntegrators(integrators.begin(), integrators.end());
+  Integrator* integrator = integrators[0];
+  std::function<void(void)> simulateOneStep = [&]() {
+    cloth.computeExternalForce();
+    // XPBD solves the springs as constraints instead
+    if (integrator->getType() != Integrator::Type::XPBD) cloth.computeSpringForce();
+    spheres.collide(&cloth);
+    if (isGroundColliding) colliders.collide(&cloth);
+    cloth.collide();
+  };
+  std::vector<Particles*> particles{&cloth.particles(), &spheres.particles()};
+
+  if (!replay.loadStart(header, cloth, particles, integrators)) {
+    std::cerr << "Corrupt recording: " << options.recording << std::endl;
+    return EXIT_FAILURE;
+  }
+  const std::uint64_t recordingStart = header.step;
+  if (!options.resumePath.empty()) {
+    std::ifstream file(options.resumePath, std::ios::binary);
+    if (!loadCheckpoint(file, header, cloth, particles, integrators) || header.step < recordingStart) {
+      std::cerr << "Checkpoint does not belong to this recording: " << options.resumePath << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  SimulationInputs applied = header.inputs;
+  applied.applyConfigs();
+
+  // Records at the step we start from are applied before it, like in the viewer
+  std::uint64_t step = header.step;
+  std::uint64_t end = options.until;
+  std::uint64_t nextStep = step;
+  SimulationInputs next;
+  auto readNext = [&]() {
+    bool hasNext = replay.next(nextStep, next);
+    // The end record holds the length of the run, without one the run ends with the last record
+    if (!hasNext) end = std::min(end, nextStep);
+    return hasNext;
+  };
+  bool hasNext = readNext();
+  while (hasNext && nextStep < step) hasNext = readNext();
+
+  PointCacheWriter bakeWriter;
+  if (!options.bakePath.empty() &&
+      !bakeWriter.open(options.bakePath, cloth.particles().getCapacity(), options.isBakeQuantized)) {
+    std::cerr << "Cannot write " << options.bakePath << std::endl;
+    return EXIT_FAILURE;
+  }
+  // Steps since the last baked frame, a frame is as many steps as the viewer runs per display frame
+  int bakeSteps = 0;
+
+  for (;; ++step) {
+    if (step == options.saveAt) {
+      std::ofstream file(options.savePath, std::ios::binary);
+      CheckpointHeader saved{header.particlesPerEdge, header.particleOrder, step, applied};
+      if (!saveCheckpoint(file, saved, cloth, particles, savedIntegrators)) {
+        std::cerr << "Cannot write " << options.savePath << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    while (hasNext && nextStep == step) {
+      if (next.resetCount != applied.resetCount) {
+        cloth.particles() = initialCloth;
+        spheres.particles() = initialSpheres;
+      }
+      next.applyConfigs();
+      applied = next;
+      hasNext = readNext();
+    }
+    if (step >= end) break;
+    applied.applyToScene(cloth, spheres);
+    integrator = integrators[std::clamp(applied.integrator, 0, static_cast<int>(integrators.size()) - 1)];
+    if (FusedEulerStep::isApplicable(*integrator, cloth, spheres, isGroundColliding)) {
+      fusedStep.step(spheres);
+    } else {
+      simulateOneStep();
+      integrator->integrate(particles, simulateOneStep);
+    }
+    cloth.limitStrain();
+    cloth.updateSleep();
+    if (bakeWriter.isOpen() && ++bakeSteps >= integrator->stepsPerFrame()) {
+      bakeSteps = 0;
+      bakeWriter.append(cloth.particles().getPositionData());
+    }
+  }
+  if (!bakeWriter.close()) {
+    std::cerr << "Cannot write " << options.bakePath << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << "steps," << step << ",checksum," << std::hex << checksum(particles) << std::dec << std::endl;
+  return 0;
+}
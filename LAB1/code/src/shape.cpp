@@ -15,12 +15,14 @@ void Shape::setModelMatrix(const Eigen::Ref<const Eigen::Matrix4f>& _modelMatrix
 }
 
 void Shape::computeExternalForce() {
-  for (size_t i = 0; i < _particles.mass().size(); ++i) {
-    if (_particles.mass(i) == 0.0f) {
-      _particles.acceleration(i).setZero();
-    } else {
-      _particles.acceleration(i) = Eigen::Vector4f(0, -9.8f, 0, 0);
-      _particles.acceleration(i) -= _particles.velocity(i) * viscousCoef * _particles.inverseMass(i);
+  for (const Particles::Range& range : _particles.activeRanges()) {
+    for (int i = range.begin; i < range.end; ++i) {
+      if (_particles.mass(i) == 0.0f) {
+        _particles.acceleration(i).setZero();
+      } else {
+        _particles.acceleration(i) = Eigen::Vector4f(0, -gravityAcceleration, 0, 0);
+        _particles.acceleration(i) -= _particles.velocity(i) * viscousCoef * _particles.inverseMass(i);
+      }
     }
   }
 }
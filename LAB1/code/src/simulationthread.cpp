@@ -0,0 +1,82 @@
+#include "simulationthread.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "cloth.h"
+#include "configs.h"
+#include "sphere.h"
+
+SimulationThread::SimulationThread(Cloth& cloth, Spheres& spheres, std::function<int(void)> step,
+                                   std::function<int(void)> stepsPerFrame, std::function<void(void)> frameDone,
+                                   int frameRate) :
+    _cloth(cloth),
+    _spheres(spheres),
+    _step(std::move(step)),
+    _stepsPerFrame(std::move(stepsPerFrame)),
+    _frameDone(std::move(frameDone)),
+    _framePeriod(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(1.0 / std::max(1, frameRate)))),
+    _snapshots(Snapshot{cloth.particles().position(), spheres.particles().position(), 0, 0}) {
+  // Start last, every member above is used by the loop
+  _thread = std::thread(&SimulationThread::simulationLoop, this);
+}
+
+SimulationThread::~SimulationThread() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _isStopping = true;
+  }
+  _stopCondition.notify_one();
+  _thread.join();
+}
+
+std::unique_lock<std::mutex> SimulationThread::lockControls() {
+  _controlRequests.fetch_add(1, std::memory_order_acq_rel);
+  std::unique_lock<std::mutex> lock(_mutex);
+  _controlRequests.fetch_sub(1, std::memory_order_acq_rel);
+  return lock;
+}
+
+void SimulationThread::simulationLoop() {
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point nextBatch = Clock::now();
+  while (true) {
+    int steps = 0;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _stopCondition.wait_until(lock, nextBatch, [this] { return _isStopping; });
+      if (_isStopping) return;
+      steps = isPaused ? 0 : _stepsPerFrame();
+    }
+    bool isAdvanced = false;
+    int substeps = 0;
+    for (int i = 0; i < steps; ++i) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_isStopping || isPaused) break;
+        substeps += _step();
+        isAdvanced = true;
+      }
+      // std::mutex is not fair, step aside until a waiting render thread got the lock
+      while (_controlRequests.load(std::memory_order_acquire) != 0) std::this_thread::yield();
+    }
+    if (isAdvanced) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_frameDone) _frameDone();
+        capture(_snapshots.back(), substeps);
+      }
+      _snapshots.publish();
+    }
+    // When the steps take longer than a frame, run as fast as possible instead of trying to catch up
+    nextBatch = std::max(nextBatch + _framePeriod, Clock::now() - _framePeriod);
+  }
+}
+
+void SimulationThread::capture(Snapshot& snapshot, int substeps) {
+  snapshot.clothPosition = _cloth.particles().position();
+  snapshot.spherePosition = _spheres.particles().position();
+  snapshot.frame = ++_frame;
+  snapshot.substeps = substeps;
+}
@@ -0,0 +1,105 @@
+#include "spatialhash.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace {
+// Keeps cell coordinates representable, far away or NaN points end up in the outermost cells.
+constexpr float maxCellCoordinate = 1 << 24;
+
+int cellCoordinate(float value) {
+  float cell = std::floor(value);
+  if (!(cell > -maxCellCoordinate)) cell = -maxCellCoordinate;
+  if (!(cell < maxCellCoordinate)) cell = maxCellCoordinate;
+  return static_cast<int>(cell);
+}
+
+// Index of the lowest set bit, `bits` must not be 0. std::countr_zero needs C++20, the VS project builds C++17
+int lowestBit(std::uint64_t bits) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward64(&index, bits);
+  return static_cast<int>(index);
+#else
+  return __builtin_ctzll(bits);
+#endif
+}
+}  // namespace
+
+Eigen::Vector3i SpatialHash::cellOf(const Eigen::Vector4f& point) const {
+  return Eigen::Vector3i(cellCoordinate(point.x() * _inverseCellSize), cellCoordinate(point.y() * _inverseCellSize),
+                         cellCoordinate(point.z() * _inverseCellSize));
+}
+
+int SpatialHash::hashCell(const Eigen::Vector3i& cell) const {
+  // Large primes from "Optimized Spatial Hashing for Collision Detection of Deformable Objects" (Teschner et al.)
+  std::uint32_t hash = (static_cast<std::uint32_t>(cell.x()) * 73856093u) ^
+                       (static_cast<std::uint32_t>(cell.y()) * 19349663u) ^
+                       (static_cast<std::uint32_t>(cell.z()) * 83492791u);
+  return static_cast<int>(hash & static_cast<std::uint32_t>(_mask));
+}
+
+void SpatialHash::build(const Eigen::Ref<const Eigen::Matrix4Xf>& points, float cellSize) {
+  const int pointCount = static_cast<int>(points.cols());
+  _inverseCellSize = 1.0f / cellSize;
+  // About two buckets per point keeps the chains short
+  int bucketCount = 1;
+  while (bucketCount < 2 * pointCount) bucketCount <<= 1;
+  _mask = bucketCount - 1;
+
+  _bucketStart.assign(bucketCount + 1, 0);
+  _entries.resize(pointCount);
+  _pointBucket.resize(pointCount);
+  for (int i = 0; i < pointCount; ++i) {
+    _pointBucket[i] = hashCell(cellOf(points.col(i)));
+    ++_bucketStart[_pointBucket[i] + 1];
+  }
+  for (int bucket = 0; bucket < bucketCount; ++bucket) _bucketStart[bucket + 1] += _bucketStart[bucket];
+  // Scatter with _bucketStart as cursors, which leaves every cursor at the start of the next bucket
+  for (int i = 0; i < pointCount; ++i) _entries[_bucketStart[_pointBucket[i]]++] = i;
+  for (int bucket = bucketCount; bucket > 0; --bucket) _bucketStart[bucket] = _bucketStart[bucket - 1];
+  _bucketStart[0] = 0;
+}
+
+void SpatialHash::query(const Eigen::Vector4f& lower, const Eigen::Vector4f& upper, std::vector<int>& result) {
+  result.clear();
+  const int pointCount = static_cast<int>(_entries.size());
+  Eigen::Vector3i first = cellOf(lower);
+  Eigen::Vector3i last = cellOf(upper);
+  // Visiting more cells than there are points is slower than returning every point
+  Eigen::Vector3d extent = (last - first).cast<double>().array() + 1.0;
+  if (extent.minCoeff() <= 0.0) return;
+  if (extent.prod() > pointCount) {
+    result.resize(pointCount);
+    for (int i = 0; i < pointCount; ++i) result[i] = i;
+    return;
+  }
+  // Mark the points in a bitmap, reading it back sorts them and drops the duplicates from cells sharing a bucket
+  _marks.resize((pointCount + 63) / 64, 0);
+  int firstWord = static_cast<int>(_marks.size());
+  int lastWord = -1;
+  for (int x = first.x(); x <= last.x(); ++x) {
+    for (int y = first.y(); y <= last.y(); ++y) {
+      for (int z = first.z(); z <= last.z(); ++z) {
+        int bucket = hashCell(Eigen::Vector3i(x, y, z));
+        for (int entry = _bucketStart[bucket]; entry < _bucketStart[bucket + 1]; ++entry) {
+          int word = _entries[entry] >> 6;
+          _marks[word] |= std::uint64_t{1} << (_entries[entry] & 63);
+          firstWord = std::min(firstWord, word);
+          lastWord = std::max(lastWord, word);
+        }
+      }
+    }
+  }
+  for (int word = firstWord; word <= lastWord; ++word) {
+    for (std::uint64_t bits = _marks[word]; bits != 0; bits &= bits - 1) {
+      result.emplace_back(word * 64 + lowestBit(bits));
+    }
+    _marks[word] = 0;
+  }
+}
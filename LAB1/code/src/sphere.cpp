@@ -1,10 +1,13 @@
 #include "sphere.h"
 
 #include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
 
 #include "cloth.h"
 #include "configs.h"
 
+#ifndef HW1_HEADLESS
 namespace {
 void generateVertices(std::vector<GLfloat>& vertices, std::vector<GLuint>& indices) {
   // See http://www.songho.ca/opengl/gl_sphere.html#sphere if you don't know how to create a sphere.
@@ -47,6 +50,70 @@ void generateVertices(std::vector<GLfloat>& vertices, std::vector<GLuint>& indic
   }
 }
 }  // namespace
+#endif
+
+namespace {
+/**
+ * @brief Predict the contact of a sphere with a point moving relative to it in a straight line.
+ * Returns how much the point's approach speed along `normal` must drop so that it only reaches the surface at the end
+ * of `horizon`, 0 when it does not reach it within `horizon`. A point already inside stops approaching at once.
+ *
+ * @param position Position of the point relative to the center.
+ * @param velocity Velocity of the point relative to the sphere.
+ * @param radius Radius the point must stay out of.
+ * @param horizon Time covered by the prediction.
+ * @param normal Outward normal of the sphere at the contact.
+ */
+float sweptContact(const Eigen::Vector4f& position, const Eigen::Vector4f& velocity, float radius, float horizon,
+                   Eigen::Vector4f& normal) {
+  const float c = position.squaredNorm() - radius * radius;
+  float time = 0.0f;
+  if (c <= 0.0f) {
+    normal = position.normalized();
+  } else {
+    // First root of |position + t * velocity| = radius, there is none ahead unless the point approaches the center
+    const float b = position.dot(velocity);
+    // Even without the quadratic term it would not get there in time
+    if (b >= 0.0f || c > -2.0f * b * horizon) return 0.0f;
+    const float a = velocity.squaredNorm();
+    const float discriminant = b * b - a * c;
+    if (discriminant < 0.0f) return 0.0f;
+    time = (-b - std::sqrt(discriminant)) / a;
+    if (time > horizon) return 0.0f;
+    normal = (position + time * velocity) / radius;
+  }
+  const float speed = -velocity.dot(normal);
+  if (speed <= 0.0f) return 0.0f;
+  return speed * (1.0f - time / horizon);
+}
+
+/**
+ * @brief Parameter s in [0, 1] of the point a + s * edge closest to the segment from p to p + path.
+ * See Ericson, Real-Time Collision Detection, 5.1.9.
+ */
+float closestEdgeParameter(const Eigen::Vector4f& a, const Eigen::Vector4f& edge, const Eigen::Vector4f& p,
+                           const Eigen::Vector4f& path) {
+  constexpr float epsilon = 1e-12f;
+  const Eigen::Vector4f r = a - p;
+  const float edgeLength2 = edge.squaredNorm();
+  const float pathLength2 = path.squaredNorm();
+  if (edgeLength2 <= epsilon) return 0.0f;
+  const float c = edge.dot(r);
+  if (pathLength2 <= epsilon) return std::clamp(-c / edgeLength2, 0.0f, 1.0f);
+  const float b = edge.dot(path);
+  const float f = path.dot(r);
+  const float denominator = edgeLength2 * pathLength2 - b * b;
+  // Parallel segments pick an arbitrary point of the edge, then clamp it to the path
+  float s = denominator > epsilon ? std::clamp((b * f - c * pathLength2) / denominator, 0.0f, 1.0f) : 0.0f;
+  const float t = (b * s + f) / pathLength2;
+  if (t < 0.0f) {
+    s = std::clamp(-c / edgeLength2, 0.0f, 1.0f);
+  } else if (t > 1.0f) {
+    s = std::clamp((b - c) / edgeLength2, 0.0f, 1.0f);
+  }
+  return s;
+}
+}  // namespace
 
 Spheres& Spheres::initSpheres() {
   static Spheres spheres;
@@ -57,21 +124,26 @@ void Spheres::addSphere(const Eigen::Ref<const Eigen::Vector4f>& position, float
   if (sphereCount == _particles.getCapacity()) {
     _particles.resize(sphereCount * 2);
     _radius.resize(sphereCount * 2);
-    offsets.allocate(8 * sphereCount * sizeof(float));
+#ifndef HW1_HEADLESS
+    offsets.allocateRing(8 * sphereCount * sizeof(float));
     sizes.allocate(2 * sphereCount * sizeof(float));
+#endif
   }
   _radius[sphereCount] = size;
   _particles.position(sphereCount) = position;
   _particles.velocity(sphereCount).setZero();
   _particles.acceleration(sphereCount).setZero();
-  _particles.mass(sphereCount) = sphereDensity * size * size * size;
+  _particles.setMass(sphereCount, sphereDensity * size * size * size);
 
+#ifndef HW1_HEADLESS
   sizes.load(0, _radius.size() * sizeof(float), _radius.data());
+#endif
   ++sphereCount;
 }
 
 Spheres::Spheres() : Shape(1, 1), sphereCount(0), _radius(1, 0.0f) {
-  offsets.allocate(4 * sizeof(float));
+#ifndef HW1_HEADLESS
+  offsets.allocateRing(4 * sizeof(float));
   sizes.allocate(sizeof(float));
 
   std::vector<GLfloat> vertices;
@@ -91,9 +163,8 @@ Spheres::Spheres() : Shape(1, 1), sphereCount(0), _radius(1, 0.0f) {
   vao.enable(1);
   vao.setAttributePointer(1, 3, 6, 3);
   glVertexAttribDivisor(1, 0);
-  offsets.bind();
+  // The offsets are pointed at their current ring region in draw()
   vao.enable(2);
-  vao.setAttributePointer(2, 3, 4, 0);
   glVertexAttribDivisor(2, 1);
   sizes.bind();
   vao.enable(3);
@@ -103,48 +174,218 @@ Spheres::Spheres() : Shape(1, 1), sphereCount(0), _radius(1, 0.0f) {
   glBindVertexArray(0);
   glBindBuffer(GL_ARRAY_BUFFER, 0);
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+#endif
+}
+
+#ifndef HW1_HEADLESS
+void Spheres::upload(const Eigen::Matrix4Xf& positions, std::uint64_t frame) {
+  offsets.loadRing(frame, 4 * sphereCount * sizeof(GLfloat), positions.data());
 }
 
 void Spheres::draw() const {
   vao.bind();
-  offsets.load(0, 4 * sphereCount * sizeof(GLfloat), _particles.getPositionData());
+  offsets.bind();
+  vao.setAttributePointer(2, 3, 4, static_cast<int>(offsets.ringOffset() / sizeof(GLfloat)));
   GLsizei indexCount = static_cast<GLsizei>(ebo.size() / sizeof(GLuint));
   glDrawElementsInstanced(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, nullptr, sphereCount);
   glBindVertexArray(0);
 }
+#endif
 
 void Spheres::collide(Shape* shape) { shape->collide(this); }
 void Spheres::collide(Cloth* cloth) {
+  if (isContinuousCollision) {
+    collideSwept(cloth);
+  } else {
+    collideDiscrete(cloth);
+  }
+}
+
+void Spheres::collideDiscrete(Cloth* cloth) {
     constexpr float coefRestitution = 0.0f;
+    //increase radius led the cloth not pentrate the sphere
+    constexpr float collisionMargin = sphereCollisionMargin;
     // TODO: Collide with particle (Simple approach to handle softbody collision)
     //   1. Detect collision.
     //   2. If collided, update impulse directly to particles' velocity
     // Note:
     //   1. There are `sphereCount` spheres (sphereCount is 1 in the default scene).
-    //   2. There are `particlesPerEdge * particlesPerEdge` particles.
+    //   2. There are `cloth->particles().getCapacity()` particles.
     //   3. See TODOs in Cloth::computeSpringForce if you don't know how to access data.
-    for (int i = 0; i < sphereCount; i++) {
-        for (int j = 0; j < particlesPerEdge * particlesPerEdge; j++) {
+    Particles& clothParticles = cloth->particles();
+    auto collideParticle = [&](int i, int j) {
         // ditectcollide
-        Eigen::Vector4f nor = _particles.position(i) - cloth->particles().position(j);
+        Eigen::Vector4f nor = _particles.position(i) - clothParticles.position(j);
         float shpclodis = nor.norm();
-        //increase radius led the cloth not pentrate the sphere
-        if (_radius[i]+0.01 < shpclodis) {
-            continue;//no collide
-            }
+        if (_radius[i] + collisionMargin < shpclodis) {
+            return;//no collide
+        }
         nor.normalize();
-        Eigen::Vector4f relavel = _particles.velocity(i) - cloth->particles().velocity(j);
+        Eigen::Vector4f relavel = _particles.velocity(i) - clothParticles.velocity(j);
         Eigen::Vector4f normalvel = nor * relavel.dot(nor);
         //if two get close
         if (relavel.dot(nor) < 0) {
             float invermsph = _particles.inverseMass(i);
-            float inversmclo = cloth->particles().inverseMass(j);
+            float inversmclo = clothParticles.inverseMass(j);
             Eigen::Vector4f impulse = -(1+coefRestitution) * normalvel/(invermsph+inversmclo);
             _particles.velocity(i) += impulse * invermsph;
-            cloth->particles().velocity(j) -= impulse * inversmclo;
+            clothParticles.velocity(j) -= impulse * inversmclo;
+            cloth->disturb(j);
         }
+    };
+    if (sphereCount < broadPhaseMinSpheres) {
+        for (int i = 0; i < sphereCount; i++) {
+            for (int j = 0; j < clothParticles.getCapacity(); j++) collideParticle(i, j);
         }
+        return;
+    }
+    // Broad phase: hash the cloth with cells as large as an average sphere, then each sphere only tests the
+    // particles in the cells overlapped by its bounding box. The candidates come sorted, so the impulses are
+    // applied in the same order as the double loop.
+    float averageRadius = 0.0f;
+    for (int i = 0; i < sphereCount; i++) averageRadius += _radius[i];
+    averageRadius /= sphereCount;
+    _clothHash.build(clothParticles.position(), 2.0f * (averageRadius + collisionMargin));
+    for (int i = 0; i < sphereCount; i++) {
+        Eigen::Vector4f extent = Eigen::Vector4f::Constant(_radius[i] + collisionMargin);
+        _clothHash.query(_particles.position(i) - extent, _particles.position(i) + extent, _candidates);
+        for (int j : _candidates) collideParticle(i, j);
+    }
+}
+
+void Spheres::collideSwept(Cloth* cloth) {
+  Particles& clothParticles = cloth->particles();
+  const std::vector<Spring>& springs = cloth->springs();
+  const std::vector<int>& adjacencyOffsets = cloth->adjacencyOffsets();
+  const std::vector<Cloth::AdjacentSpring>& adjacentSprings = cloth->adjacentSprings();
+  const int particleCount = clothParticles.getCapacity();
+  Eigen::Ref<Eigen::Matrix4Xf> positions = clothParticles.position();
+  Eigen::Ref<Eigen::Matrix4Xf> velocities = clothParticles.velocity();
+  // Adaptive substeps may be longer than deltaTime, predicting too far ahead only starts the contacts early
+  const float horizon = isAdaptive ? std::max(deltaTime, maxDeltaTime) : deltaTime;
+  // Every point of a triangle is within longestEdge / sqrt(3) of one of its corners, so only spheres smaller than that
+  // can slip between particles and need the edge contacts. Measuring the edges costs about as much as the particle
+  // contacts, it is skipped while every sphere is larger than triangles stretched to twice their rest size: a cloth
+  // stretched further is as good as torn.
+  float smallestRadius = INFINITY;
+  for (int i = 0; i < sphereCount; i++) smallestRadius = std::min(smallestRadius, _radius[i] + sphereCollisionMargin);
+  const float stretchedEdge = 2.0f * cloth->longestRestEdge();
+  const bool isEdgeMeasured = 3.0f * smallestRadius * smallestRadius < stretchedEdge * stretchedEdge;
+  const float longestEdge = isEdgeMeasured ? cloth->longestEdge() : 0.0f;
+  const bool isHashed = sphereCount >= broadPhaseMinSpheres;
+  // No particle is faster than clothSpeed, the largest velocity component bounds the speed within a factor sqrt(3).
+  // Raised whenever a contact speeds a particle up, so that the spheres after it still find it.
+  const Eigen::Map<const Eigen::ArrayXf> components(clothParticles.getVelocityData(), 4 * particleCount);
+  float clothSpeed = std::sqrt(3.0f) * components.abs().maxCoeff();
+  if (isHashed) {
+    float averageRadius = 0.0f;
+    for (int i = 0; i < sphereCount; i++) averageRadius += _radius[i];
+    averageRadius /= sphereCount;
+    _clothHash.build(positions, 2.0f * (averageRadius + sphereCollisionMargin));
+  }
+  _isCandidate.resize(particleCount, 0);
+  // Split an impulse along the normal between the sphere and a point of the cloth by their inverse masses
+  auto impulse = [](float speedChange, float sphereInverseMass, float clothInverseMass) {
+    const float inverseMass = sphereInverseMass + clothInverseMass;
+    return inverseMass > 0.0f ? speedChange / inverseMass : 0.0f;
+  };
+  for (int i = 0; i < sphereCount; i++) {
+    const float radius = _radius[i] + sphereCollisionMargin;
+    const float sphereInverseMass = _particles.inverseMass(i);
+    // Positions have w = 1 and velocities w = 0, the differences below have w = 0 as in collideDiscrete
+    const Eigen::Vector4f center = _particles.position(i);
+    // Written back once every contact of the sphere is handled
+    Eigen::Vector4f sphereVelocity = _particles.velocity(i);
+    Eigen::Vector4f normal;
+    // Particles farther from the center than this cannot reach the sphere within the horizon
+    auto contactReach2 = [&]() {
+      const float reach = radius + (sphereVelocity.norm() + clothSpeed) * horizon;
+      return reach * reach;
+    };
+    float particleReach2 = contactReach2();
+    auto collideParticle = [&](int j) {
+      const Eigen::Vector4f position = positions.col(j) - center;
+      if (position.squaredNorm() > particleReach2) return;
+      const Eigen::Vector4f velocity = velocities.col(j) - sphereVelocity;
+      const float speedChange = sweptContact(position, velocity, radius, horizon, normal);
+      if (speedChange == 0.0f) return;
+      const float clothInverseMass = clothParticles.inverseMass(j);
+      const float magnitude = impulse(speedChange, sphereInverseMass, clothInverseMass);
+      velocities.col(j) += magnitude * clothInverseMass * normal;
+      cloth->disturb(j);
+      sphereVelocity -= magnitude * sphereInverseMass * normal;
+      clothSpeed = std::max(clothSpeed, velocities.col(j).norm());
+      particleReach2 = contactReach2();
+    };
+    const bool isEdgeTested = 3.0f * radius * radius < longestEdge * longestEdge;
+    if (!isHashed && !isEdgeTested) {
+      // Nothing to gather, the reach test rejects a distant particle as fast as a box would
+      for (int j = 0; j < particleCount; j++) collideParticle(j);
+      _particles.velocity(i) = sphereVelocity;
+      continue;
     }
+    const Eigen::Vector4f end = center + sphereVelocity * horizon;
+    // Every point of an edge is within half its length of one of its ends
+    const float reach = radius + clothSpeed * horizon + (isEdgeTested ? 0.5f * longestEdge : 0.0f);
+    Eigen::Vector4f lower = Eigen::Vector4f::Zero();
+    Eigen::Vector4f upper = Eigen::Vector4f::Zero();
+    lower.head<3>() = center.cwiseMin(end).head<3>().array() - reach;
+    upper.head<3>() = center.cwiseMax(end).head<3>().array() + reach;
+    if (isHashed) {
+      _clothHash.query(lower, upper, _candidates);
+    } else {
+      _candidates.clear();
+      for (int j = 0; j < particleCount; j++) {
+        const Eigen::Vector4f position = positions.col(j);
+        if ((position.head<3>().array() >= lower.head<3>().array()).all() &&
+            (position.head<3>().array() <= upper.head<3>().array()).all()) {
+          _candidates.push_back(j);
+        }
+      }
+    }
+    for (int j : _candidates) {
+      _isCandidate[j] = 1;
+      collideParticle(j);
+    }
+    if (isEdgeTested) {
+      // Each edge is tested once, from its lower end when both ends are candidates
+      for (int j : _candidates) {
+        for (int k = adjacencyOffsets[j]; k < adjacencyOffsets[j + 1]; ++k) {
+          const Spring& spring = springs[adjacentSprings[k].spring];
+          if (spring.type() == Spring::Type::BEND) continue;
+          const int start = static_cast<int>(spring.startParticleIndex());
+          const int stop = static_cast<int>(spring.endParticleIndex());
+          const int other = start == j ? stop : start;
+          if (_isCandidate[other] && other < j) continue;
+          const Eigen::Vector4f startPosition = positions.col(start);
+          const Eigen::Vector4f edge = positions.col(stop) - startPosition;
+          const Eigen::Vector4f startVelocity = velocities.col(start);
+          const Eigen::Vector4f edgeVelocity = velocities.col(stop) - startVelocity;
+          // Path of the sphere relative to the middle of the edge, the ends are left to the particle contacts
+          const Eigen::Vector4f path = (sphereVelocity - startVelocity - 0.5f * edgeVelocity) * horizon;
+          const float s = closestEdgeParameter(startPosition, edge, center, path);
+          if (s <= 0.0f || s >= 1.0f) continue;
+          const Eigen::Vector4f position = startPosition + s * edge - center;
+          const Eigen::Vector4f velocity = startVelocity + s * edgeVelocity - sphereVelocity;
+          const float speedChange = sweptContact(position, velocity, radius, horizon, normal);
+          if (speedChange == 0.0f) continue;
+          // The point of the edge reacts like a particle with the ends' inverse masses weighted by s^2 and (1 - s)^2
+          const float startInverseMass = clothParticles.inverseMass(start);
+          const float stopInverseMass = clothParticles.inverseMass(stop);
+          const float clothInverseMass = (1.0f - s) * (1.0f - s) * startInverseMass + s * s * stopInverseMass;
+          const float magnitude = impulse(speedChange, sphereInverseMass, clothInverseMass);
+          velocities.col(start) += magnitude * (1.0f - s) * startInverseMass * normal;
+          velocities.col(stop) += magnitude * s * stopInverseMass * normal;
+          cloth->disturb(start);
+          cloth->disturb(stop);
+          sphereVelocity -= magnitude * sphereInverseMass * normal;
+          clothSpeed = std::max({clothSpeed, velocities.col(start).norm(), velocities.col(stop).norm()});
+        }
+      }
+    }
+    for (int j : _candidates) _isCandidate[j] = 0;
+    _particles.velocity(i) = sphereVelocity;
+  }
 }
 
 void Spheres::setVelocity(int i, const Eigen::Vector4f vel) { _particles.velocity(i) = vel; }
@@ -0,0 +1,413 @@
+#include "springkernel.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "configs.h"
+#include "threadpool.h"
+
+#if defined(__AVX512F__)
+#define SPRING_KERNEL_AVX512
+#include <immintrin.h>
+// MSVC does not define __FMA__, but /arch:AVX2 implies it.
+#elif defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+#define SPRING_KERNEL_AVX2
+#include <immintrin.h>
+// Same for __F16C__
+#if defined(__F16C__) || defined(_MSC_VER)
+#define SPRING_KERNEL_F16C
+#endif
+#endif
+
+namespace {
+// Thin wrappers around one SIMD register, so that a single kernel template serves every instruction set.
+struct ScalarLanes {
+  static constexpr int width = 1;
+  float v;
+  static ScalarLanes load(const float* p) { return {*p}; }
+  static ScalarLanes load(const Eigen::half* p) { return {static_cast<float>(*p)}; }
+  static ScalarLanes broadcast(float x) { return {x}; }
+  void store(float* p) const { *p = v; }
+  friend ScalarLanes operator+(ScalarLanes a, ScalarLanes b) { return {a.v + b.v}; }
+  friend ScalarLanes operator-(ScalarLanes a, ScalarLanes b) { return {a.v - b.v}; }
+  friend ScalarLanes operator*(ScalarLanes a, ScalarLanes b) { return {a.v * b.v}; }
+  // a * b + c
+  friend ScalarLanes fma(ScalarLanes a, ScalarLanes b, ScalarLanes c) { return {a.v * b.v + c.v}; }
+  friend ScalarLanes sqrt(ScalarLanes a) { return {std::sqrt(a.v)}; }
+  // 1 / a, or 0 when a is not positive
+  friend ScalarLanes safeInverse(ScalarLanes a) { return {(a.v > 0.0f) ? 1.0f / a.v : 0.0f}; }
+};
+
+#if defined(SPRING_KERNEL_AVX512)
+struct SimdLanes {
+  static constexpr int width = 16;
+  __m512 v;
+  static SimdLanes load(const float* p) { return {_mm512_loadu_ps(p)}; }
+  static SimdLanes load(const Eigen::half* p) {
+    return {_mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)))};
+  }
+  static SimdLanes broadcast(float x) { return {_mm512_set1_ps(x)}; }
+  void store(float* p) const { _mm512_storeu_ps(p, v); }
+  friend SimdLanes operator+(SimdLanes a, SimdLanes b) { return {_mm512_add_ps(a.v, b.v)}; }
+  friend SimdLanes operator-(SimdLanes a, SimdLanes b) { return {_mm512_sub_ps(a.v, b.v)}; }
+  friend SimdLanes operator*(SimdLanes a, SimdLanes b) { return {_mm512_mul_ps(a.v, b.v)}; }
+  friend SimdLanes fma(SimdLanes a, SimdLanes b, SimdLanes c) { return {_mm512_fmadd_ps(a.v, b.v, c.v)}; }
+  friend SimdLanes sqrt(SimdLanes a) { return {_mm512_sqrt_ps(a.v)}; }
+  friend SimdLanes safeInverse(SimdLanes a) {
+    __mmask16 isPositive = _mm512_cmp_ps_mask(a.v, _mm512_setzero_ps(), _CMP_GT_OQ);
+    return {_mm512_maskz_div_ps(isPositive, _mm512_set1_ps(1.0f), a.v)};
+  }
+};
+#elif defined(SPRING_KERNEL_AVX2)
+struct SimdLanes {
+  static constexpr int width = 8;
+  __m256 v;
+  static SimdLanes load(const float* p) { return {_mm256_loadu_ps(p)}; }
+  static SimdLanes load(const Eigen::half* p) {
+#if defined(SPRING_KERNEL_F16C)
+    return {_mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)))};
+#else
+    alignas(32) float values[width];
+    for (int i = 0; i < width; ++i) values[i] = static_cast<float>(p[i]);
+    return {_mm256_load_ps(values)};
+#endif
+  }
+  static SimdLanes broadcast(float x) { return {_mm256_set1_ps(x)}; }
+  void store(float* p) const { _mm256_storeu_ps(p, v); }
+  friend SimdLanes operator+(SimdLanes a, SimdLanes b) { return {_mm256_add_ps(a.v, b.v)}; }
+  friend SimdLanes operator-(SimdLanes a, SimdLanes b) { return {_mm256_sub_ps(a.v, b.v)}; }
+  friend SimdLanes operator*(SimdLanes a, SimdLanes b) { return {_mm256_mul_ps(a.v, b.v)}; }
+  friend SimdLanes fma(SimdLanes a, SimdLanes b, SimdLanes c) { return {_mm256_fmadd_ps(a.v, b.v, c.v)}; }
+  friend SimdLanes sqrt(SimdLanes a) { return {_mm256_sqrt_ps(a.v)}; }
+  friend SimdLanes safeInverse(SimdLanes a) {
+    __m256 isPositive = _mm256_cmp_ps(a.v, _mm256_setzero_ps(), _CMP_GT_OQ);
+    return {_mm256_and_ps(_mm256_div_ps(_mm256_set1_ps(1.0f), a.v), isPositive)};
+  }
+};
+#else
+using SimdLanes = ScalarLanes;
+#endif
+
+// Springs are evaluated in blocks, their forces staged here before being scattered to the particles.
+constexpr int blockSize = 256;
+// Gaps of at most this many springs between two runs are filled with springs of zero stiffness and damping.
+constexpr int maxBridgedGap = 4;
+
+// SoA rows the springs read, the velocity ones in float or half
+template <typename V>
+struct StateRows {
+  const float* x;
+  const float* y;
+  const float* z;
+  const V* vx;
+  const V* vy;
+  const V* vz;
+};
+
+/**
+ * Spring force of springs [i, count) of a block, as many as fit in whole registers. Returns the first spring not
+ * evaluated. `a` and `b` are the first start / end particle of the block, the forces go to 3 rows of `blockSize`.
+ */
+template <typename Lanes, typename V>
+int evaluateSprings(int i,
+                    int count,
+                    const StateRows<V>& state,
+                    int a,
+                    int b,
+                    const float* restLength,
+                    const float* stiffnessScale,
+                    const float* dampingScale,
+                    Lanes stiffness,
+                    Lanes damping,
+                    float* force) {
+  const auto [x, y, z, vx, vy, vz] = state;
+  for (; i + Lanes::width <= count; i += Lanes::width) {
+    const int ia = a + i;
+    const int ib = b + i;
+    Lanes dx = Lanes::load(x + ia) - Lanes::load(x + ib);
+    Lanes dy = Lanes::load(y + ia) - Lanes::load(y + ib);
+    Lanes dz = Lanes::load(z + ia) - Lanes::load(z + ib);
+    Lanes length = sqrt(fma(dx, dx, fma(dy, dy, dz * dz)));
+    Lanes relative = fma(Lanes::load(vx + ia) - Lanes::load(vx + ib), dx,
+                         fma(Lanes::load(vy + ia) - Lanes::load(vy + ib), dy,
+                             (Lanes::load(vz + ia) - Lanes::load(vz + ib)) * dz));
+    Lanes inverseLength = safeInverse(length);
+    // (k * (|d| - l) + kd * dv . d / |d|) / |d|, the direction is normalized by the same factor
+    Lanes magnitude = fma(stiffness * Lanes::load(stiffnessScale + i), length - Lanes::load(restLength + i),
+                          damping * Lanes::load(dampingScale + i) * relative * inverseLength);
+    magnitude = magnitude * inverseLength;
+    (dx * magnitude).store(force + i);
+    (dy * magnitude).store(force + blockSize + i);
+    (dz * magnitude).store(force + 2 * blockSize + i);
+  }
+  return i;
+}
+
+/**
+ * Add `sign` times the staged forces [i, count) to the particles starting at `p` of the 3 `force` rows. Returns the
+ * first one not added.
+ */
+template <typename Lanes>
+int scatterForce(int i, int count, const float* staged, float* const* force, int p, Lanes sign) {
+  for (; i + Lanes::width <= count; i += Lanes::width) {
+    for (int row = 0; row < 3; ++row) {
+      float* target = force[row] + p + i;
+      fma(sign, Lanes::load(staged + row * blockSize + i), Lanes::load(target)).store(target);
+    }
+  }
+  return i;
+}
+
+/**
+ * Spring force of the `count` springs of a block, in whole registers then one by one.
+ */
+template <typename V>
+void evaluateBlock(int count,
+                   const StateRows<V>& state,
+                   int a,
+                   int b,
+                   const float* restLength,
+                   const float* stiffnessScale,
+                   const float* dampingScale,
+                   float stiffness,
+                   float damping,
+                   float* force) {
+  int i = evaluateSprings(0, count, state, a, b, restLength, stiffnessScale, dampingScale,
+                          SimdLanes::broadcast(stiffness), SimdLanes::broadcast(damping), force);
+  evaluateSprings(i, count, state, a, b, restLength, stiffnessScale, dampingScale,
+                  ScalarLanes::broadcast(stiffness), ScalarLanes::broadcast(damping), force);
+}
+
+/**
+ * Subtract the staged forces of a block from its start particles and add them to its end particles.
+ */
+void scatterBlock(int count, const float* staged, float* const* force, int a, int b) {
+  // Start and end particles of a block overlap for short springs, so scatter them in separate passes.
+  int i = scatterForce(0, count, staged, force, a, SimdLanes::broadcast(-1.0f));
+  scatterForce(i, count, staged, force, a, ScalarLanes::broadcast(-1.0f));
+  i = scatterForce(0, count, staged, force, b, SimdLanes::broadcast(1.0f));
+  scatterForce(i, count, staged, force, b, ScalarLanes::broadcast(1.0f));
+}
+
+StateRows<float> stateRows(const SpringKernel::StateMatrix& state) {
+  return {state.row(0).data(), state.row(1).data(), state.row(2).data(),
+          state.row(3).data(), state.row(4).data(), state.row(5).data()};
+}
+}  // namespace
+
+void SpringKernel::assign(const std::vector<Spring>& springs) {
+  clearSprings(springs.size());
+  _tileRuns.clear();
+  for (size_t i = 0; i < springs.size(); ++i) _slots[i] = packSpring(springs[i], true);
+}
+
+void SpringKernel::clearSprings(size_t springCount) {
+  _restLength.clear();
+  _stiffnessScale.clear();
+  _dampingScale.clear();
+  _runs.clear();
+  _slots.resize(springCount);
+}
+
+void SpringKernel::setScales(const std::vector<float>& stiffness, const std::vector<float>& damping) {
+  for (size_t i = 0; i < _slots.size(); ++i) {
+    _stiffnessScale[_slots[i]] = stiffness[i];
+    _dampingScale[_slots[i]] = damping[i];
+  }
+}
+
+void SpringKernel::assignTiles(const std::vector<Spring>& springs, int particleCount, int tileSize) {
+  clearSprings(springs.size());
+  const int tileCount = (particleCount + tileSize - 1) / tileSize;
+  auto springTile = [tileSize](const Spring& spring) {
+    return static_cast<int>(std::max(spring.startParticleIndex(), spring.endParticleIndex())) / tileSize;
+  };
+  // Counting sort by tile, which keeps the order of the springs within a tile
+  std::vector<int> offsets(tileCount + 1, 0);
+  for (const Spring& spring : springs) ++offsets[springTile(spring) + 1];
+  for (int t = 0; t < tileCount; ++t) offsets[t + 1] += offsets[t];
+  std::vector<int> sorted(springs.size());
+  for (size_t i = 0; i < springs.size(); ++i) sorted[offsets[springTile(springs[i])]++] = static_cast<int>(i);
+  _tileRuns.assign(tileCount + 1, 0);
+  int next = 0;
+  for (int t = 0; t < tileCount; ++t) {
+    // A run never spans two tiles
+    bool canJoin = false;
+    for (; next < offsets[t]; ++next) {
+      _slots[sorted[next]] = packSpring(springs[sorted[next]], canJoin);
+      canJoin = true;
+    }
+    _tileRuns[t + 1] = static_cast<int>(_runs.size());
+  }
+  _state.resize(Eigen::NoChange, particleCount);
+  _force.resize(3, particleCount);
+}
+
+int SpringKernel::packSpring(const Spring& spring, bool canJoin) {
+  int start = static_cast<int>(spring.startParticleIndex());
+  int end = static_cast<int>(spring.endParticleIndex());
+  if (canJoin && !_runs.empty()) {
+    Run& last = _runs.back();
+    int gap = start - (last.startParticle + last.springCount);
+    if (gap >= 0 && gap <= maxBridgedGap && end - (last.endParticle + last.springCount) == gap) {
+      // e.g. the end of one grid row to the start of the next
+      _restLength.insert(_restLength.end(), gap, 0.0f);
+      _stiffnessScale.insert(_stiffnessScale.end(), gap, 0.0f);
+      _dampingScale.insert(_dampingScale.end(), gap, 0.0f);
+      last.springCount += gap + 1;
+      return appendSpring(spring);
+    }
+  }
+  _runs.push_back({static_cast<int>(_restLength.size()), 1, start, end});
+  return appendSpring(spring);
+}
+
+int SpringKernel::appendSpring(const Spring& spring) {
+  _restLength.emplace_back(spring.length());
+  _stiffnessScale.emplace_back(1.0f);
+  _dampingScale.emplace_back(1.0f);
+  return static_cast<int>(_restLength.size()) - 1;
+}
+
+const char* SpringKernel::name() {
+#if defined(SPRING_KERNEL_AVX512)
+  return "avx512";
+#elif defined(SPRING_KERNEL_AVX2)
+  return "avx2";
+#else
+  return "scalar";
+#endif
+}
+
+void SpringKernel::computeRuns(int beginSpring, int endSpring, float* force, float stiffness, float damping) const {
+  const int stride = static_cast<int>(_state.cols());
+  float* const forceRows[3] = {force, force + stride, force + 2 * stride};
+  computeRuns(stateRows(_state), beginSpring, endSpring, forceRows, stiffness, damping);
+}
+
+template <typename Rows>
+void SpringKernel::computeRuns(const Rows& state, int beginSpring, int endSpring, float* const* force, float stiffness,
+                               float damping) const {
+  alignas(64) float staged[3 * blockSize];
+  // First run that ends after beginSpring
+  auto run = std::upper_bound(_runs.begin(), _runs.end(), beginSpring,
+                              [](int spring, const Run& r) { return spring < r.firstSpring + r.springCount; });
+  for (; run != _runs.end() && run->firstSpring < endSpring; ++run) {
+    // Clip the run to [beginSpring, endSpring)
+    int skip = std::max(0, beginSpring - run->firstSpring);
+    int count = std::min(run->springCount, endSpring - run->firstSpring) - skip;
+    int a = run->startParticle + skip;
+    int b = run->endParticle + skip;
+    const int first = run->firstSpring + skip;
+    for (int block = 0; block < count; block += blockSize) {
+      int blockCount = std::min(blockSize, count - block);
+      evaluateBlock(blockCount, state, a + block, b + block, _restLength.data() + first + block,
+                    _stiffnessScale.data() + first + block, _dampingScale.data() + first + block, stiffness, damping,
+                    staged);
+      scatterBlock(blockCount, staged, force, a + block, b + block);
+    }
+  }
+}
+
+void SpringKernel::computeTile(int tile, float stiffness, float damping, const int* owner, int ownerBegin,
+                               int ownerEnd) {
+  const int stride = static_cast<int>(_state.cols());
+  float* force = _force.data();
+  float* const forceRows[3] = {force, force + stride, force + 2 * stride};
+  const StateRows<float> state = stateRows(_state);
+  alignas(64) float staged[3 * blockSize];
+  auto isOwned = [&](int i) { return ownerBegin <= owner[i] && owner[i] < ownerEnd; };
+  for (int r = _tileRuns[tile]; r < _tileRuns[tile + 1]; ++r) {
+    const Run& run = _runs[r];
+    for (int block = 0; block < run.springCount; block += blockSize) {
+      const int blockCount = std::min(blockSize, run.springCount - block);
+      const int a = run.startParticle + block;
+      const int b = run.endParticle + block;
+      const int first = run.firstSpring + block;
+      evaluateBlock(blockCount, state, a, b, _restLength.data() + first, _stiffnessScale.data() + first,
+                    _dampingScale.data() + first, stiffness, damping, staged);
+      if (owner == nullptr) {
+        scatterBlock(blockCount, staged, forceRows, a, b);
+        continue;
+      }
+      // Same passes and sums as scatterBlock, without the particles of other threads
+      for (int row = 0; row < 3; ++row) {
+        for (int i = 0; i < blockCount; ++i) {
+          if (isOwned(a + i)) force[row * stride + a + i] -= staged[row * blockSize + i];
+        }
+      }
+      for (int row = 0; row < 3; ++row) {
+        for (int i = 0; i < blockCount; ++i) {
+          if (isOwned(b + i)) force[row * stride + b + i] += staged[row * blockSize + i];
+        }
+      }
+    }
+  }
+}
+
+template <typename VelocityScalar>
+void SpringKernel::computeRows(const float* const* position, const VelocityScalar* const* velocity,
+                               float* const* force, float stiffness, float damping) const {
+  const StateRows<VelocityScalar> state{position[0], position[1], position[2], velocity[0], velocity[1], velocity[2]};
+  computeRuns(state, 0, static_cast<int>(_restLength.size()), force, stiffness, damping);
+}
+
+template void SpringKernel::computeRows(const float* const*, const float* const*, float* const*, float, float) const;
+template void SpringKernel::computeRows(const float* const*, const Eigen::half* const*, float* const*, float,
+                                        float) const;
+
+void SpringKernel::compute(Particles& particles, float stiffness, float damping, bool isParallel) {
+  ThreadPool& pool = ThreadPool::getPool();
+  const int particleCount = particles.getCapacity();
+  const int springCount = static_cast<int>(_restLength.size());
+  const int threadCount = (isParallel && springCount >= 2 * parallelGrainSize) ? pool.size() : 1;
+  _state.resize(Eigen::NoChange, particleCount);
+  _force.resize(3 * threadCount, particleCount);
+  auto load = [&](int begin, int end) { loadState(particles, 0, begin, end); };
+  auto store = [&](int begin, int end) { storeForce(particles, 0, threadCount, begin, end); };
+
+  if (threadCount == 1) {
+    load(0, particleCount);
+    computeRuns(0, springCount, _force.data(), stiffness, damping);
+    store(0, particleCount);
+    return;
+  }
+  pool.parallelFor(particleCount, load, parallelGrainSize);
+  pool.parallelFor(
+      threadCount,
+      [&](int begin, int end) {
+        for (int t = begin; t < end; ++t) {
+          int beginSpring = static_cast<int>(static_cast<long long>(springCount) * t / threadCount);
+          int endSpring = static_cast<int>(static_cast<long long>(springCount) * (t + 1) / threadCount);
+          computeRuns(beginSpring, endSpring, _force.row(3 * t).data(), stiffness, damping);
+        }
+      },
+      1);
+  pool.parallelFor(particleCount, store, parallelGrainSize);
+}
+
+void SpringKernel::compute(Particles& particles, int firstParticle, int particleCount, float stiffness, float damping) {
+  _state.resize(Eigen::NoChange, particleCount);
+  _force.resize(3, particleCount);
+  loadState(particles, firstParticle, 0, particleCount);
+  computeRuns(0, static_cast<int>(_restLength.size()), _force.data(), stiffness, damping);
+  storeForce(particles, firstParticle, 1, 0, particleCount);
+}
+
+void SpringKernel::loadState(Particles& particles, int firstParticle, int begin, int end) {
+  // Copy the particles into SoA rows and clear the accumulators
+  int count = end - begin;
+  _state.block(0, begin, 3, count) = particles.position().block(0, firstParticle + begin, 3, count);
+  _state.block(3, begin, 3, count) = particles.velocity().block(0, firstParticle + begin, 3, count);
+  _state.row(6).segment(begin, count) =
+      Eigen::Map<const Eigen::RowVectorXf>(particles.getInverseMassData() + firstParticle + begin, count);
+  _force.middleCols(begin, count).setZero();
+}
+
+void SpringKernel::storeForce(Particles& particles, int firstParticle, int threadCount, int begin, int end) {
+  // Sum every thread's forces and turn them into acceleration
+  int count = end - begin;
+  for (int t = 1; t < threadCount; ++t) _force.block(0, begin, 3, count) += _force.block(3 * t, begin, 3, count);
+  particles.acceleration().block(0, firstParticle + begin, 3, count) +=
+      (_force.block(0, begin, 3, count).array().rowwise() * _state.row(6).segment(begin, count).array()).matrix();
+}
@@ -0,0 +1,133 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "clothbatch.h"
+#include "configs.h"
+#include "threadpool.h"
+
+namespace {
+struct Options {
+  int steps = 5000;
+  float deltaTime = 0.0f;
+  int resolution = defaultParticlesPerEdge;
+  std::vector<float> springCoefs{springCoef};
+  std::vector<float> damperCoefs{damperCoef};
+  std::vector<float> viscousCoefs{viscousCoef};
+  Eigen::Vector3f springTypeScale = Eigen::Vector3f::Ones();
+  Eigen::Vector3f damperTypeScale = Eigen::Vector3f::Ones();
+  bool isMultithreaded = false;
+  bool isVectorized = true;
+  bool isPinned = true;
+};
+
+void printUsage(const char* program) {
+  std::cerr << "Usage: " << program
+            << " [--steps N] [--delta-time H] [--resolution N] [--spring K[,K...]] [--damper D[,D...]]"
+               " [--viscous V[,V...]] [--spring-types S,S,S] [--damper-types S,S,S] [--multithread] [--no-simd]"
+               " [--no-pins]"
+            << std::endl;
+}
+
+bool parseValues(const char* argument, std::vector<float>& values) {
+  values.clear();
+  std::stringstream stream(argument);
+  std::string token;
+  while (std::getline(stream, token, ',')) {
+    float value = static_cast<float>(std::atof(token.c_str()));
+    if (value < 0.0f) return false;
+    values.emplace_back(value);
+  }
+  return !values.empty();
+}
+
+bool parseScales(const char* argument, Eigen::Vector3f& scales) {
+  std::stringstream stream(argument);
+  std::string token;
+  for (int i = 0; i < 3; ++i) {
+    if (!std::getline(stream, token, ',')) return false;
+    scales[i] = static_cast<float>(std::atof(token.c_str()));
+    if (scales[i] < 0.0f) return false;
+  }
+  return !std::getline(stream, token, ',');
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+      options.steps = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--delta-time") == 0 && i + 1 < argc) {
+      options.deltaTime = static_cast<float>(std::atof(argv[++i]));
+    } else if (std::strcmp(argv[i], "--resolution") == 0 && i + 1 < argc) {
+      options.resolution = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--spring") == 0 && i + 1 < argc) {
+      if (!parseValues(argv[++i], options.springCoefs)) return false;
+    } else if (std::strcmp(argv[i], "--damper") == 0 && i + 1 < argc) {
+      if (!parseValues(argv[++i], options.damperCoefs)) return false;
+    } else if (std::strcmp(argv[i], "--viscous") == 0 && i + 1 < argc) {
+      if (!parseValues(argv[++i], options.viscousCoefs)) return false;
+    } else if (std::strcmp(argv[i], "--spring-types") == 0 && i + 1 < argc) {
+      if (!parseScales(argv[++i], options.springTypeScale)) return false;
+    } else if (std::strcmp(argv[i], "--damper-types") == 0 && i + 1 < argc) {
+      if (!parseScales(argv[++i], options.damperTypeScale)) return false;
+    } else if (std::strcmp(argv[i], "--multithread") == 0) {
+      options.isMultithreaded = true;
+    } else if (std::strcmp(argv[i], "--no-simd") == 0) {
+      options.isVectorized = false;
+    } else if (std::strcmp(argv[i], "--no-pins") == 0) {
+      options.isPinned = false;
+    } else {
+      return false;
+    }
+  }
+  return options.steps > 0 && options.deltaTime >= 0.0f && options.resolution >= 3;
+}
+}  // namespace
+
+// Simulate every combination of the given coefficients side by side and print one CSV row of metrics per instance.
+int main(int argc, char** argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (options.deltaTime > 0.0f) deltaTime = options.deltaTime;
+  isMultithreaded = options.isMultithreaded;
+  isVectorized = options.isVectorized;
+  springTypeScale = options.springTypeScale;
+  damperTypeScale = options.damperTypeScale;
+
+  std::vector<ClothMaterial> materials;
+  for (float spring : options.springCoefs) {
+    for (float damper : options.damperCoefs) {
+      for (float viscous : options.viscousCoefs) materials.push_back({spring, damper, viscous});
+    }
+  }
+  // Same scene as HW1: the cloth falls onto a unit sphere at the origin.
+  ClothBatch batch(options.resolution, std::move(materials), options.isPinned);
+  batch.addSphere(Eigen::Vector4f(0, 0, 0, 1), 1.0f);
+
+  auto begin = std::chrono::steady_clock::now();
+  batch.step(options.steps);
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - begin).count();
+
+  std::cout << "instance,spring_coef,damper_coef,viscous_coef,max_strain,kinetic_energy,max_speed,mean_height,stable"
+            << std::endl;
+  for (int i = 0; i < batch.size(); ++i) {
+    const ClothMaterial& material = batch.material(i);
+    const ClothBatch::Metrics& metrics = batch.metrics(i);
+    std::cout << i << ',' << material.springCoef << ',' << material.damperCoef << ',' << material.viscousCoef << ','
+              << metrics.maxStrain << ',' << metrics.kineticEnergy << ',' << metrics.maxSpeed << ','
+              << metrics.meanHeight << ',' << (metrics.isStable ? 1 : 0) << std::endl;
+  }
+  int threads = isMultithreaded ? ThreadPool::getPool().size() : 1;
+  std::cerr << batch.size() << " instances x " << options.steps << " steps on " << threads << " threads in " << seconds
+            << " s" << std::endl;
+  return 0;
+}
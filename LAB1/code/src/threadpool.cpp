@@ -0,0 +1,71 @@
+#include "threadpool.h"
+
+#include <algorithm>
+
+namespace {
+// Begin of the chunk-th part when [0, count) is split into chunkCount parts.
+int chunkBegin(int count, int chunk, int chunkCount) {
+  return static_cast<int>(static_cast<long long>(count) * chunk / chunkCount);
+}
+}  // namespace
+
+ThreadPool::ThreadPool(int threadCount) {
+  // The calling thread always runs the first chunk
+  for (int i = 1; i < threadCount; ++i) workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    isStopping = true;
+  }
+  wakeCondition.notify_all();
+  for (auto& worker : workers) worker.join();
+}
+
+ThreadPool& ThreadPool::getPool() {
+  static ThreadPool pool(std::max(1, static_cast<int>(std::thread::hardware_concurrency())));
+  return pool;
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int, int)>& task, int grainSize) {
+  int chunks = std::min(size(), (count + std::max(1, grainSize) - 1) / std::max(1, grainSize));
+  if (chunks <= 1) {
+    if (count > 0) task(0, count);
+    return;
+  }
+  std::lock_guard<std::mutex> callerLock(callerMutex);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    currentTask = &task;
+    itemCount = count;
+    chunkCount = chunks;
+    pendingChunks = chunks - 1;
+    ++generation;
+  }
+  wakeCondition.notify_all();
+  task(0, chunkBegin(count, 1, chunks));
+
+  std::unique_lock<std::mutex> lock(mutex);
+  doneCondition.wait(lock, [this] { return pendingChunks == 0; });
+  currentTask = nullptr;
+}
+
+void ThreadPool::workerLoop(int chunk) {
+  unsigned int seenGeneration = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    wakeCondition.wait(lock, [&] { return isStopping || generation != seenGeneration; });
+    if (isStopping) return;
+    seenGeneration = generation;
+    // Small jobs do not need every worker
+    if (chunk >= chunkCount) continue;
+    const std::function<void(int, int)>* task = currentTask;
+    int begin = chunkBegin(itemCount, chunk, chunkCount);
+    int end = chunkBegin(itemCount, chunk + 1, chunkCount);
+    lock.unlock();
+    (*task)(begin, end);
+    lock.lock();
+    if (--pendingChunks == 0) doneCondition.notify_one();
+  }
+}